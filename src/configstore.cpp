@@ -0,0 +1,389 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Log-structured key-value store for the configuration
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "configstore.h"
+#ifdef ESP_PLATFORM
+#include <esp_rom_crc.h>
+#endif
+
+#define CONFIG_STORE_MAGIC 0x55444B31   // "UDK1"
+#define CONFIG_RECORD_MARKER 0xC5
+#define CONFIG_RECORD_SEAL 0x01         // The records before it form a complete store
+#define CONFIG_RECORD_REMOVED 0x02
+
+// Start of both files, the higher generation is the newer one
+struct Config_File_Header {
+  uint32_t magic;
+  uint32_t generation;
+};
+
+// Header of every record, its key and value follow
+struct Config_Record {
+  uint8_t marker;
+  uint8_t flags;
+  uint8_t keyLength;
+  uint8_t valueLength;
+  uint32_t crc;         // Of the flags, lengths, key and value
+};
+
+static uint32_t configCrc(uint32_t crc, const uint8_t *data, size_t length) {
+#ifdef ESP_PLATFORM
+  return esp_rom_crc32_le(crc, data, length);
+#else
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+#endif
+}
+
+static uint32_t configRecordCrc(const Config_Record &record, const uint8_t *data) {
+  uint32_t crc = configCrc(0, &record.flags, 3);
+  return configCrc(crc, data, record.keyLength + record.valueLength);
+}
+
+// FNV-1a
+static uint32_t configHash(const char *key) {
+  uint32_t hash = 2166136261UL;
+  while (*key) {
+    hash = (hash ^ (uint8_t)*key++) * 16777619UL;
+  }
+  return hash;
+}
+
+static void configFileName(uint8_t slot, char *name) {
+  sprintf(name, Default_Config_Store_File, slot);
+}
+
+ConfigStore::ConfigStore()
+  : m_file()
+  , m_slot(0)
+  , m_generation(0)
+  , m_size(0)
+  , m_stale(0)
+  , m_entries()
+  , m_count(0)
+  , m_begun(false)
+  , m_stats()
+{
+}
+
+bool ConfigStore::begin() {
+  unsigned long start = micros();
+  m_begun = true;
+  char name[24];
+  uint32_t generations[2] = { 0, 0 };
+  for (uint8_t slot = 0; slot < 2; slot++) {
+    configFileName(slot, name);
+    File file = SPIFFS.open(name, FILE_READ);
+    Config_File_Header header;
+    if (file && (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)) && (header.magic == CONFIG_STORE_MAGIC)) {
+      generations[slot] = header.generation;
+    }
+    file.close();
+  }
+
+  // The newer file is only complete when it is sealed, a compaction may have been cut short
+  uint8_t slot = (generations[1] > generations[0]) ? 1 : 0;
+  uint32_t valid = generations[slot] ? scan(slot) : 0;
+  if (!valid && generations[slot ^ 1]) {
+    slot ^= 1;
+    valid = scan(slot);
+  }
+  if (!valid) {
+    m_count = 0;
+    m_stale = 0;
+    m_generation = std::max(generations[0], generations[1]);
+    return compact();
+  }
+
+  // The other file is either older or torn
+  configFileName(slot ^ 1, name);
+  SPIFFS.remove(name);
+  m_stats.loadTime = micros() - start;
+  // A torn record at the end would hide whatever is appended after it
+  if (valid < m_size) {
+    return compact();
+  }
+  return true;
+}
+
+void ConfigStore::loop() {
+  if (m_begun && (m_size > Default_Config_Store_Size) && (m_stale > m_size / 2)) {
+    compact();
+  }
+}
+
+bool ConfigStore::exists(const char *key) {
+  return ready() && find(key, configHash(key)) != NULL;
+}
+
+bool ConfigStore::get(const char *key, void *value, size_t size) {
+  Config_Entry *entry = ready() ? find(key, configHash(key)) : NULL;
+  if (!entry || (entry->length != size)) {
+    return false;
+  }
+  uint8_t buffer[Default_Config_Value_Size];
+  if (!readValue(entry, buffer)) {
+    return false;
+  }
+  memcpy(value, buffer, size);
+  return true;
+}
+
+bool ConfigStore::getString(const char *key, char *value, size_t size) {
+  Config_Entry *entry = ready() ? find(key, configHash(key)) : NULL;
+  uint8_t buffer[Default_Config_Value_Size];
+  if (!size || !entry || !readValue(entry, buffer)) {
+    return false;
+  }
+  size_t length = std::min((size_t)entry->length, size - 1);
+  memcpy(value, buffer, length);
+  value[length] = '\0';
+  return true;
+}
+
+bool ConfigStore::set(const char *key, const void *value, size_t size) {
+  if ((strlen(key) >= Default_Config_Key_Size) || (size > Default_Config_Value_Size) || !ready()) {
+    return false;
+  }
+  Config_Entry *entry = find(key, configHash(key));
+  if (entry && (entry->length == size)) {
+    uint8_t buffer[Default_Config_Value_Size];
+    if (readValue(entry, buffer) && !memcmp(buffer, value, size)) {
+      m_stats.skipped++;
+      return true;
+    }
+  }
+  if (!append(0, key, value, size)) {
+    return false;
+  }
+  m_stats.updated += size;
+  return true;
+}
+
+bool ConfigStore::remove(const char *key) {
+  return !exists(key) || append(CONFIG_RECORD_REMOVED, key, NULL, 0);
+}
+
+bool ConfigStore::clear() {
+  ready();
+  m_count = 0;
+  return compact();
+}
+
+Config_Version ConfigStore::version() {
+  Config_Version version = { m_generation, m_size };
+  if (m_begun) {
+    return version;
+  }
+  // The same file begin() would pick first, a torn one only makes the version differ
+  char name[24];
+  for (uint8_t slot = 0; slot < 2; slot++) {
+    configFileName(slot, name);
+    File file = SPIFFS.open(name, FILE_READ);
+    Config_File_Header header;
+    if (file && (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)) && (header.magic == CONFIG_STORE_MAGIC)
+      && (header.generation > version.generation)) {
+      version.generation = header.generation;
+      version.size = file.size();
+    }
+    file.close();
+  }
+  return version;
+}
+
+// Writes the live records and a seal into the other file, which then replaces the active one
+bool ConfigStore::compact() {
+  char name[24];
+  uint8_t slot = m_slot ^ 1;
+  configFileName(slot, name);
+  File file = SPIFFS.open(name, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  Config_File_Header header = { CONFIG_STORE_MAGIC, m_generation + 1 };
+  bool result = (file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header));
+  uint32_t size = sizeof(header);
+  uint8_t buffer[sizeof(Config_Record) + Default_Config_Key_Size + Default_Config_Value_Size];
+  uint32_t offsets[Default_Config_Store_Keys];
+  for (uint8_t i = 0; i < m_count && result; i++) {
+    Config_Record *record = (Config_Record *)buffer;
+    result = m_file.seek(m_entries[i].offset) && (m_file.read(buffer, sizeof(Config_Record)) == sizeof(Config_Record));
+    size_t length = sizeof(Config_Record) + (result ? record->keyLength + record->valueLength : 0);
+    result = result && (m_file.read(buffer + sizeof(Config_Record), length - sizeof(Config_Record)) == length - sizeof(Config_Record))
+      && (file.write(buffer, length) == length);
+    offsets[i] = size;
+    size += length;
+  }
+  Config_Record seal = { CONFIG_RECORD_MARKER, CONFIG_RECORD_SEAL, 0, 0, 0 };
+  seal.crc = configRecordCrc(seal, NULL);
+  result = result && (file.write((const uint8_t *)&seal, sizeof(seal)) == sizeof(seal));
+  size += sizeof(seal);
+  file.flush();
+  file.close();
+  if (!result) {
+    SPIFFS.remove(name);
+    return false;
+  }
+
+  m_file.close();
+  configFileName(m_slot, name);
+  SPIFFS.remove(name);
+  for (uint8_t i = 0; i < m_count; i++) {
+    m_entries[i].offset = offsets[i];
+  }
+  m_stats.written += size;
+  m_stats.compactions++;
+  m_stale = 0;
+  m_size = size;
+  return open(slot, m_generation + 1);
+}
+
+bool ConfigStore::open(uint8_t slot, uint32_t generation) {
+  char name[24];
+  configFileName(slot, name);
+  m_file = SPIFFS.open(name, "a+");
+  m_slot = slot;
+  m_generation = generation;
+  return m_file;
+}
+
+// Indexes a file up to its last intact record, returns where that is or 0 when the file
+// is not sealed
+uint32_t ConfigStore::scan(uint8_t slot) {
+  char name[24];
+  configFileName(slot, name);
+  File file = SPIFFS.open(name, FILE_READ);
+  Config_File_Header header;
+  if (!file || (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header))) {
+    return 0;
+  }
+  uint32_t size = file.size();
+  uint32_t offset = sizeof(header);
+  bool sealed = false;
+  m_file = file;
+  m_count = 0;
+  m_stale = 0;
+  uint8_t data[Default_Config_Key_Size + Default_Config_Value_Size];
+  Config_Record record;
+  while ((file.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) && (record.marker == CONFIG_RECORD_MARKER)
+    && (record.keyLength < Default_Config_Key_Size) && (offset + sizeof(record) + record.keyLength + record.valueLength <= size)
+    && (file.read(data, record.keyLength + record.valueLength) == (size_t)(record.keyLength + record.valueLength))
+    && (configRecordCrc(record, data) == record.crc)) {
+    uint32_t length = sizeof(record) + record.keyLength + record.valueLength;
+    if (record.flags & CONFIG_RECORD_SEAL) {
+      sealed = true;
+    }
+    else {
+      char key[Default_Config_Key_Size];
+      memcpy(key, data, record.keyLength);
+      key[record.keyLength] = '\0';
+      // Seeks to read back colliding keys, the scan resumes after the record
+      Config_Entry *entry = find(key, configHash(key));
+      file.seek(offset + length);
+      if (entry) {
+        m_stale += sizeof(record) + record.keyLength + entry->length;
+      }
+      if (record.flags & CONFIG_RECORD_REMOVED) {
+        m_stale += length;
+        if (entry) {
+          *entry = m_entries[--m_count];
+        }
+      }
+      else if (entry || (m_count < Default_Config_Store_Keys)) {
+        entry = entry ? entry : &m_entries[m_count++];
+        entry->hash = configHash(key);
+        entry->offset = offset;
+        entry->length = record.valueLength;
+      }
+    }
+    offset += length;
+  }
+  file.close();
+  m_file = File();
+  if (!sealed) {
+    return 0;
+  }
+  m_size = size;
+  return open(slot, header.generation) ? offset : 0;
+}
+
+bool ConfigStore::append(uint8_t flags, const char *key, const void *value, size_t size) {
+  uint8_t buffer[sizeof(Config_Record) + Default_Config_Key_Size + Default_Config_Value_Size];
+  Config_Record *record = (Config_Record *)buffer;
+  uint32_t hash = configHash(key);
+  Config_Entry *entry = find(key, hash);
+  if (!entry && !(flags & CONFIG_RECORD_REMOVED) && (m_count >= Default_Config_Store_Keys)) {
+    return false;
+  }
+  record->marker = CONFIG_RECORD_MARKER;
+  record->flags = flags;
+  record->keyLength = strlen(key);
+  record->valueLength = size;
+  memcpy(buffer + sizeof(Config_Record), key, record->keyLength);
+  if (size) {
+    memcpy(buffer + sizeof(Config_Record) + record->keyLength, value, size);
+  }
+  record->crc = configRecordCrc(*record, buffer + sizeof(Config_Record));
+  size_t length = sizeof(Config_Record) + record->keyLength + size;
+
+  m_file.seek(0, SeekEnd);
+  if (m_file.write(buffer, length) != length) {
+    return false;
+  }
+  m_file.flush();
+  m_stats.written += length;
+
+  if (entry) {
+    m_stale += sizeof(Config_Record) + record->keyLength + entry->length;
+  }
+  if (flags & CONFIG_RECORD_REMOVED) {
+    m_stale += length;
+    if (entry) {
+      *entry = m_entries[--m_count];
+    }
+  }
+  else {
+    entry = entry ? entry : &m_entries[m_count++];
+    entry->hash = hash;
+    entry->offset = m_size;
+    entry->length = size;
+  }
+  m_size += length;
+  return true;
+}
+
+// Entries only hold the hash, a match is confirmed against the key in the record
+Config_Entry *ConfigStore::find(const char *key, uint32_t hash) {
+  size_t keyLength = strlen(key);
+  for (uint8_t i = 0; i < m_count; i++) {
+    if (m_entries[i].hash != hash) {
+      continue;
+    }
+    Config_Record record;
+    char stored[Default_Config_Key_Size];
+    if (m_file.seek(m_entries[i].offset) && (m_file.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
+      && (record.keyLength == keyLength) && (m_file.read((uint8_t *)stored, keyLength) == keyLength)
+      && !memcmp(stored, key, keyLength)) {
+      return &m_entries[i];
+    }
+  }
+  return NULL;
+}
+
+bool ConfigStore::readValue(const Config_Entry *entry, uint8_t *value) {
+  Config_Record record;
+  return m_file.seek(entry->offset) && (m_file.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
+    && m_file.seek(entry->offset + sizeof(record) + record.keyLength)
+    && (m_file.read(value, entry->length) == entry->length);
+}
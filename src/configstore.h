@@ -0,0 +1,105 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Log-structured key-value store for the configuration
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef configstore_h
+#define configstore_h
+
+#include <Arduino.h>
+#include <FS.h>
+#include <SPIFFS.h>
+
+#define Default_Config_Store_File "/cfgkv%u.bin"  // Two files, compaction writes the other one
+#define Default_Config_Store_Keys 64
+#define Default_Config_Store_Size 8192      // Compaction is considered once the log is larger
+#define Default_Config_Key_Size 32          // Longest key plus one
+#define Default_Config_Value_Size 255
+
+// Store counters, sizes are in bytes
+struct Config_Stats {
+  uint32_t updated;         // Value bytes that changed
+  uint32_t written;         // Written to flash, records and compaction included
+  uint32_t skipped;         // Writes of an unchanged value
+  uint32_t compactions;
+  uint32_t loadTime;        // Microseconds begin() took to index the log
+};
+
+// Changes with every record written and every compaction, a copy taken from the store is
+// current only while the version is the same
+struct Config_Version {
+  uint32_t generation;
+  uint32_t size;
+  inline bool operator==(const Config_Version &other) const { return (generation == other.generation) && (size == other.size); }
+  inline bool operator!=(const Config_Version &other) const { return !(*this == other); }
+};
+
+// Index entry of the newest record of a key
+struct Config_Entry {
+  uint32_t hash;
+  uint32_t offset;
+  uint8_t length;
+};
+
+// Keys and their values as an append-only log of CRC checked records. A write appends a
+// record for the one key that changed and only moves its index entry, the file is never
+// rewritten in place, so losing power leaves either the old or the new value. Compaction
+// copies the live records into the other file and seals it before the old one is removed,
+// it runs from loop() once the log has grown and is mostly stale. The index keeps the
+// offset of every key, a read is one seek. Nothing is read before the first use, so a
+// boot served from elsewhere does not pay for indexing.
+class ConfigStore
+{
+  public:
+    ConfigStore();
+
+    // Picks the newest sealed file and indexes it, creates one if there is none. Runs on
+    // first use unless called before.
+    bool begin();
+    // Compacts when due, call it from the main loop.
+    void loop();
+
+    bool exists(const char *key);
+    // False unless the stored value has exactly size bytes.
+    bool get(const char *key, void *value, size_t size);
+    // Cut to size, always terminated.
+    bool getString(const char *key, char *value, size_t size);
+    // Appends only when the value differs from the stored one.
+    bool set(const char *key, const void *value, size_t size);
+    inline bool setString(const char *key, const char *value) { return set(key, value, strlen(value)); }
+    bool remove(const char *key);
+    // Drops every key.
+    bool clear();
+    bool compact();
+    // Read from the file headers when the store has not begun, nothing is indexed.
+    Config_Version version();
+
+    template<typename T> inline bool get(const char *key, T &value) { return get(key, &value, sizeof(T)); }
+    template<typename T> inline bool set(const char *key, const T &value) { return set(key, &value, sizeof(T)); }
+
+    inline uint8_t count() { return ready() ? m_count : 0; }
+    inline const Config_Stats &stats() const { return m_stats; }
+
+  private:
+    inline bool ready() { return m_begun || begin(); }
+    bool open(uint8_t slot, uint32_t generation);
+    uint32_t scan(uint8_t slot);
+    bool append(uint8_t flags, const char *key, const void *value, size_t size);
+    Config_Entry *find(const char *key, uint32_t hash);
+    bool readValue(const Config_Entry *entry, uint8_t *value);
+
+    File m_file;                  // Active log, read and appended
+    uint8_t m_slot;
+    uint32_t m_generation;
+    uint32_t m_size;
+    uint32_t m_stale;             // Bytes of records overwritten or removed since
+    Config_Entry m_entries[Default_Config_Store_Keys];
+    uint8_t m_count;
+    bool m_begun;
+    Config_Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,132 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Buffered serial console
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "console.h"
+
+Console::Console()
+  : m_buffer()
+  , m_head(0)
+  , m_tail(0)
+  , m_used(0)
+  , m_policy(CONSOLE_DROP_OLDEST)
+  , m_stats()
+  , m_lock(portMUX_INITIALIZER_UNLOCKED)
+  , m_task(NULL)
+  , m_output(NULL)
+{
+}
+
+bool Console::begin(Print &output, Console_Policy policy) {
+  m_output = &output;
+  m_policy = policy;
+  if (!m_task && (xTaskCreate(drainTask, "console", Default_Console_Task_Stack, this,
+      Default_Console_Task_Priority, &m_task) != pdPASS)) {
+    m_task = NULL;
+    return false;
+  }
+  xTaskNotifyGive(m_task);
+  return true;
+}
+
+size_t Console::write(uint8_t c) {
+  return queue(&c, 1, NULL, 0);
+}
+
+size_t Console::write(const uint8_t *buffer, size_t size) {
+  return queue(buffer, size, NULL, 0);
+}
+
+size_t Console::line(const char *text) {
+  return queue((const uint8_t *)text, strlen(text), (const uint8_t *)"\r\n", 2);
+}
+
+void Console::flush() {
+  unsigned long start = millis();
+  while (m_used && m_task && (millis() - start < Default_Console_Flush_Timeout)) {
+    delay(1);
+  }
+  if (m_output) {
+    m_output->flush();
+  }
+}
+
+size_t Console::queue(const uint8_t *data, size_t size, const uint8_t *end, size_t endSize) {
+  size_t total = size + endSize;
+  if (!total) {
+    return 0;
+  }
+  bool fits = true;
+  portENTER_CRITICAL(&m_lock);
+  size_t space = sizeof(m_buffer) - m_used;
+  if (total > space) {
+    if ((m_policy == CONSOLE_DROP_NEWEST) || (total > sizeof(m_buffer))) {
+      m_stats.dropped += total;
+      fits = false;
+    }
+    else {
+      // Up to the end of a line, the output should not resume in the middle of one
+      size_t discard = total - space;
+      while ((discard < m_used) && (m_buffer[(m_tail + discard - 1) % sizeof(m_buffer)] != '\n')) {
+        discard++;
+      }
+      m_tail = (m_tail + discard) % sizeof(m_buffer);
+      m_used -= discard;
+      m_stats.dropped += discard;
+    }
+    m_stats.drops++;
+  }
+  if (fits) {
+    copyIn(data, size);
+    copyIn(end, endSize);
+    m_stats.written += total;
+    m_stats.highWater = std::max(m_stats.highWater, (uint32_t)m_used);
+  }
+  portEXIT_CRITICAL(&m_lock);
+
+  if (fits && m_task) {
+    xTaskNotifyGive(m_task);
+  }
+  return fits ? size : 0;
+}
+
+// Called with the lock held and enough space
+void Console::copyIn(const uint8_t *data, size_t size) {
+  while (size) {
+    size_t part = std::min(size, sizeof(m_buffer) - m_head);
+    memcpy(m_buffer + m_head, data, part);
+    m_head = (m_head + part) % sizeof(m_buffer);
+    m_used += part;
+    data += part;
+    size -= part;
+  }
+}
+
+void Console::drainTask(void *console) {
+  static_cast<Console *>(console)->drain();
+}
+
+// The lock is only held to take a chunk out, the output may block as long as it likes
+void Console::drain() {
+  uint8_t chunk[Default_Console_Chunk];
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    for (;;) {
+      portENTER_CRITICAL(&m_lock);
+      size_t size = std::min((size_t)m_used, sizeof(chunk));
+      size = std::min(size, sizeof(m_buffer) - m_tail);
+      memcpy(chunk, m_buffer + m_tail, size);
+      m_tail = (m_tail + size) % sizeof(m_buffer);
+      m_used -= size;
+      portEXIT_CRITICAL(&m_lock);
+      if (!size) {
+        break;
+      }
+      m_output->write(chunk, size);
+    }
+  }
+}
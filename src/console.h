@@ -0,0 +1,73 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Buffered serial console
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef console_h
+#define console_h
+
+#include <Arduino.h>
+
+#define Default_Console_Buffer 2048         // Bytes waiting for the output
+#define Default_Console_Chunk 64            // Bytes handed to the output at once
+#define Default_Console_Task_Stack 2048
+#define Default_Console_Task_Priority 1     // Not above the loop task
+#define Default_Console_Flush_Timeout 500   // Longest wait in flush(), milliseconds
+
+enum Console_Policy {
+  CONSOLE_DROP_OLDEST,      // Room is made by discarding the oldest lines
+  CONSOLE_DROP_NEWEST       // Writes that do not fit are discarded
+};
+
+// Console counters, in bytes unless noted
+struct Console_Stats {
+  uint32_t written;         // Queued for the output
+  uint32_t dropped;         // Discarded for lack of room
+  uint32_t drops;           // Number of times something was discarded
+  uint32_t highWater;       // Most ever buffered at once
+};
+
+// Print that never waits for the UART. Writes are copied into a ring buffer and a low
+// priority task hands them to the output, so logging costs the caller a copy and a full
+// buffer loses console output instead of stalling the control loop. Each write is kept or
+// discarded as a whole, line() queues a line with its end in one write.
+class Console : public Print
+{
+  public:
+    Console();
+
+    // Starts the task draining into output, what was written before is kept.
+    bool begin(Print &output, Console_Policy policy = CONSOLE_DROP_OLDEST);
+    inline void setPolicy(Console_Policy policy) { m_policy = policy; }
+    inline Console_Policy policy() const { return m_policy; }
+
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    size_t line(const char *text);
+    // Waits until the buffer drained, before a reboot.
+    void flush() override;
+
+    inline const Console_Stats &stats() const { return m_stats; }
+
+  private:
+    size_t queue(const uint8_t *data, size_t size, const uint8_t *end, size_t endSize);
+    void copyIn(const uint8_t *data, size_t size);
+    static void drainTask(void *console);
+    void drain();
+
+    uint8_t m_buffer[Default_Console_Buffer];
+    size_t m_head;                // Next byte written
+    size_t m_tail;                // Next byte drained
+    volatile size_t m_used;
+    Console_Policy m_policy;
+    Console_Stats m_stats;
+    portMUX_TYPE m_lock;
+    TaskHandle_t m_task;
+    Print *m_output;
+};
+
+#endif
@@ -0,0 +1,322 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Hostname resolver cache for the broker connection
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "dnscache.h"
+#include <FS.h>
+#include <SPIFFS.h>
+
+#define DNS_CACHE_MAGIC 0x444E5331  // "DNS1"
+#define DNS_PORT 53
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+
+// Persisted last known good address
+struct DNS_Record {
+  char host[64];
+  uint32_t ip;
+};
+
+// Skips a possibly compressed name, pos ends right after it
+static bool dnsSkipName(const uint8_t *packet, size_t length, size_t &pos) {
+  while (pos < length) {
+    uint8_t label = packet[pos];
+    if ((label & 0xC0) == 0xC0) {
+      pos += 2;
+      return pos <= length;
+    }
+    pos++;
+    if (!label) {
+      return true;
+    }
+    pos += label;
+  }
+  return false;
+}
+
+DNSCache::DNSCache()
+  : m_entries()
+  , m_udp()
+  , m_server()
+  , m_id(0)
+  , m_pending(-1)
+  , m_attempt(0)
+  , m_sentAt(0)
+  , m_startedAt(0)
+  , m_stats()
+{
+}
+
+void DNSCache::begin() {
+  File file = SPIFFS.open(Default_DNS_Cache_File, FILE_READ);
+  if (!file) {
+    return;
+  }
+  uint32_t magic = 0;
+  if ((file.read((uint8_t *)&magic, sizeof(magic)) == sizeof(magic)) && (magic == DNS_CACHE_MAGIC)) {
+    DNS_Record record;
+    while (file.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) {
+      if (!memchr(record.host, '\0', sizeof(record.host)) || !record.ip) {
+        continue;
+      }
+      DNS_Entry *entry = insert(record.host);
+      // Usable right away but refreshed on first use
+      entry->ip = record.ip;
+      entry->fresh = false;
+    }
+  }
+  file.close();
+}
+
+void DNSCache::loop() {
+  if (m_pending < 0) {
+    return;
+  }
+  uint32_t ip, ttl;
+  if (receive(ip, ttl)) {
+    update(&m_entries[m_pending], ip, ttl);
+    m_udp.stop();
+    m_pending = -1;
+  }
+  else if (millis() - m_sentAt > Default_DNS_Timeout) {
+    if ((++m_attempt >= Default_DNS_Retries) || !send(m_entries[m_pending].host)) {
+      m_stats.failures++;
+      m_udp.stop();
+      m_pending = -1;
+    }
+  }
+}
+
+bool DNSCache::resolve(const char *host, IPAddress &ip) {
+  if (ip.fromString(host)) {
+    return true;
+  }
+
+  DNS_Entry *entry = find(host);
+  if (entry && !entry->failed) {
+    ip = entry->ip;
+    if (entry->fresh && ((long)(millis() - entry->expires) < 0)) {
+      m_stats.hits++;
+      return true;
+    }
+    m_stats.staleHits++;
+    if (m_pending < 0) {
+      m_pending = entry - m_entries;
+      m_attempt = 0;
+      m_startedAt = millis();
+      if (!send(host)) {
+        m_udp.stop();
+        m_pending = -1;
+      }
+    }
+    return true;
+  }
+
+  // Nothing usable, a running refresh gives way to the blocking query
+  if (m_pending >= 0) {
+    m_udp.stop();
+    m_pending = -1;
+  }
+  uint32_t address, ttl;
+  if (query(host, address, ttl)) {
+    entry = entry ? entry : insert(host);
+    update(entry, address, ttl);
+    ip = address;
+    return true;
+  }
+  if (entry) {
+    m_stats.fallbacks++;
+    ip = entry->ip;
+    return true;
+  }
+  return false;
+}
+
+void DNSCache::invalidate(const char *host) {
+  DNS_Entry *entry = find(host);
+  if (entry) {
+    entry->failed = true;
+  }
+}
+
+DNS_Entry *DNSCache::find(const char *host) {
+  for (uint8_t i = 0; i < Default_DNS_Cache_Size; i++) {
+    if (m_entries[i].ip && !strcmp(m_entries[i].host, host)) {
+      return &m_entries[i];
+    }
+  }
+  return NULL;
+}
+
+// Takes a free slot or the one expiring first
+DNS_Entry *DNSCache::insert(const char *host) {
+  DNS_Entry *entry = &m_entries[0];
+  for (uint8_t i = 0; i < Default_DNS_Cache_Size; i++) {
+    if (!m_entries[i].ip) {
+      entry = &m_entries[i];
+      break;
+    }
+    if (!m_entries[i].fresh || ((long)(m_entries[i].expires - entry->expires) < 0)) {
+      entry = &m_entries[i];
+    }
+  }
+  if ((m_pending >= 0) && (entry == &m_entries[m_pending])) {
+    m_udp.stop();
+    m_pending = -1;
+  }
+  memset(entry, 0, sizeof(DNS_Entry));
+  strlcpy(entry->host, host, sizeof(entry->host));
+  return entry;
+}
+
+bool DNSCache::query(const char *host, uint32_t &ip, uint32_t &ttl) {
+  m_startedAt = millis();
+  bool result = false;
+  for (m_attempt = 0; !result && (m_attempt < Default_DNS_Retries); m_attempt++) {
+    if (!send(host)) {
+      break;
+    }
+    while (!(result = receive(ip, ttl)) && (millis() - m_sentAt < Default_DNS_Timeout)) {
+      delay(10);
+    }
+  }
+  m_udp.stop();
+
+  // Without a known DNS server the system resolver is the only option, its TTL is unknown
+  IPAddress address;
+  if (!result && !m_server && WiFi.hostByName(host, address)) {
+    ip = address;
+    ttl = Default_DNS_Min_TTL;
+    result = true;
+  }
+  if (!result) {
+    m_stats.failures++;
+  }
+  return result;
+}
+
+bool DNSCache::send(const char *host) {
+  m_server = WiFi.dnsIP(0);
+  if (!m_server) {
+    return false;
+  }
+
+  uint8_t packet[Default_DNS_Packet_Size];
+  size_t length = 12;
+  m_id = (uint16_t)(micros() ^ (millis() << 4));
+  memset(packet, 0, length);
+  packet[0] = m_id >> 8;
+  packet[1] = m_id & 0xFF;
+  packet[2] = 0x01;     // Recursion desired
+  packet[5] = 1;        // One question
+  const char *label = host;
+  while (*label) {
+    const char *dot = strchr(label, '.');
+    size_t size = dot ? (size_t)(dot - label) : strlen(label);
+    if (!size || (size > 63) || (length + size + 6 > sizeof(packet))) {
+      return false;
+    }
+    packet[length++] = size;
+    memcpy(packet + length, label, size);
+    length += size;
+    label += size + (dot ? 1 : 0);
+  }
+  packet[length++] = 0;
+  packet[length++] = 0;
+  packet[length++] = DNS_TYPE_A;
+  packet[length++] = 0;
+  packet[length++] = DNS_CLASS_IN;
+
+  m_stats.queries++;
+  m_sentAt = millis();
+  return m_udp.beginPacket(m_server, DNS_PORT) && (m_udp.write(packet, length) == length) && m_udp.endPacket();
+}
+
+// Takes the first A record of the answer, the TTL is the lowest along the CNAME chain
+bool DNSCache::receive(uint32_t &ip, uint32_t &ttl) {
+  int size = m_udp.parsePacket();
+  if (size <= 0) {
+    return false;
+  }
+  uint8_t packet[Default_DNS_Packet_Size];
+  size_t length = m_udp.read(packet, sizeof(packet));
+  if ((m_udp.remoteIP() != m_server) || (m_udp.remotePort() != DNS_PORT) || (length < 12)
+    || (((packet[0] << 8) | packet[1]) != m_id) || !(packet[2] & 0x80)) {
+    return false;
+  }
+  if (packet[3] & 0x0F) {
+    // Answered with an error, no point in waiting for the timeout
+    m_sentAt -= Default_DNS_Timeout;
+    return false;
+  }
+
+  uint16_t questions = (packet[4] << 8) | packet[5];
+  uint16_t answers = (packet[6] << 8) | packet[7];
+  size_t pos = 12;
+  for (uint16_t i = 0; i < questions; i++) {
+    if (!dnsSkipName(packet, length, pos)) {
+      return false;
+    }
+    pos += 4;
+  }
+  uint32_t lowest = Default_DNS_Max_TTL;
+  for (uint16_t i = 0; i < answers; i++) {
+    if (!dnsSkipName(packet, length, pos) || (pos + 10 > length)) {
+      return false;
+    }
+    uint16_t type = (packet[pos] << 8) | packet[pos + 1];
+    uint16_t klass = (packet[pos + 2] << 8) | packet[pos + 3];
+    uint32_t recordTtl = ((uint32_t)packet[pos + 4] << 24) | ((uint32_t)packet[pos + 5] << 16) | (packet[pos + 6] << 8) | packet[pos + 7];
+    uint16_t rdLength = (packet[pos + 8] << 8) | packet[pos + 9];
+    pos += 10;
+    if (pos + rdLength > length) {
+      return false;
+    }
+    lowest = std::min(lowest, recordTtl);
+    if ((type == DNS_TYPE_A) && (klass == DNS_CLASS_IN) && (rdLength == 4)) {
+      ip = IPAddress(packet[pos], packet[pos + 1], packet[pos + 2], packet[pos + 3]);
+      ttl = std::max(lowest, (uint32_t)Default_DNS_Min_TTL);
+      m_stats.lastLatency = millis() - m_startedAt;
+      m_stats.totalLatency += m_stats.lastLatency;
+      return true;
+    }
+    pos += rdLength;
+  }
+  return false;
+}
+
+void DNSCache::update(DNS_Entry *entry, uint32_t ip, uint32_t ttl) {
+  bool changed = (entry->ip != ip);
+  entry->ip = ip;
+  entry->expires = millis() + ttl * 1000;
+  entry->fresh = true;
+  entry->failed = false;
+  // Flash is only written when the address is new
+  if (changed) {
+    save();
+  }
+}
+
+void DNSCache::save() {
+  File file = SPIFFS.open(Default_DNS_Cache_File, FILE_WRITE);
+  if (!file) {
+    return;
+  }
+  uint32_t magic = DNS_CACHE_MAGIC;
+  file.write((const uint8_t *)&magic, sizeof(magic));
+  for (uint8_t i = 0; i < Default_DNS_Cache_Size; i++) {
+    if (!m_entries[i].ip) {
+      continue;
+    }
+    DNS_Record record;
+    memset(&record, 0, sizeof(record));
+    strlcpy(record.host, m_entries[i].host, sizeof(record.host));
+    record.ip = m_entries[i].ip;
+    file.write((const uint8_t *)&record, sizeof(record));
+  }
+  file.close();
+}
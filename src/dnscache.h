@@ -0,0 +1,83 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Hostname resolver cache for the broker connection
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef dnscache_h
+#define dnscache_h
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+
+#define Default_DNS_Cache_Size 4
+#define Default_DNS_Cache_File "/dnscache.bin"
+#define Default_DNS_Timeout 2000      // Per attempt
+#define Default_DNS_Retries 2
+#define Default_DNS_Min_TTL 60        // Seconds, also used when the TTL is unknown
+#define Default_DNS_Max_TTL 86400
+#define Default_DNS_Packet_Size 512
+
+// Resolver counters, durations are in milliseconds
+struct DNS_Stats {
+  uint32_t queries;         // Queries sent, background refreshes included
+  uint32_t failures;        // Queries without an answer
+  uint32_t hits;            // Served from a fresh entry
+  uint32_t staleHits;       // Served from an expired entry while it is refreshed
+  uint32_t fallbacks;       // Served from the last known good address after a failed query
+  uint32_t lastLatency;     // Duration of the last answered query
+  uint32_t totalLatency;    // Sum of the answered query durations
+};
+
+struct DNS_Entry {
+  char host[64];
+  uint32_t ip;
+  unsigned long expires;    // millis() at which the TTL runs out
+  bool fresh;               // Answered within its TTL since boot
+  bool failed;              // Connecting to the address failed, resolve again before use
+};
+
+// Caches A records by their TTL. An expired entry is still handed out while a refresh
+// runs in the background from loop(), and the last known good addresses are kept in
+// SPIFFS so a reboot does not have to wait for the DNS server. Queries are sent to the
+// DNS server of the station interface directly, the system resolver does not expose TTLs.
+class DNSCache
+{
+  public:
+    DNSCache();
+
+    // Reads back the last known good addresses.
+    void begin();
+    // Polls the background refresh, call it from the main loop.
+    void loop();
+    // Address for host, blocks only when nothing usable is cached.
+    bool resolve(const char *host, IPAddress &ip);
+    // Connecting to the cached address of host failed, the next resolve queries again
+    // and falls back to the address only when the query fails.
+    void invalidate(const char *host);
+    inline const DNS_Stats &stats() const { return m_stats; }
+
+  private:
+    DNS_Entry *find(const char *host);
+    DNS_Entry *insert(const char *host);
+    bool query(const char *host, uint32_t &ip, uint32_t &ttl);
+    bool send(const char *host);
+    bool receive(uint32_t &ip, uint32_t &ttl);
+    void update(DNS_Entry *entry, uint32_t ip, uint32_t ttl);
+    void save();
+
+    DNS_Entry m_entries[Default_DNS_Cache_Size];
+    WiFiUDP m_udp;
+    IPAddress m_server;
+    uint16_t m_id;
+    int8_t m_pending;             // Entry refreshed in the background, -1 if none
+    uint8_t m_attempt;
+    unsigned long m_sentAt;
+    unsigned long m_startedAt;
+    DNS_Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,74 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Event queue from system callbacks to the main loop
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "eventqueue.h"
+
+static_assert((Default_Event_Queue_Size & (Default_Event_Queue_Size - 1)) == 0,
+  "Event queue size must be a power of two");
+
+EventQueue::EventQueue()
+  : m_head(0)
+  , m_tail(0)
+  , m_overflows(0)
+  , m_stats()
+{
+  // A slot is free for the push at position p when its sequence is p
+  for (uint32_t i = 0; i < Default_Event_Queue_Size; i++) {
+    m_slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool EventQueue::push(uint8_t type, uint8_t reason) {
+  uint32_t position = m_head.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &m_slots[position % Default_Event_Queue_Size];
+    int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) - position);
+    if (diff == 0) {
+      // Free, claimed once the head moves past it
+      if (m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if (diff < 0) {
+      // Still holds the event of the previous round
+      m_overflows.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else {
+      position = m_head.load(std::memory_order_relaxed);
+    }
+  }
+  slot->event.type = type;
+  slot->event.reason = reason;
+  slot->event.at = micros();
+  slot->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+bool EventQueue::pop(Event &event) {
+  Slot &slot = m_slots[m_tail % Default_Event_Queue_Size];
+  if ((int32_t)(slot.sequence.load(std::memory_order_acquire) - (m_tail + 1)) < 0) {
+    return false;
+  }
+  event = slot.event;
+  // Free for the push one round later
+  slot.sequence.store(m_tail + Default_Event_Queue_Size, std::memory_order_release);
+  m_tail++;
+
+  m_stats.handled++;
+  m_stats.lastLatency = micros() - event.at;
+  m_stats.maxLatency = std::max(m_stats.maxLatency, m_stats.lastLatency);
+  return true;
+}
+
+Event_Stats EventQueue::stats() const {
+  Event_Stats stats = m_stats;
+  stats.overflows = m_overflows.load(std::memory_order_relaxed);
+  return stats;
+}
@@ -0,0 +1,67 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Event queue from system callbacks to the main loop
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef eventqueue_h
+#define eventqueue_h
+
+#include <Arduino.h>
+#include <atomic>
+
+#define Default_Event_Queue_Size 16         // Power of two
+
+enum Event_Type {
+  EVENT_WIFI_CONNECTED,
+  EVENT_WIFI_DISCONNECTED,                  // With the reason reported by the driver
+  EVENT_WIFI_LOST_IP,
+  EVENT_WIFI_GOT_IP,
+  EVENT_PROVISION_DONE
+};
+
+struct Event {
+  uint8_t type;
+  uint8_t reason;
+  uint32_t at;                              // micros() when it was pushed
+};
+
+// Queue counters, latencies are in microseconds from push to pop
+struct Event_Stats {
+  uint32_t handled;
+  uint32_t overflows;                       // Pushes refused because the queue was full
+  uint32_t lastLatency;
+  uint32_t maxLatency;
+};
+
+// Bounded queue without locks, any number of tasks push and the main loop pops. Each slot
+// carries a sequence number that tells producers whether it is free and the consumer
+// whether it is filled, so a callback running in the event task never waits for the loop
+// and never blocks it. A push to a full queue fails and is counted.
+class EventQueue
+{
+  public:
+    EventQueue();
+
+    // Safe from any task.
+    bool push(uint8_t type, uint8_t reason = 0);
+    // Only from the main loop, false when the queue is empty.
+    bool pop(Event &event);
+    Event_Stats stats() const;
+
+  private:
+    struct Slot {
+      std::atomic<uint32_t> sequence;
+      Event event;
+    };
+
+    Slot m_slots[Default_Event_Queue_Size];
+    std::atomic<uint32_t> m_head;           // Next push
+    uint32_t m_tail;                        // Next pop
+    std::atomic<uint32_t> m_overflows;
+    Event_Stats m_stats;
+};
+
+#endif
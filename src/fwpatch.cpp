@@ -0,0 +1,127 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Streaming applier for delta firmware images
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "fwpatch.h"
+
+#define FIRMWARE_PATCH_MAGIC "UDP1"
+
+enum {
+  PATCH_MAGIC,
+  PATCH_SIZE,
+  PATCH_DIFF_SIZE,
+  PATCH_DIFF,
+  PATCH_EXTRA_SIZE,
+  PATCH_EXTRA,
+  PATCH_ADJUSTMENT,
+  PATCH_DONE,
+};
+
+void Firmware_Patch::begin(const esp_partition_t *source, Firmware_Stage &next) {
+  m_source = source;
+  m_next = &next;
+  memset(&m_state, 0, sizeof(m_state));
+}
+
+void Firmware_Patch::restore(const State &state) {
+  m_state = state;
+}
+
+bool Firmware_Patch::field(uint8_t b) {
+  m_state.value |= (uint32_t)(b & 0x7f) << m_state.shift;
+  m_state.shift += 7;
+  return !(b & 0x80);
+}
+
+bool Firmware_Patch::write(const uint8_t *data, size_t length) {
+  if (!m_source || !m_next) {
+    return false;
+  }
+  uint8_t buffer[256];
+  size_t i = 0;
+  while (i < length) {
+    switch (m_state.phase) {
+      case PATCH_MAGIC:
+        if (data[i++] != FIRMWARE_PATCH_MAGIC[m_state.value]) {
+          return false;
+        }
+        if (++m_state.value == strlen(FIRMWARE_PATCH_MAGIC)) {
+          m_state.value = 0;
+          m_state.phase = PATCH_SIZE;
+        }
+        continue;
+
+      case PATCH_DIFF:
+      case PATCH_EXTRA: {
+        size_t n = min(min(m_state.remaining, (uint32_t)(length - i)), (uint32_t)sizeof(buffer));
+        if (m_state.produced + n > m_state.size) {
+          return false;
+        }
+        if (m_state.phase == PATCH_DIFF) {
+          if (m_state.source + n > m_source->size || esp_partition_read(m_source, m_state.source, buffer, n) != ESP_OK) {
+            return false;
+          }
+          for (size_t j = 0; j < n; j++) {
+            buffer[j] += data[i + j];
+          }
+          m_state.source += n;
+        }
+        else {
+          memcpy(buffer, data + i, n);
+        }
+        if (!m_next->write(buffer, n)) {
+          return false;
+        }
+        i += n;
+        m_state.produced += n;
+        m_state.remaining -= n;
+        if (m_state.remaining == 0) {
+          m_state.phase = (m_state.phase == PATCH_DIFF) ? PATCH_EXTRA_SIZE : PATCH_ADJUSTMENT;
+        }
+        continue;
+      }
+
+      case PATCH_DONE:
+        // Trailing padding
+        return true;
+
+      default:
+        break;
+    }
+
+    // Varint fields, at most five bytes
+    if (m_state.shift > 28) {
+      return false;
+    }
+    if (!field(data[i++])) {
+      continue;
+    }
+    uint32_t value = m_state.value;
+    m_state.value = 0;
+    m_state.shift = 0;
+    switch (m_state.phase) {
+      case PATCH_SIZE:
+        m_state.size = value;
+        m_state.phase = value ? PATCH_DIFF_SIZE : PATCH_DONE;
+        break;
+      case PATCH_DIFF_SIZE:
+        m_state.remaining = value;
+        m_state.phase = value ? PATCH_DIFF : PATCH_EXTRA_SIZE;
+        break;
+      case PATCH_EXTRA_SIZE:
+        m_state.remaining = value;
+        m_state.phase = value ? PATCH_EXTRA : PATCH_ADJUSTMENT;
+        break;
+      case PATCH_ADJUSTMENT:
+        // Zigzag encoded signed offset
+        m_state.source += (value & 1) ? -(int32_t)((value >> 1) + 1) : (int32_t)(value >> 1);
+        m_state.phase = (m_state.produced < m_state.size) ? PATCH_DIFF_SIZE : PATCH_DONE;
+        break;
+    }
+  }
+  return true;
+}
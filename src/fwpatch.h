@@ -0,0 +1,62 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Streaming applier for delta firmware images
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef fwpatch_h
+#define fwpatch_h
+
+#include <Arduino.h>
+#include <esp_partition.h>
+
+// A step of the firmware write pipeline (decompression, flash).
+class Firmware_Stage
+{
+  public:
+    virtual bool write(const uint8_t *data, size_t length) = 0;
+};
+
+// Streaming applier for delta images (bsdiff style) against the running partition.
+// A patch is the magic "UDP1", the size of the new image as varint, then
+// records until the new image is complete:
+//   diff size (varint), diff bytes added to the old image at the source position,
+//   extra size (varint), extra bytes copied as is,
+//   adjustment (zigzag varint) added to the source position.
+// Varints are little endian base 128. Only a few counters have to be persisted.
+class Firmware_Patch : public Firmware_Stage
+{
+  public:
+    struct State {
+      uint8_t phase;
+      uint8_t shift;      // Varint bits read so far
+      uint32_t value;     // Varint value read so far
+      uint32_t remaining; // Bytes left in the current diff or extra block
+      uint32_t source;    // Read position in the running partition
+      uint32_t size;      // Size of the new image
+      uint32_t produced;  // Bytes of the new image produced so far
+    };
+
+    inline Firmware_Patch()
+      : m_source(NULL), m_next(NULL), m_state() { }
+
+    void begin(const esp_partition_t *source, Firmware_Stage &next);
+    void restore(const State &state);
+    bool write(const uint8_t *data, size_t length) override;
+    // Returns true once the whole new image was produced.
+    inline bool finished() const { return m_state.size && m_state.produced == m_state.size; }
+
+    inline const State &state() const { return m_state; }
+
+  private:
+    // Consumes one varint byte, returns true when the field is complete.
+    bool field(uint8_t b);
+
+    const esp_partition_t *m_source;
+    Firmware_Stage *m_next;
+    State m_state;
+};
+
+#endif
@@ -13,11 +13,20 @@
 #include <esp32-hal-log.h>
 #include <esp_int_wdt.h>
 #include <esp_task_wdt.h>
+#include <sys/time.h>
+#include <type_traits>
 #include <FS.h>
 #include <SPIFFS.h>
 #include <Arduino.h>
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
+#include <dnscache.h>
+#include <tlsclient.h>
+#include <logstore.h>
+#include <console.h>
+#include <eventqueue.h>
+#include <configstore.h>
+#include <loglevel.h>
 #include <ArduinoJson.h>
 #include <StreamUtils.h>
 #include <ArduinoOTA.h>
@@ -26,23 +35,71 @@
 
 #define countof(a) (sizeof(a) / sizeof(a[0]))
 #define COMPILED __DATE__ " " __TIME__
-#define LOG_REC_SIZE 10
+#define LOG_REC_SIZE 10                 // Pending lines that trigger an upload
 #define LOG_REC_LENGTH 192
+#define LOG_BATCH_AGE 10000             // Oldest buffered line is uploaded after this
+#define LOG_BATCH_LEVEL 2               // Lines at this level or more severe are uploaded right away
+#define LOG_BATCH_PAYLOAD (DOCSIZE - 64)  // Room left for the topic in the MQTT buffer
+#define LOG_CLOCK_VALID 1600000000      // Wall clock is considered set by SNTP after this
+#define LOG_UPLOAD_BATCHES 4            // Messages per upload, a long backlog is sent over several loops
+#define LOG_REPEAT_SLOTS 8              // Call sites watched for repeats at once
+#define LOG_REPEAT_WINDOW 60            // Seconds a call site stays quiet after a line, config.logDedup
+#define LOG_RATE_BURST 30               // Lines a level may log at once before its rate applies
+#define LOG_RATE_DEFAULT {0, 0, 60, 60, 120}  // Lines per minute from error to debug, 0 is unlimited, config.logRate
+#define CONFIG_SCHEMA 1                 // Bump when Config or ConfigCoMCU change, older snapshots are then rebuilt
+#define CONFIG_SNAPSHOT_MAGIC 0x55445332  // "UDS2"
+#define CONFIG_FIELD_EXPORT 1           // Sent as a client attribute
+#define CONFIG_FIELD_APPLY 2            // Taken from shared attributes
+#define CONFIG_COMCU_FRAME_FIELDS 10    // Fields per setConfigCoMCU frame, the CoMCU parses one at a time
 #define PIN_RXD2 16
 #define PIN_TXD2 17
 #define WIFI_FALLBACK_COUNTER 5
 #ifndef DOCSIZE
   #define DOCSIZE 1024
 #endif
+#ifndef CONSOLE_POLICY
+  #define CONSOLE_POLICY CONSOLE_DROP_OLDEST
+#endif
+#ifndef TLS_IN_BUFFER
+  #define TLS_IN_BUFFER Default_TLS_In_Buffer
+#endif
+#ifndef TLS_OUT_BUFFER
+  #define TLS_OUT_BUFFER Default_TLS_Out_Buffer
+#endif
+#ifndef IOT_HEAP_RESERVE
+  #define IOT_HEAP_RESERVE (4 * DOCSIZE + 4096 + 16384)   // JSON documents, OTA buffer and application headroom
+#endif
 
 const char* configFile = "/cfg.json";
 const char* configFileCoMCU = "/comcu.json";
+const char* configSnapshotFile = "/cfg.snap";
+const char* configSnapshotFileCoMCU = "/comcu.snap";
 char logBuff[LOG_REC_LENGTH];
-char _logRec[LOG_REC_SIZE][LOG_REC_LENGTH];
-uint8_t _logRecIndex;
+unsigned long _logPendingSince;
+
+// Call site whose lines are held back while it repeats
+struct LogRepeat
+{
+  const char *file;
+  const char *function;
+  uint16_t line;
+  uint8_t level;
+  uint32_t count;               // Lines held back since the window started
+  unsigned long since;          // Start of the window
+};
+
+// Token bucket of a level, tokens are in 1/60000 of a line so the rate is per minute
+struct LogBucket
+{
+  uint32_t tokens;
+  unsigned long refilled;
+  uint32_t dropped;             // Lines over the rate since the last summary
+  unsigned long summarized;
+};
+
+LogRepeat _logRepeats[LOG_REPEAT_SLOTS];
+LogBucket _logBuckets[5];
 bool FLAG_IOT_SUBSCRIBE = false;
-bool FLAG_IOT_INIT = false;
-bool FLAG_OTA_UPDATE_INIT = false;
 uint8_t WIFI_RECONNECT_ATTEMPT = 0;
 bool WIFI_IS_DEFAULT = false;
 
@@ -53,6 +110,9 @@ struct Config
   char model[16];
   char group[16];
   uint8_t logLev;
+  bool logCoMcu;
+  uint16_t logDedup;
+  uint16_t logRate[5];
 
   char broker[128];
   uint16_t port;
@@ -70,6 +130,17 @@ struct Config
   uint8_t relayChannels[4];
 };
 
+// Start of a snapshot file, the struct follows as it is in memory
+struct ConfigSnapshot
+{
+  uint32_t magic;
+  uint16_t schema;
+  uint16_t size;
+  uint32_t crc;
+  uint32_t loadTime;      // Microseconds the last load from the config store took
+  Config_Version store;   // Of the config store the struct matches
+};
+
 struct ConfigCoMCU
 {
   bool fPanic;
@@ -93,6 +164,135 @@ struct ConfigCoMCU
   uint8_t pin1Wire;
 };
 
+enum ConfigFieldType
+{
+  FIELD_TEXT,
+  FIELD_BOOL,
+  FIELD_UINT8,
+  FIELD_UINT16,
+  FIELD_FLOAT
+};
+
+// One member of Config or ConfigCoMCU. The tables below drive the defaults, the config store,
+// the shared attributes and every JSON written, so a member is added in one place. The key is
+// the member name. A default from source overrides text or value, it is a const char* for text
+// and one int per element for numbers.
+struct ConfigField
+{
+  const char *name;
+  uint16_t offset;
+  uint16_t size;            // Bytes of the member, all elements
+  uint8_t type;
+  uint8_t count;            // Elements, arrays have more than one
+  uint8_t flags;
+  float value;
+  const char *text;
+  const void *source;
+};
+
+template<typename T> constexpr uint8_t configFieldCount()
+{
+  return std::extent<T>::value ? std::extent<T>::value : 1;
+}
+
+#define CONFIG_TEXT(S, member, flags, text) \
+  {#member, offsetof(S, member), sizeof(S::member), FIELD_TEXT, 1, flags, 0, text, nullptr}
+#define CONFIG_TEXT_FROM(S, member, flags, source) \
+  {#member, offsetof(S, member), sizeof(S::member), FIELD_TEXT, 1, flags, 0, nullptr, source}
+#define CONFIG_NUMBER(S, member, type, flags, value) \
+  {#member, offsetof(S, member), sizeof(S::member), type, configFieldCount<decltype(S::member)>(), flags, value, nullptr, nullptr}
+#define CONFIG_NUMBER_FROM(S, member, type, flags, source) \
+  {#member, offsetof(S, member), sizeof(S::member), type, configFieldCount<decltype(S::member)>(), flags, 0, nullptr, source}
+
+const int _logRateDefaults[] = LOG_RATE_DEFAULT;
+
+// hwid and name are derived from the chip by configLoadFailSafe()
+constexpr ConfigField configFields[] = {
+  CONFIG_TEXT(Config, model, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, "Generic"),
+  CONFIG_TEXT(Config, group, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, "UDAWA"),
+  CONFIG_NUMBER(Config, logLev, FIELD_UINT8, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, 5),
+  CONFIG_NUMBER(Config, logCoMcu, FIELD_BOOL, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, 0),
+  CONFIG_NUMBER(Config, logDedup, FIELD_UINT16, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, LOG_REPEAT_WINDOW),
+  CONFIG_NUMBER_FROM(Config, logRate, FIELD_UINT16, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, _logRateDefaults),
+  CONFIG_TEXT_FROM(Config, broker, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &broker),
+  CONFIG_NUMBER_FROM(Config, port, FIELD_UINT16, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &port),
+  CONFIG_TEXT_FROM(Config, wssid, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &wssid),
+  CONFIG_TEXT_FROM(Config, wpass, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &wpass),
+  CONFIG_TEXT_FROM(Config, dssid, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &dssid),
+  CONFIG_TEXT_FROM(Config, dpass, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &dpass),
+  CONFIG_TEXT_FROM(Config, upass, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &upass),
+  CONFIG_TEXT_FROM(Config, accessToken, CONFIG_FIELD_EXPORT, &accessToken),
+  CONFIG_NUMBER(Config, provSent, FIELD_BOOL, 0, 0),
+  CONFIG_TEXT_FROM(Config, provisionDeviceKey, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &provisionDeviceKey),
+  CONFIG_TEXT_FROM(Config, provisionDeviceSecret, CONFIG_FIELD_EXPORT | CONFIG_FIELD_APPLY, &provisionDeviceSecret)
+};
+
+constexpr ConfigField configCoMCUFields[] = {
+  CONFIG_NUMBER(ConfigCoMCU, fPanic, FIELD_BOOL, 0, 0),
+  CONFIG_NUMBER(ConfigCoMCU, pEcKcoe, FIELD_FLOAT, 0, 2.9),
+  CONFIG_NUMBER(ConfigCoMCU, pEcTcoe, FIELD_FLOAT, 0, 0.019),
+  CONFIG_NUMBER(ConfigCoMCU, pEcVin, FIELD_FLOAT, 0, 4.54),
+  CONFIG_NUMBER(ConfigCoMCU, pEcPpm, FIELD_FLOAT, 0, 0.5),
+  CONFIG_NUMBER(ConfigCoMCU, pEcR1, FIELD_UINT16, 0, 1000),
+  CONFIG_NUMBER(ConfigCoMCU, pEcRa, FIELD_UINT16, 0, 25),
+  CONFIG_NUMBER(ConfigCoMCU, bfreq, FIELD_UINT16, 0, 1600),
+  CONFIG_NUMBER(ConfigCoMCU, fBuzz, FIELD_BOOL, 0, 1),
+  CONFIG_NUMBER(ConfigCoMCU, pinBuzzer, FIELD_UINT8, 0, 3),
+  CONFIG_NUMBER(ConfigCoMCU, pinLedR, FIELD_UINT8, 0, 9),
+  CONFIG_NUMBER(ConfigCoMCU, pinLedG, FIELD_UINT8, 0, 10),
+  CONFIG_NUMBER(ConfigCoMCU, pinLedB, FIELD_UINT8, 0, 11),
+  CONFIG_NUMBER(ConfigCoMCU, pinEcPower, FIELD_UINT8, 0, 15),
+  CONFIG_NUMBER(ConfigCoMCU, pinEcGnd, FIELD_UINT8, 0, 16),
+  CONFIG_NUMBER(ConfigCoMCU, pinEcData, FIELD_UINT8, 0, 14),
+  CONFIG_NUMBER(ConfigCoMCU, pin1Wire, FIELD_UINT8, 0, 2)
+};
+
+constexpr uint8_t configFieldWidth(uint8_t type)
+{
+  return type == FIELD_FLOAT ? sizeof(float) : type == FIELD_UINT16 ? sizeof(uint16_t) : 1;
+}
+
+constexpr bool configFieldsValid(const ConfigField *fields, size_t count)
+{
+  return !count || ((fields->type == FIELD_TEXT || fields->size == fields->count * configFieldWidth(fields->type))
+    && configFieldsValid(fields + 1, count - 1));
+}
+
+static_assert(configFieldsValid(configFields, countof(configFields)), "A Config field type does not match its member");
+static_assert(configFieldsValid(configCoMCUFields, countof(configCoMCUFields)), "A ConfigCoMCU field type does not match its member");
+
+// Renders into a buffer, cut when full and always terminated. Without a buffer it only counts.
+class PrintBuffer : public Print
+{
+  public:
+    PrintBuffer(char *buffer, size_t size) : m_buffer(buffer), m_size(size), m_length(0) { if(size){buffer[0] = '\0';} }
+    size_t write(uint8_t c) override
+    {
+      if(m_length + 1 < m_size)
+      {
+        m_buffer[m_length] = c;
+        m_buffer[m_length + 1] = '\0';
+      }
+      m_length++;
+      return 1;
+    }
+    using Print::write;
+    inline size_t length() const { return m_length; }
+
+  private:
+    char *m_buffer;
+    size_t m_size;
+    size_t m_length;
+};
+
+// Streams into the message opened by tb.beginPublish()
+class PrintPublish : public Print
+{
+  public:
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+};
+
 
 void reboot();
 char* getDeviceId();
@@ -100,17 +300,39 @@ void cbWifiOnConnected(WiFiEvent_t event, WiFiEventInfo_t info);
 void cbWiFiOnDisconnected(WiFiEvent_t event, WiFiEventInfo_t info);
 void cbWiFiOnLostIp(WiFiEvent_t event, WiFiEventInfo_t info);
 void cbWiFiOnGotIp(WiFiEvent_t event, WiFiEventInfo_t info);
+void eventDispatch(const Event &event);
 void configLoadFailSafe();
 void configLoad();
+bool configLoadJson();
 void configSave();
 void configReset();
 void configCoMCULoadFailSafe();
 void configCoMCULoad();
+bool configCoMCULoadJson();
 void configCoMCUSave();
 void configCoMCUReset();
+bool configSnapshotLoad(const char* path, void* data, size_t size, uint32_t &loadTime);
+void configSnapshotSave(const char* path, const void* data, size_t size, uint32_t loadTime);
+void configSnapshotFollow(const char* path, const Config_Version &before);
+void configFieldsDefault(const ConfigField *fields, size_t count, void *base);
+void configFieldsLoad(const ConfigField *fields, size_t count, void *base);
+bool configFieldsSave(const ConfigField *fields, size_t count, const void *base);
+void configFieldsApply(const ConfigField *fields, size_t count, void *base, JsonVariantConst data, uint8_t flags);
+void configFieldsPrint(Print &out, const ConfigField *fields, size_t count, const void *base, uint8_t flags);
+void configAttributesApply(JsonVariantConst data);
+bool configAttributesSend();
 bool loadFile(const char* filePath, char* buffer);
 callbackResponse processProvisionResponse(const callbackData &data);
+void logWrite(uint8_t level, const char* fileName, int lineNumber, const char* functionName, const char* format, ...)
+  __attribute__((format(printf, 5, 6)));
 void recordLog(uint8_t level, const char* fileName, int, const char* functionName);
+bool logAdmit(uint8_t level, const char* fileName, int lineNumber, const char* functionName);
+void logRefill(LogBucket &bucket, uint16_t rate, unsigned long now);
+void logOutput(uint8_t level, const char* fileName, int lineNumber, const char* functionName, const char* format, va_list args);
+void logSummary(uint8_t level, const char* fileName, int lineNumber, const char* functionName, const char* format, ...)
+  __attribute__((format(printf, 5, 6)));
+void logRepeatCheck();
+void logFormat(char *out, size_t size, uint8_t level, const Log_Source &source, const char *message);
 void iotSendLog();
 void iotInit();
 void startup();
@@ -125,15 +347,20 @@ void writeSettings(StaticJsonDocument<DOCSIZE> &doc, const char* path);
 void setCoMCUPin(uint8_t pin, char type, bool mode, uint16_t aval, bool state);
 
 
-WiFiClientSecure ssl = WiFiClientSecure();
+LogStore logStore;
+ConfigStore configStore;
+Console console;
+EventQueue events;
+DNSCache dnsCache;
+TLSClient ssl;
 Config config;
 ConfigCoMCU configcomcu;
 ThingsBoardSized<DOCSIZE, 64> tb(ssl);
-volatile bool provisionResponseProcessed = false;
 
 void startup() {
   // put your setup code here, to run once:
   Serial.begin(115200);
+  console.begin(Serial, CONSOLE_POLICY);
   #ifdef USE_SERIAL2
     Serial2.begin(115200, SERIAL_8N1, PIN_RXD2, PIN_TXD2);
   #endif
@@ -143,13 +370,12 @@ void startup() {
   {
     //configReset();
     configLoadFailSafe();
-    sprintf_P(logBuff, PSTR("Problem with file system. Failsafe config was loaded."));
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    LOG_E("Problem with file system. Failsafe config was loaded.");
   }
   else
   {
-    sprintf_P(logBuff, PSTR("Loading config..."));
-    recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    logStore.begin();
+    LOG_D("Loading config...");
     configLoad();
   }
 }
@@ -164,14 +390,18 @@ void networkInit()
   if(!config.wssid || *config.wssid == 0x00 || strlen(config.wssid) > 32)
   {
     configLoadFailSafe();
-    sprintf_P(logBuff, PSTR("SSID too long or missing! Failsafe config was loaded."));
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    LOG_E("SSID too long or missing! Failsafe config was loaded.");
   }
   WiFi.begin(config.wssid, config.wpass);
   WiFi.setHostname(config.name);
   WiFi.setAutoReconnect(true);
 
+  dnsCache.begin();
+  ssl.setResolver(&dnsCache);
   ssl.setCACert(CA_CERT);
+  ssl.setSessionStore(TLS_SESSION_RTC);
+  ssl.setBufferSizes(TLS_IN_BUFFER, TLS_OUT_BUFFER);
+  tb.Firmware_Set_CA_Cert(CA_CERT);
 
   taskManager.scheduleFixedRate(10000, [] {
     if(WiFi.status() == WL_CONNECTED && !tb.connected())
@@ -195,37 +425,100 @@ void networkInit()
 void udawa() {
   taskManager.runLoop();
   ArduinoOTA.handle();
+  dnsCache.loop();
+  logRepeatCheck();
+  configStore.loop();
 
   tb.loop();
 
-  if(FLAG_OTA_UPDATE_INIT)
+  if(logStore.pending() && millis() - _logPendingSince >= LOG_BATCH_AGE && !tb.provisioning())
   {
-    FLAG_OTA_UPDATE_INIT = 0;
-    otaUpdateInit();
+    iotSendLog();
   }
 
-  if(FLAG_IOT_INIT)
+  Event event;
+  while(events.pop(event))
   {
-    FLAG_IOT_INIT = 0;
-    iotInit();
+    eventDispatch(event);
   }
 }
 
+// Runs on the main loop what the WiFi callbacks and the provisioning response queued
+void eventDispatch(const Event &event)
+{
+  switch(event.type)
+  {
+    case EVENT_WIFI_CONNECTED:
+      LOG_I("WiFi Connected to %s", WiFi.SSID().c_str());
+      WIFI_RECONNECT_ATTEMPT = 0;
+      break;
+    case EVENT_WIFI_DISCONNECTED:
+      WIFI_RECONNECT_ATTEMPT += 1;
+      if(WIFI_RECONNECT_ATTEMPT >= WIFI_FALLBACK_COUNTER)
+      {
+        if(!WIFI_IS_DEFAULT)
+        {
+          LOG_I("WiFi (%s) Disconnected (reason %u)! Attempt: %d/%d", config.dssid, event.reason, WIFI_RECONNECT_ATTEMPT,
+            WIFI_FALLBACK_COUNTER);
+          WiFi.begin(config.dssid, config.dpass);
+          WIFI_IS_DEFAULT = true;
+        }
+        else
+        {
+          LOG_I("WiFi (%s) Disconnected (reason %u)! Attempt: %d/%d", config.wssid, event.reason, WIFI_RECONNECT_ATTEMPT,
+            WIFI_FALLBACK_COUNTER);
+          WiFi.begin(config.wssid, config.wpass);
+          WIFI_IS_DEFAULT = false;
+        }
+        WIFI_RECONNECT_ATTEMPT = 0;
+      }
+      else
+      {
+        WiFi.reconnect();
+      }
+      break;
+    case EVENT_WIFI_LOST_IP:
+      LOG_I("WiFi (%s) IP Lost!", WiFi.SSID().c_str());
+      WiFi.reconnect();
+      break;
+    case EVENT_WIFI_GOT_IP:
+      otaUpdateInit();
+      iotInit();
+      break;
+    case EVENT_PROVISION_DONE:
+      // Reconnect once with the received credentials, a refused request is retried
+      // later by the connection watchdog
+      tb.disconnect();
+      if(config.provSent)
+      {
+        iotInit();
+      }
+      break;
+  }
+  const Event_Stats stats = events.stats();
+  LOG_D("Event %u queued for %u us, max: %u us, overflows: %u", event.type, stats.lastLatency, stats.maxLatency,
+    stats.overflows);
+}
+
 void reboot()
 {
-  sprintf_P(logBuff, PSTR("Device rebooting..."));
-  recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+  LOG_E("Device rebooting...");
+  console.flush();
   esp_task_wdt_init(1,true);
   esp_task_wdt_add(NULL);
   while(true);
 }
 
+// Formatted once, the efuse MAC does not change
 char* getDeviceId()
 {
-  char* decodedString = new char[16];
-  uint64_t chipid = ESP.getEfuseMac();
-  sprintf(decodedString, "%04X%08X",(uint16_t)(chipid>>32), (uint32_t)chipid);
-  return decodedString;
+  static char deviceId[16];
+  if(!*deviceId)
+  {
+    uint64_t chipid = ESP.getEfuseMac();
+    sprintf(deviceId, "%04X%08X",(uint16_t)(chipid>>32), (uint32_t)chipid);
+  }
+  return deviceId;
 }
 
 void otaUpdateInit()
@@ -261,53 +554,38 @@ void otaUpdateInit()
 void iotInit()
 {
   int freeHeap = ESP.getFreeHeap();
-  sprintf_P(logBuff, PSTR("Initializing IoT, available memory: %d"), freeHeap);
-  recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  if(freeHeap < 92000)
+  int minHeap = ssl.memoryRequired() + IOT_HEAP_RESERVE;
+  LOG_I("Initializing IoT, available memory: %d, required: %d", freeHeap, minHeap);
+  if(freeHeap < minHeap)
   {
-    sprintf_P(logBuff, PSTR("Unable to init IoT, insufficient memory: %d"), freeHeap);
-    recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    LOG_I("Unable to init IoT, insufficient memory: %d", freeHeap);
     return;
   }
   if(!config.provSent)
   {
-    ThingsBoardSized<DOCSIZE, 64> tbProvision(ssl);
-    if(!tbProvision.connected())
+    // Provisioning runs on the main client, the response is handled from udawa()
+    if(!tb.connected())
     {
-      sprintf_P(logBuff, PSTR("Starting provision initiation to %s:%d"),  config.broker, config.port);
-      recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-      if(tbProvision.connect(config.broker, "provision", config.port))
+      LOG_I("Starting provision initiation to %s:%d",  config.broker, config.port);
+      if(tb.connect(config.broker, "provision", config.port))
       {
-        sprintf_P(logBuff, PSTR("Connected to provisioning server: %s:%d"),  config.broker, config.port);
-        recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+        LOG_D("Connected to provisioning server: %s:%d",  config.broker, config.port);
 
         GenericCallback cb[2] = {
           { "provisionResponse", processProvisionResponse },
           { "provisionResponse", processProvisionResponse }
         };
-        if(tbProvision.callbackSubscribe(cb, 2))
+        if(tb.callbackSubscribe(cb, 2))
         {
-          if(tbProvision.sendProvisionRequest(config.name, config.provisionDeviceKey, config.provisionDeviceSecret))
+          if(tb.sendProvisionRequest(config.name, config.provisionDeviceKey, config.provisionDeviceSecret))
           {
-            sprintf_P(logBuff, PSTR("Provision request was sent! Waiting for response."));
-            recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-            unsigned long timer = millis();
-            while(true)
-            {
-              tbProvision.loop();
-              if(millis() - timer > 10000)
-              {
-                break;
-              }
-            }
-            tbProvision.disconnect();
+            LOG_D("Provision request was sent! Waiting for response.");
           }
         }
       }
       else
       {
-        sprintf_P(logBuff, PSTR("Failed to connect to provisioning server: %s:%d"),  config.broker, config.port);
-        recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+        LOG_E("Failed to connect to provisioning server: %s:%d",  config.broker, config.port);
         return;
       }
     }
@@ -316,146 +594,60 @@ void iotInit()
   {
     if(!tb.connected())
     {
-      sprintf_P(logBuff, PSTR("Connecting to broker %s:%d"), config.broker, config.port);
-      recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+      LOG_D("Connecting to broker %s:%d", config.broker, config.port);
       if(!tb.connect(config.broker, config.accessToken, config.port, config.name))
       {
-        sprintf_P(logBuff, PSTR("Failed to connect to IoT Broker %s"), config.broker);
-        recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+        LOG_E("Failed to connect to IoT Broker %s", config.broker);
         return;
       }
 
       iotSendLog();
-      sprintf_P(logBuff, PSTR("IoT Connected!"));
-      recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+      LOG_D("IoT Connected!");
+      const TLS_Stats &tls = ssl.stats();
+      LOG_D("TLS handshake %u ms (%s), full: %u, resumed: %u, failed: %u", tls.lastHandshakeTime,
+        tls.lastResumed ? "resumed" : "full", tls.fullHandshakes, tls.resumedHandshakes, tls.failedHandshakes);
+      const DNS_Stats &dns = dnsCache.stats();
+      LOG_D("DNS resolve %u ms, queries: %u, failures: %u, hits: %u, stale: %u, fallbacks: %u", dns.lastLatency,
+        dns.queries, dns.failures, dns.hits, dns.staleHits, dns.fallbacks);
+      const Console_Stats &con = console.stats();
+      LOG_D("Console written: %u, dropped: %u in %u drops, high water: %u", con.written, con.dropped, con.drops,
+        con.highWater);
       FLAG_IOT_SUBSCRIBE = true;
     }
   }
 }
 
+// The callbacks run in the event task, they only queue the event for the main loop
 void cbWifiOnConnected(WiFiEvent_t event, WiFiEventInfo_t info)
 {
-  sprintf_P(logBuff, PSTR("WiFi Connected to %s"), WiFi.SSID().c_str());
-  recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  WIFI_RECONNECT_ATTEMPT = 0;
+  events.push(EVENT_WIFI_CONNECTED);
 }
 
 void cbWiFiOnDisconnected(WiFiEvent_t event, WiFiEventInfo_t info)
 {
-  WIFI_RECONNECT_ATTEMPT += 1;
-  if(WIFI_RECONNECT_ATTEMPT >= WIFI_FALLBACK_COUNTER)
-  {
-    if(!WIFI_IS_DEFAULT)
-    {
-      sprintf_P(logBuff, PSTR("WiFi (%s) Disconnected! Attempt: %d/%d"), config.dssid, WIFI_RECONNECT_ATTEMPT, WIFI_FALLBACK_COUNTER);
-      recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-      WiFi.begin(config.dssid, config.dpass);
-      WIFI_IS_DEFAULT = true;
-    }
-    else
-    {
-      sprintf_P(logBuff, PSTR("WiFi (%s) Disconnected! Attempt: %d/%d"), config.wssid, WIFI_RECONNECT_ATTEMPT, WIFI_FALLBACK_COUNTER);
-      recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-      WiFi.begin(config.wssid, config.wpass);
-      WIFI_IS_DEFAULT = false;
-    }
-    WIFI_RECONNECT_ATTEMPT = 0;
-  }
-  else
-  {
-    WiFi.reconnect();
-  }
+  events.push(EVENT_WIFI_DISCONNECTED, info.wifi_sta_disconnected.reason);
 }
 
 void cbWiFiOnLostIp(WiFiEvent_t event, WiFiEventInfo_t info)
 {
-  sprintf_P(logBuff, PSTR("WiFi (%s) IP Lost!"), WiFi.SSID().c_str());
-  recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  WiFi.reconnect();
+  events.push(EVENT_WIFI_LOST_IP);
 }
 
 void cbWiFiOnGotIp(WiFiEvent_t event, WiFiEventInfo_t info)
 {
-  FLAG_OTA_UPDATE_INIT = 1;
-  FLAG_IOT_INIT = 1;
+  events.push(EVENT_WIFI_GOT_IP);
 }
 
 void configReset()
 {
-  bool formatted = SPIFFS.format();
-  if(formatted)
-  {
-    sprintf_P(logBuff, PSTR("SPIFFS formatting success."));
-    recordLog(3, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  }
-  else
+  // Only the config is dropped, the rest of the file system is kept
+  if(!configStore.clear())
   {
-    sprintf_P(logBuff, PSTR("SPIFFS formatting failed."));
-    recordLog(3, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  }
-  File file;
-  file = SPIFFS.open(configFile, FILE_WRITE);
-  if (!file) {
-    sprintf_P(logBuff, PSTR("Failed to create config file. Config reset is cancelled."));
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
-    file.close();
-    return;
-  }
-
-  StaticJsonDocument<DOCSIZE> doc;
-
-  char dv[16];
-  sprintf(dv, "%s", getDeviceId());
-  doc["name"] = "UDAWA" + String(dv);
-  doc["model"] = "Generic";
-  doc["group"] = "UDAWA";
-  doc["broker"] = broker;
-  doc["port"] = port;
-  doc["wssid"] = wssid;
-  doc["wpass"] = wpass;
-  doc["dssid"] = dssid;
-  doc["dpass"] = dpass;
-  doc["upass"] = upass;
-  doc["accessToken"] = accessToken;
-  doc["provSent"] = false;
-  doc["provisionDeviceKey"] = provisionDeviceKey;
-  doc["provisionDeviceSecret"] = provisionDeviceSecret;
-  doc["logLev"] = 5;
-
-  size_t size = serializeJson(doc, file);
-  file.close();
-
-  sprintf_P(logBuff, PSTR("Verifiying resetted config file (size: %d) is written successfully..."), size);
-  recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  file = SPIFFS.open(configFile, FILE_READ);
-  if (!file)
-  {
-    sprintf_P(logBuff, PSTR("Failed to open the config file!"));
-    recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  }
-  else
-  {
-    sprintf_P(logBuff, PSTR("New config file opened, size: %d"), file.size());
-    recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-
-    if(file.size() < 1)
-    {
-      sprintf_P(logBuff, PSTR("Config file size is abnormal: %d, trying to rewrite..."), file.size());
-      recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
-
-      size_t size = serializeJson(doc, file);
-      sprintf_P(logBuff, PSTR("Writing: %d of data, file size: %d"), size, file.size());
-      recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
-    }
-    else
-    {
-      sprintf_P(logBuff, PSTR("Config file size is normal: %d, trying to reboot..."), file.size());
-      recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
-      file.close();
-      reboot();
-    }
+    LOG_E("Failed to clear the config store.");
   }
-  file.close();
+  configLoadFailSafe();
+  configSave();
+  LOG_W("Config was reset to defaults.");
 }
 
 void configLoadFailSafe()
@@ -466,280 +658,479 @@ void configLoadFailSafe()
 
   String name = "UDAWA" + String(dv);
   strlcpy(config.name, name.c_str(), sizeof(config.name));
-  strlcpy(config.model, "Generic", sizeof(config.model));
-  strlcpy(config.group, "UDAWA", sizeof(config.group));
-  strlcpy(config.broker, broker, sizeof(config.broker));
-  strlcpy(config.wssid, wssid, sizeof(config.wssid));
-  strlcpy(config.wpass, wpass, sizeof(config.wpass));
-  strlcpy(config.dssid, dssid, sizeof(config.dssid));
-  strlcpy(config.dpass, dpass, sizeof(config.dpass));
-  strlcpy(config.upass, upass, sizeof(config.upass));
-  strlcpy(config.accessToken, accessToken, sizeof(config.accessToken));
-  config.provSent = false;
-  config.port = port;
-  strlcpy(config.provisionDeviceKey, provisionDeviceKey, sizeof(config.provisionDeviceKey));
-  strlcpy(config.provisionDeviceSecret, provisionDeviceSecret, sizeof(config.provisionDeviceSecret));
-  config.logLev = 5;
+  configFieldsDefault(configFields, countof(configFields), &config);
 }
 
-void configLoad()
+// Reads the JSON config file of earlier versions, false if there is none
+bool configLoadJson()
 {
   File file = SPIFFS.open(configFile, FILE_READ);
-  sprintf_P(logBuff, PSTR("Loading config file."));
-  recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  if(file.size() > 1)
-  {
-    sprintf_P(logBuff, PSTR("Config file size is normal: %d, trying to fit it in %d docsize."), file.size(), DOCSIZE);
-    recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  }
-  else
+  if(!file || file.size() < 2)
   {
     file.close();
-    sprintf_P(logBuff, PSTR("Config file size is abnormal: %d. Closing file and trying to reset..."), file.size());
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
-    configReset();
-    return;
+    return false;
   }
 
   StaticJsonDocument<DOCSIZE> doc;
   DeserializationError error = deserializeJson(doc, file);
-
+  file.close();
   if(error)
   {
-    sprintf_P(logBuff, PSTR("Failed to load config file! (%s - %s - %d). Falling back to failsafe."), configFile, error.c_str(), file.size());
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
-    file.close();
-    configLoadFailSafe();
+    LOG_E("Failed to load config file! (%s - %s).", configFile, error.c_str());
+    return false;
+  }
+
+  // Keys missing keep their failsafe value
+  configFieldsApply(configFields, countof(configFields), &config, doc, 0);
+  return true;
+}
+
+// Takes the snapshot when it is intact and of this schema, otherwise loads from the config
+// store, where keys missing keep their failsafe value, and writes a new snapshot
+void configLoad()
+{
+  unsigned long start = micros();
+  uint32_t storeLoadTime = 0;
+  if(configSnapshotLoad(configSnapshotFile, &config, sizeof(config), storeLoadTime))
+  {
+    LOG_I("Device ID: %s", config.hwid);
+    LOG_I("Config snapshot loaded in %lu us, the config store took %u us.", micros() - start, storeLoadTime);
     return;
   }
+
+  configLoadFailSafe();
+  LOG_I("Device ID: %s", config.hwid);
+  if(!configStore.exists("model"))
+  {
+    if(configLoadJson())
+    {
+      LOG_I("Moving the config file into the config store.");
+      configSave();
+      SPIFFS.remove(configFile);
+    }
+    else
+    {
+      LOG_E("No config stored, trying to reset...");
+      configReset();
+    }
+  }
   else
   {
-    char dv[16];
-    sprintf(dv, "%s", getDeviceId());
-    strlcpy(config.hwid, dv, sizeof(config.hwid));
-
-    sprintf_P(logBuff, PSTR("Device ID: %s"), dv);
-    recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-
-
-    String name = "UDAWA" + String(dv);
-    strlcpy(config.name, name.c_str(), sizeof(config.name));
-    //strlcpy(config.name, doc["name"].as<const char*>(), sizeof(config.name));
-    strlcpy(config.model, doc["model"].as<const char*>(), sizeof(config.model));
-    strlcpy(config.group, doc["group"].as<const char*>(), sizeof(config.group));
-    strlcpy(config.broker, doc["broker"].as<const char*>(), sizeof(config.broker));
-    strlcpy(config.wssid, doc["wssid"].as<const char*>(), sizeof(config.wssid));
-    strlcpy(config.wpass, doc["wpass"].as<const char*>(), sizeof(config.wpass));
-    strlcpy(config.dssid, doc["dssid"].as<const char*>(), sizeof(config.dssid));
-    strlcpy(config.dpass, doc["dpass"].as<const char*>(), sizeof(config.dpass));
-    strlcpy(config.upass, doc["upass"].as<const char*>(), sizeof(config.upass));
-    strlcpy(config.accessToken, doc["accessToken"].as<const char*>(), sizeof(config.accessToken));
-    config.provSent = doc["provSent"].as<int>();
-    config.port = doc["port"].as<uint16_t>() ? doc["port"].as<uint16_t>() : port;
-    config.logLev = doc["logLev"].as<uint8_t>();
-    strlcpy(config.provisionDeviceKey, doc["provisionDeviceKey"].as<const char*>(), sizeof(config.provisionDeviceKey));
-    strlcpy(config.provisionDeviceSecret, doc["provisionDeviceSecret"].as<const char*>(), sizeof(config.provisionDeviceSecret));
-
-    sprintf_P(logBuff, PSTR("Config loaded successfuly."));
-    recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    configFieldsLoad(configFields, countof(configFields), &config);
   }
-  file.close();
+
+  storeLoadTime = micros() - start;
+  configSnapshotSave(configSnapshotFile, &config, sizeof(config), storeLoadTime);
+  LOG_I("Config loaded successfuly in %u us, %u keys indexed in %u us.", storeLoadTime, configStore.count(),
+    configStore.stats().loadTime);
 }
 
+// Appends only the values that changed
 void configSave()
 {
-  if(!SPIFFS.remove(configFile))
+  Config_Version before = configStore.version();
+  bool saved = configStore.setString("name", config.name);
+  saved &= configFieldsSave(configFields, countof(configFields), &config);
+  if(!saved)
   {
-    sprintf_P(logBuff, PSTR("Failed to delete the old configFile: %s"), configFile);
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    LOG_E("Failed to save config.");
   }
-  File file = SPIFFS.open(configFile, FILE_WRITE);
-  if (!file)
-  {
-    file.close();
-    return;
-  }
-
-  StaticJsonDocument<DOCSIZE> doc;
-  doc["name"] = config.name;
-  doc["model"] = config.model;
-  doc["group"] = config.group;
-  doc["broker"] = config.broker;
-  doc["port"]  = config.port;
-  doc["wssid"] = config.wssid;
-  doc["wpass"] = config.wpass;
-  doc["dssid"] = config.dssid;
-  doc["dpass"] = config.dpass;
-  doc["upass"] = config.upass;
-  doc["accessToken"] = config.accessToken;
-  doc["provSent"] = config.provSent;
-  doc["provisionDeviceKey"] = config.provisionDeviceKey;
-  doc["provisionDeviceSecret"] = config.provisionDeviceSecret;
-  doc["logLev"] = config.logLev;
-
-  serializeJson(doc, file);
-  file.close();
+  configSnapshotSave(configSnapshotFile, &config, sizeof(config), 0);
+  configSnapshotFollow(configSnapshotFileCoMCU, before);
 }
 
+void configCoMCULoadFailSafe()
+{
+  configFieldsDefault(configCoMCUFields, countof(configCoMCUFields), &configcomcu);
+}
 
 void configCoMCUReset()
 {
-  SPIFFS.remove(configFileCoMCU);
-  File file = SPIFFS.open(configFileCoMCU, FILE_WRITE);
-  if (!file) {
-    file.close();
-    return;
-  }
+  configCoMCULoadFailSafe();
+  configCoMCUSave();
+  LOG_I("ConfigCoMCU hard reset.");
+}
 
+// Reads the JSON CoMCU config file of earlier versions, false if there is none
+bool configCoMCULoadJson()
+{
+  File file = SPIFFS.open(configFileCoMCU, FILE_READ);
+  if(!file)
+  {
+    return false;
+  }
   StaticJsonDocument<DOCSIZE> doc;
-
-  doc["fPanic"] = false;
-  doc["pEcKcoe"] = 2.9;
-  doc["pEcTcoe"] = 0.019;
-  doc["pEcVin"] = 4.54;
-  doc["pEcPpm"] = 0.5;
-  doc["pEcR1"] = 1000;
-  doc["pEcRa"] =  25;
-
-  doc["bfreq"] = 1600;
-  doc["fBuzz"] = 1;
-
-  doc["pinBuzzer"] = 3;
-  doc["pinLedR"] = 9;
-  doc["pinLedG"] = 10;
-  doc["pinLedB"] = 11;
-  doc["pinEcPower"] = 15;
-  doc["pinEcGnd"] = 16;
-  doc["pinEcData"] = 14;
-
-  doc["pin1Wire"] = 2;
-
-  serializeJson(doc, file);
+  DeserializationError error = deserializeJson(doc, file);
   file.close();
+  if(error)
+  {
+    return false;
+  }
 
-  sprintf_P(logBuff, PSTR("ConfigCoMCU hard reset:"));
-  recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  serializeJsonPretty(doc, Serial);
+  configFieldsApply(configCoMCUFields, countof(configCoMCUFields), &configcomcu, doc, 0);
+  return true;
 }
 
 void configCoMCULoad()
 {
-  File file = SPIFFS.open(configFileCoMCU);
-  StaticJsonDocument<DOCSIZE> doc;
-  DeserializationError error = deserializeJson(doc, file);
-
-  if(error)
+  unsigned long start = micros();
+  uint32_t storeLoadTime = 0;
+  if(configSnapshotLoad(configSnapshotFileCoMCU, &configcomcu, sizeof(configcomcu), storeLoadTime))
   {
-    file.close();
-    configCoMCUReset();
     return;
   }
+
+  configCoMCULoadFailSafe();
+  if(!configStore.exists("bfreq"))
+  {
+    if(configCoMCULoadJson())
+    {
+      configCoMCUSave();
+      SPIFFS.remove(configFileCoMCU);
+    }
+    else
+    {
+      configCoMCUReset();
+    }
+  }
   else
   {
+    configFieldsLoad(configCoMCUFields, countof(configCoMCUFields), &configcomcu);
+  }
 
-    configcomcu.fPanic = doc["fPanic"].as<bool>();
-    configcomcu.pEcKcoe = doc["pEcKcoe"].as<float>();
-    configcomcu.pEcTcoe = doc["pEcTcoe"].as<float>();
-    configcomcu.pEcVin = doc["pEcVin"].as<float>();
-    configcomcu.pEcPpm = doc["pEcPpm"].as<float>();
-    configcomcu.pEcR1 = doc["pEcR1"].as<uint16_t>();
-    configcomcu.pEcRa =  doc["pEcRa"].as<uint16_t>();
+  storeLoadTime = micros() - start;
+  configSnapshotSave(configSnapshotFileCoMCU, &configcomcu, sizeof(configcomcu), storeLoadTime);
+  LOG_I("ConfigCoMCU loaded successfuly in %u us.", storeLoadTime);
+}
 
-    configcomcu.bfreq = doc["bfreq"].as<uint16_t>();
-    configcomcu.fBuzz = doc["fBuzz"].as<bool>();
+void configCoMCUSave()
+{
+  Config_Version before = configStore.version();
+  bool saved = configFieldsSave(configCoMCUFields, countof(configCoMCUFields), &configcomcu);
+  if(!saved)
+  {
+    LOG_E("Failed to save ConfigCoMCU.");
+  }
+  configSnapshotSave(configSnapshotFileCoMCU, &configcomcu, sizeof(configcomcu), 0);
+  configSnapshotFollow(configSnapshotFile, before);
+}
 
-    configcomcu.pinBuzzer = doc["pinBuzzer"].as<uint8_t>();
-    configcomcu.pinLedR = doc["pinLedR"].as<uint8_t>();
-    configcomcu.pinLedG = doc["pinLedG"].as<uint8_t>();
-    configcomcu.pinLedB = doc["pinLedB"].as<uint8_t>();
-    configcomcu.pinEcPower = doc["pinEcPower"].as<uint8_t>();
-    configcomcu.pinEcGnd = doc["pinEcGnd"].as<uint8_t>();
-    configcomcu.pinEcData = doc["pinEcData"].as<uint8_t>();
+// Reads a snapshot in one go, false when it is missing, torn, of another schema or taken
+// from another version of the config store, as when power was lost before it was rewritten
+bool configSnapshotLoad(const char* path, void* data, size_t size, uint32_t &loadTime)
+{
+  File file = SPIFFS.open(path, FILE_READ);
+  if(!file)
+  {
+    return false;
+  }
+  uint8_t buffer[sizeof(ConfigSnapshot) + std::max(sizeof(Config), sizeof(ConfigCoMCU))];
+  size_t length = file.read(buffer, sizeof(ConfigSnapshot) + size);
+  file.close();
+  ConfigSnapshot *snapshot = (ConfigSnapshot *)buffer;
+  if(length != sizeof(ConfigSnapshot) + size || snapshot->magic != CONFIG_SNAPSHOT_MAGIC || snapshot->schema != CONFIG_SCHEMA
+    || snapshot->size != size || snapshot->crc != Firmware_CRC32::crc32(0, buffer + sizeof(ConfigSnapshot), size)
+    || snapshot->store != configStore.version())
+  {
+    LOG_W("Config snapshot %s is missing or outdated.", path);
+    return false;
+  }
+  memcpy(data, buffer + sizeof(ConfigSnapshot), size);
+  loadTime = snapshot->loadTime;
+  return true;
+}
 
-    configcomcu.pin1Wire = doc["pin1Wire"].as<uint8_t>();
+// The config store stays the source, a torn snapshot only means a slower boot.
+// A loadTime of 0 keeps the one already stored.
+void configSnapshotSave(const char* path, const void* data, size_t size, uint32_t loadTime)
+{
+  ConfigSnapshot snapshot;
+  if(!loadTime)
+  {
+    File file = SPIFFS.open(path, FILE_READ);
+    if(file && file.read((uint8_t *)&snapshot, sizeof(snapshot)) == sizeof(snapshot) && snapshot.magic == CONFIG_SNAPSHOT_MAGIC)
+    {
+      loadTime = snapshot.loadTime;
+    }
+    file.close();
+  }
+  snapshot.magic = CONFIG_SNAPSHOT_MAGIC;
+  snapshot.schema = CONFIG_SCHEMA;
+  snapshot.size = size;
+  snapshot.crc = Firmware_CRC32::crc32(0, (const uint8_t *)data, size);
+  snapshot.loadTime = loadTime;
+  snapshot.store = configStore.version();
 
-    sprintf_P(logBuff, PSTR("ConfigCoMCU loaded successfuly."));
-    recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
+  File file = SPIFFS.open(path, FILE_WRITE);
+  if(!file || file.write((const uint8_t *)&snapshot, sizeof(snapshot)) != sizeof(snapshot)
+    || file.write((const uint8_t *)data, size) != size)
+  {
+    LOG_E("Failed to write config snapshot %s.", path);
   }
   file.close();
 }
 
-void configCoMCUSave()
+// Both snapshots come from the one store, a save of the keys of one leaves the other
+// current. Moves it to the new store version when it matched the one before the save.
+void configSnapshotFollow(const char* path, const Config_Version &before)
 {
-  if(!SPIFFS.remove(configFileCoMCU))
+  if(configStore.version() == before)
   {
-    sprintf_P(logBuff, PSTR("Failed to delete the old configFileCoMCU: %s"), configFileCoMCU);
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    return;
   }
-  File file = SPIFFS.open(configFileCoMCU, FILE_WRITE);
-  if (!file)
+  uint8_t buffer[sizeof(ConfigSnapshot) + std::max(sizeof(Config), sizeof(ConfigCoMCU))];
+  File file = SPIFFS.open(path, FILE_READ);
+  size_t length = file ? file.read(buffer, sizeof(buffer)) : 0;
+  file.close();
+  ConfigSnapshot *snapshot = (ConfigSnapshot *)buffer;
+  if(length < sizeof(ConfigSnapshot) || snapshot->magic != CONFIG_SNAPSHOT_MAGIC || snapshot->store != before)
   {
-    file.close();
     return;
   }
+  snapshot->store = configStore.version();
+  file = SPIFFS.open(path, FILE_WRITE);
+  if(!file || file.write(buffer, length) != length)
+  {
+    LOG_E("Failed to write config snapshot %s.", path);
+  }
+  file.close();
+}
 
-  StaticJsonDocument<DOCSIZE> doc;
-
-  doc["fPanic"] = configcomcu.fPanic;
-  doc["pEcKcoe"] = configcomcu.pEcKcoe;
-  doc["pEcTcoe"] = configcomcu.pEcTcoe;
-  doc["pEcVin"] = configcomcu.pEcVin;
-  doc["pEcPpm"] = configcomcu.pEcPpm;
-  doc["pEcR1"] = configcomcu.pEcR1;
-  doc["pEcRa"] = configcomcu.pEcRa;
+void syncConfigCoMCU()
+{
+  configCoMCULoad();
 
-  doc["bfreq"] = configcomcu.bfreq;
-  doc["fBuzz"] = configcomcu.fBuzz;
+  for(size_t i = 0; i < countof(configCoMCUFields); i += CONFIG_COMCU_FRAME_FIELDS)
+  {
+    size_t count = std::min((size_t)CONFIG_COMCU_FRAME_FIELDS, countof(configCoMCUFields) - i);
+    auto frame = [&](Print &out) {
+      out.print("{\"method\":\"setConfigCoMCU\",");
+      configFieldsPrint(out, configCoMCUFields + i, count, &configcomcu, 0);
+      out.print('}');
+    };
+    frame(Serial2);
+    if(config.logCoMcu)
+    {
+      char text[DOCSIZE];
+      PrintBuffer buffer(text, sizeof(text));
+      frame(buffer);
+      console.line(text);
+    }
+  }
+}
 
-  doc["pinBuzzer"] = configcomcu.pinBuzzer;
-  doc["pinLedR"] = configcomcu.pinLedR;
-  doc["pinLedG"] = configcomcu.pinLedG;
-  doc["pinLedB"] = configcomcu.pinLedB;
-  doc["pinEcPower"] = configcomcu.pinEcPower;
-  doc["pinEcGnd"] = configcomcu.pinEcGnd;
-  doc["pinEcData"] = configcomcu.pinEcData;
+// Every default of the table, text from source is cut to the member
+void configFieldsDefault(const ConfigField *fields, size_t count, void *base)
+{
+  for(size_t f = 0; f < count; f++)
+  {
+    const ConfigField &field = fields[f];
+    uint8_t *member = (uint8_t *)base + field.offset;
+    if(field.type == FIELD_TEXT)
+    {
+      strlcpy((char *)member, field.source ? *(const char * const *)field.source : field.text, field.size);
+      continue;
+    }
+    for(uint8_t i = 0; i < field.count; i++)
+    {
+      float value = field.source ? ((const int *)field.source)[i] : field.value;
+      uint8_t *element = member + i * configFieldWidth(field.type);
+      switch(field.type)
+      {
+        case FIELD_BOOL: *(bool *)element = value != 0; break;
+        case FIELD_UINT8: *element = value; break;
+        case FIELD_UINT16: *(uint16_t *)element = value; break;
+        case FIELD_FLOAT: *(float *)element = value; break;
+      }
+    }
+  }
+}
 
-  doc["pin1Wire"] = configcomcu.pin1Wire;
+// Keys missing from the config store keep the value they had
+void configFieldsLoad(const ConfigField *fields, size_t count, void *base)
+{
+  for(size_t f = 0; f < count; f++)
+  {
+    const ConfigField &field = fields[f];
+    uint8_t *member = (uint8_t *)base + field.offset;
+    if(field.type == FIELD_TEXT)
+    {
+      configStore.getString(field.name, (char *)member, field.size);
+    }
+    else
+    {
+      configStore.get(field.name, member, field.size);
+    }
+  }
+}
 
-  serializeJson(doc, file);
-  file.close();
+bool configFieldsSave(const ConfigField *fields, size_t count, const void *base)
+{
+  bool saved = true;
+  for(size_t f = 0; f < count; f++)
+  {
+    const ConfigField &field = fields[f];
+    const uint8_t *member = (const uint8_t *)base + field.offset;
+    if(field.type == FIELD_TEXT)
+    {
+      saved &= configStore.setString(field.name, (const char *)member);
+    }
+    else
+    {
+      saved &= configStore.set(field.name, member, field.size);
+    }
+  }
+  return saved;
 }
 
-void syncConfigCoMCU()
+// Takes the fields that have all of flags, 0 takes every field. Keys missing or of the wrong
+// type are skipped, arrays may be given in part.
+void configFieldsApply(const ConfigField *fields, size_t count, void *base, JsonVariantConst data, uint8_t flags)
 {
-  configCoMCULoad();
+  for(size_t f = 0; f < count; f++)
+  {
+    const ConfigField &field = fields[f];
+    JsonVariantConst value = data[field.name];
+    if((field.flags & flags) != flags || value.isNull())
+    {
+      continue;
+    }
+    uint8_t *member = (uint8_t *)base + field.offset;
+    if(field.type == FIELD_TEXT)
+    {
+      if(value.is<const char*>())
+      {
+        strlcpy((char *)member, value.as<const char*>(), field.size);
+      }
+      continue;
+    }
+    for(uint8_t i = 0; i < field.count; i++)
+    {
+      JsonVariantConst item = field.count > 1 ? value[i] : value;
+      if(item.isNull())
+      {
+        continue;
+      }
+      uint8_t *element = member + i * configFieldWidth(field.type);
+      switch(field.type)
+      {
+        case FIELD_BOOL: *(bool *)element = item.as<bool>(); break;
+        case FIELD_UINT8: *element = item.as<uint8_t>(); break;
+        case FIELD_UINT16: *(uint16_t *)element = item.as<uint16_t>(); break;
+        case FIELD_FLOAT: *(float *)element = item.as<float>(); break;
+      }
+    }
+  }
+}
 
-  StaticJsonDocument<DOCSIZE> doc;
-  doc["method"] = "setConfigCoMCU";
+// Writes the fields that have all of flags as JSON members, without the braces so the caller
+// can add its own members
+void configFieldsPrint(Print &out, const ConfigField *fields, size_t count, const void *base, uint8_t flags)
+{
+  bool first = true;
+  for(size_t f = 0; f < count; f++)
+  {
+    const ConfigField &field = fields[f];
+    if((field.flags & flags) != flags)
+    {
+      continue;
+    }
+    if(!first)
+    {
+      out.print(',');
+    }
+    first = false;
+    out.print('"');
+    out.print(field.name);
+    out.print("\":");
 
-  doc["fPanic"] = configcomcu.fPanic;
-  doc["pEcKcoe"] = configcomcu.pEcKcoe;
-  doc["pEcTcoe"] = configcomcu.pEcTcoe;
-  doc["pEcVin"] = configcomcu.pEcVin;
-  doc["pEcPpm"] = configcomcu.pEcPpm;
-  doc["pEcR1"] = configcomcu.pEcR1;
-  doc["pEcRa"] = configcomcu.pEcRa;
+    const uint8_t *member = (const uint8_t *)base + field.offset;
+    if(field.type == FIELD_TEXT)
+    {
+      out.print('"');
+      for(const char *c = (const char *)member; *c; c++)
+      {
+        if(*c == '"' || *c == '\\')
+        {
+          out.print('\\');
+          out.print(*c);
+        }
+        else if((uint8_t)*c < 0x20)
+        {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+          out.print(escaped);
+        }
+        else
+        {
+          out.print(*c);
+        }
+      }
+      out.print('"');
+      continue;
+    }
 
-  doc["method"] = "setConfigCoMCU";
-  serialWriteToCoMcu(doc, 0);
-  doc.clear();
+    if(field.count > 1)
+    {
+      out.print('[');
+    }
+    for(uint8_t i = 0; i < field.count; i++)
+    {
+      const uint8_t *element = member + i * configFieldWidth(field.type);
+      char number[16];
+      switch(field.type)
+      {
+        case FIELD_BOOL: strcpy(number, *(const bool *)element ? "true" : "false"); break;
+        case FIELD_UINT8: snprintf(number, sizeof(number), "%u", *element); break;
+        case FIELD_UINT16: snprintf(number, sizeof(number), "%u", *(const uint16_t *)element); break;
+        case FIELD_FLOAT: snprintf(number, sizeof(number), "%.7g", *(const float *)element); break;
+      }
+      if(i)
+      {
+        out.print(',');
+      }
+      out.print(number);
+    }
+    if(field.count > 1)
+    {
+      out.print(']');
+    }
+  }
+}
 
-  doc["bfreq"] = configcomcu.bfreq;
-  doc["fBuzz"] = configcomcu.fBuzz;
+void configAttributesApply(JsonVariantConst data)
+{
+  configFieldsApply(configFields, countof(configFields), &config, data, CONFIG_FIELD_APPLY);
+}
 
-  doc["pinBuzzer"] = configcomcu.pinBuzzer;
-  doc["pinLedR"] = configcomcu.pinLedR;
-  doc["pinLedG"] = configcomcu.pinLedG;
-  doc["pinLedB"] = configcomcu.pinLedB;
-  doc["pinEcPower"] = configcomcu.pinEcPower;
-  doc["pinEcGnd"] = configcomcu.pinEcGnd;
-  doc["pinEcData"] = configcomcu.pinEcData;
+// Streams the exported config as one attributes message. MQTT wants the length ahead of the
+// payload, so it is rendered twice, first only to count it.
+bool configAttributesSend()
+{
+  auto payload = [](Print &out) {
+    out.print('{');
+    configFieldsPrint(out, configFields, countof(configFields), &config, CONFIG_FIELD_EXPORT);
+    out.print('}');
+  };
+  PrintBuffer counter(nullptr, 0);
+  payload(counter);
+  if(!tb.beginPublish("v1/devices/me/attributes", counter.length(), false))
+  {
+    return false;
+  }
+  PrintPublish publish;
+  payload(publish);
+  return tb.endPublish();
+}
 
-  doc["pin1Wire"] = configcomcu.pin1Wire;
+size_t PrintPublish::write(uint8_t c)
+{
+  return tb.write(c);
+}
 
-  doc["method"] = "setConfigCoMCU";
-  serialWriteToCoMcu(doc, 0);
-  doc.clear();
+size_t PrintPublish::write(const uint8_t *buffer, size_t size)
+{
+  return tb.write(buffer, size);
 }
 
 bool loadFile(const char* filePath, char *buffer)
@@ -761,28 +1152,24 @@ bool loadFile(const char* filePath, char *buffer)
 
 callbackResponse processProvisionResponse(const callbackData &data)
 {
-  sprintf_P(logBuff, PSTR("Received device provision response"));
-  recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
+  LOG_I("Received device provision response");
   int jsonSize = measureJson(data) + 1;
   char buffer[jsonSize];
   serializeJson(data, buffer, jsonSize);
 
   if (strncmp(data["status"], "SUCCESS", strlen("SUCCESS")) != 0)
   {
-    sprintf_P(logBuff, PSTR("Provision response contains the error: %s"), data["errorMsg"].as<const char*>());
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
-    provisionResponseProcessed = true;
+    LOG_E("Provision response contains the error: %s", data["errorMsg"].as<const char*>());
+    events.push(EVENT_PROVISION_DONE);
     return callbackResponse("provisionResponse", 1);
   }
   else
   {
-    sprintf_P(logBuff, PSTR("Provision response credential type: %s"), data["credentialsType"].as<const char*>());
-    recordLog(1, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    LOG_E("Provision response credential type: %s", data["credentialsType"].as<const char*>());
   }
   if (strncmp(data["credentialsType"], "ACCESS_TOKEN", strlen("ACCESS_TOKEN")) == 0)
   {
-    sprintf_P(logBuff, PSTR("ACCESS TOKEN received: %s"), data["credentialsValue"].as<String>().c_str());
-    recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    LOG_D("ACCESS TOKEN received.");
     strlcpy(config.accessToken, data["credentialsValue"].as<String>().c_str(), sizeof(config.accessToken));
     config.provSent = true;
     configSave();
@@ -795,17 +1182,182 @@ callbackResponse processProvisionResponse(const callbackData &data)
     credentials.password = credentials_value["password"].as<String>();
     */
   }
-  provisionResponseProcessed = true;
+  events.push(EVENT_PROVISION_DONE);
   return callbackResponse("provisionResponse", 1);
   reboot();
 }
 
+// Kept for sketches that still format into logBuff, use the LOG_* macros instead
 void recordLog(uint8_t level, const char* fileName, int lineNumber, const char* functionName)
 {
-  if(level > config.logLev)
+  logWrite(level, fileName, lineNumber, functionName, PSTR("%s"), logBuff);
+}
+
+void logWrite(uint8_t level, const char* fileName, int lineNumber, const char* functionName, const char* format, ...)
+{
+  if(level > config.logLev || !logAdmit(level, fileName, lineNumber, functionName))
   {
     return;
   }
+  va_list args;
+  va_start(args, format);
+  logOutput(level, fileName, lineNumber, functionName, format, args);
+  va_end(args);
+}
+
+// Lines of a call site that logged within the last config.logDedup seconds are held back
+// and counted, the count is logged when the window ends. Lines above the rate of their
+// level are dropped and counted the same way.
+bool logAdmit(uint8_t level, const char* fileName, int lineNumber, const char* functionName)
+{
+  unsigned long now = millis();
+  if(config.logDedup)
+  {
+    LogRepeat *slot = NULL;
+    for(uint8_t i = 0; i < LOG_REPEAT_SLOTS && !slot; i++)
+    {
+      if(_logRepeats[i].file == fileName && _logRepeats[i].line == lineNumber)
+      {
+        slot = &_logRepeats[i];
+      }
+    }
+    if(slot && now - slot->since < config.logDedup * 1000UL)
+    {
+      slot->count++;
+      return false;
+    }
+    if(!slot)
+    {
+      // A free slot or the one watched longest, whose count is logged first
+      slot = &_logRepeats[0];
+      for(uint8_t i = 0; i < LOG_REPEAT_SLOTS && slot->file; i++)
+      {
+        if(!_logRepeats[i].file || (long)(_logRepeats[i].since - slot->since) < 0)
+        {
+          slot = &_logRepeats[i];
+        }
+      }
+    }
+    if(slot->count)
+    {
+      LogRepeat repeat = *slot;
+      slot->count = 0;
+      logSummary(repeat.level, repeat.file, repeat.line, repeat.function, PSTR("Repeated %u times in %lu s"),
+        repeat.count, (now - repeat.since) / 1000);
+    }
+    *slot = { fileName, functionName, (uint16_t)lineNumber, level, 0, now };
+  }
+
+  uint16_t rate = (level >= 1 && level <= 5) ? config.logRate[level - 1] : 0;
+  if(rate)
+  {
+    LogBucket &bucket = _logBuckets[level - 1];
+    logRefill(bucket, rate, now);
+    if(bucket.tokens < 60000)
+    {
+      bucket.dropped++;
+      return false;
+    }
+    bucket.tokens -= 60000;
+  }
+  return true;
+}
+
+void logRefill(LogBucket &bucket, uint16_t rate, unsigned long now)
+{
+  uint64_t tokens = bucket.tokens + (uint64_t)std::min(now - bucket.refilled, 60000UL * LOG_RATE_BURST) * rate;
+  bucket.tokens = std::min(tokens, (uint64_t)60000 * LOG_RATE_BURST);
+  bucket.refilled = now;
+}
+
+// Logs the repeat counts of call sites whose window ended and the lines dropped by rate
+void logRepeatCheck()
+{
+  unsigned long now = millis();
+  for(uint8_t i = 0; i < LOG_REPEAT_SLOTS; i++)
+  {
+    LogRepeat &slot = _logRepeats[i];
+    if(!slot.file || now - slot.since < config.logDedup * 1000UL)
+    {
+      continue;
+    }
+    if(slot.count)
+    {
+      // A new window starts, a call site that keeps repeating logs one summary per window
+      LogRepeat repeat = slot;
+      slot.count = 0;
+      slot.since = now;
+      logSummary(repeat.level, repeat.file, repeat.line, repeat.function, PSTR("Repeated %u times in %lu s"),
+        repeat.count, (now - repeat.since) / 1000);
+    }
+    else
+    {
+      slot.file = NULL;
+    }
+  }
+  for(uint8_t level = 1; level <= 5; level++)
+  {
+    LogBucket &bucket = _logBuckets[level - 1];
+    uint16_t rate = config.logRate[level - 1];
+    if(!bucket.dropped || level > config.logLev)
+    {
+      continue;
+    }
+    // Refilled here as a storm may end with its last line dropped. The summary is already
+    // throttled to one per line of rate and does not take a token from the lines.
+    logRefill(bucket, rate, now);
+    if(!rate || now - bucket.summarized >= 60000UL / rate)
+    {
+      uint32_t dropped = bucket.dropped;
+      bucket.dropped = 0;
+      bucket.summarized = now;
+      logSummary(level, PSTR(__FILE__), __LINE__, PSTR(__func__), PSTR("Rate limit dropped %u lines"), dropped);
+    }
+  }
+}
+
+// Bypasses the repeat and rate checks
+void logSummary(uint8_t level, const char* fileName, int lineNumber, const char* functionName, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  logOutput(level, fileName, lineNumber, functionName, format, args);
+  va_end(args);
+}
+
+void logOutput(uint8_t level, const char* fileName, int lineNumber, const char* functionName, const char* format, va_list args)
+{
+  Log_Source source = { fileName, functionName, format, (uint16_t)lineNumber, ESP.getFreeHeap() };
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint64_t ts = (now.tv_sec > LOG_CLOCK_VALID) ? (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000 : 0;
+
+  // Lines are stored in binary, errors reach flash and the server right away
+  if(!logStore.pending())
+  {
+    _logPendingSince = millis();
+  }
+  va_list packed;
+  va_copy(packed, args);
+  logStore.append(level, ts, source, packed);
+  va_end(packed);
+
+  // The console is the only place the line is formatted when it is logged
+  char message[LOG_REC_LENGTH];
+  vsnprintf_P(message, sizeof(message), format, args);
+  char formattedLog[LOG_REC_LENGTH];
+  logFormat(formattedLog, sizeof(formattedLog), level, source, message);
+  console.line(formattedLog);
+
+  if(level <= LOG_BATCH_LEVEL || (tb.connected() && !tb.provisioning() && logStore.pending() >= LOG_REC_SIZE))
+  {
+    iotSendLog();
+  }
+}
+
+// Prefixes a message with its level, free heap and source
+void logFormat(char *out, size_t size, uint8_t level, const Log_Source &source, const char *message)
+{
   const char *levels;
   if(level == 5){levels = "D";}
   else if(level == 4){levels = "I";}
@@ -814,55 +1366,99 @@ void recordLog(uint8_t level, const char* fileName, int lineNumber, const char*
   else if(level == 1){levels = "E";}
   else{levels = "X";}
 
-  char formattedLog[LOG_REC_LENGTH];
-  uint32_t freeHeap = ESP.getFreeHeap();
-  sprintf_P(formattedLog, PSTR("[%s][%d][%s:%d] %s: %s"), levels, freeHeap, fileName, lineNumber, functionName, logBuff);
-  if(tb.connected())
-  {
-    StaticJsonDocument<DOCSIZE> doc;
-    doc["log"] = formattedLog;
-    tb.sendTelemetryDoc(doc);
-    doc.clear();
-  }
-  else
-  {
-    if(_logRecIndex == LOG_REC_SIZE)
-    {
-      _logRecIndex = 0;
-    }
-    sprintf_P(_logRec[_logRecIndex], PSTR("[%s][%d][%s:%d] %s: %s"), levels, freeHeap, fileName, lineNumber, functionName, logBuff);
-    _logRecIndex++;
-  }
-  Serial.println(formattedLog);
+  snprintf_P(out, size, PSTR("[%s][%u][%s:%u] %s: %s"), levels, source.heap, source.file ? source.file : "?", source.line,
+    source.function ? source.function : "?", message);
 }
 
+// Uploads the stored lines after the upload cursor, as few telemetry messages as the MQTT
+// buffer allows. Lines logged with a valid wall clock keep their timestamp, the others are
+// stamped now, and without a clock the lines are joined. Nothing is sent on the provisioning
+// session, the server closes it on any other publish.
 void iotSendLog()
 {
-  StaticJsonDocument<DOCSIZE> doc;
-  for(uint8_t i = 0; i < LOG_REC_SIZE; i++)
+  logStore.flush();
+  if(!tb.connected() || tb.provisioning() || !logStore.pending())
+  {
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  bool clockValid = now.tv_sec > LOG_CLOCK_VALID;
+  uint64_t nowMs = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+  uint64_t lastTs = 0;
+  char payload[LOG_BATCH_PAYLOAD];
+  char message[LOG_REC_LENGTH];
+  char line[LOG_REC_LENGTH];
+  Log_Record record;
+  Log_Source source;
+  bool held = false;
+
+  logStore.rewind();
+  for(uint8_t batches = 0; batches < LOG_UPLOAD_BATCHES && (held || logStore.next(record, source, message, sizeof(message))); batches++)
   {
-    if(_logRec[i][0] != '\0')
+    StaticJsonDocument<DOCSIZE> doc;
+    JsonArray batch = doc.to<JsonArray>();
+    size_t size = clockValid ? 2 : 9;   // [] or {"log":}
+    size_t joinedLength = 0;
+    uint8_t taken = 0;
+    uint32_t last = 0;
+    do
     {
-      doc["log"] = String(_logRec[i]);
-      tb.sendTelemetryDoc(doc);
-      _logRec[i][0] = '\0';
+      if(!held)
+      {
+        logFormat(line, sizeof(line), record.level, source, message);
+      }
+      StaticJsonDocument<16> measure;
+      measure.set((const char *)line);
+      // Escaped line plus the timestamped object around it, or the newline joining it
+      size_t lineSize = measureJson(measure) + (clockValid ? 40 : 2);
+      held = taken && (size + lineSize > LOG_BATCH_PAYLOAD || doc.memoryUsage() + strlen(line) + 64 > doc.capacity());
+      if(held)
+      {
+        break;
+      }
+      if(clockValid)
+      {
+        uint64_t ts = record.ts ? record.ts : nowMs;
+        lastTs = ts = (ts > lastTs) ? ts : lastTs + 1;
+        JsonObject entry = batch.createNestedObject();
+        entry["ts"] = ts;
+        entry["values"]["log"] = line;
+      }
+      else
+      {
+        joinedLength += snprintf(payload + joinedLength, sizeof(payload) - joinedLength, "%s%s", taken ? "\n" : "", line);
+        joinedLength = std::min(joinedLength, sizeof(payload) - 1);
+      }
+      size += lineSize;
+      last = record.seq;
+      taken++;
+    } while(logStore.next(record, source, message, sizeof(message)));
+
+    if(!clockValid)
+    {
+      // Copied into the document, the payload buffer is reused for the output
+      doc.clear();
+      doc["log"] = (char *)payload;
     }
+    serializeJson(doc, payload, sizeof(payload));
+    if(!tb.sendTelemetryJson(payload))
+    {
+      return;
+    }
+    logStore.commit(last);
   }
-  doc.clear();
 }
 
 void serialWriteToCoMcu(StaticJsonDocument<DOCSIZE> &doc, bool isRpc)
 {
-  if(false)
+  serializeJson(doc, Serial2);
+  if(config.logCoMcu)
   {
-    StringPrint stream;
-    serializeJson(doc, stream);
-    String result = stream.str();
-    sprintf_P(logBuff, PSTR("%s"), result.c_str());
-    recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    char frame[DOCSIZE];
+    serializeJson(doc, frame, sizeof(frame));
+    console.line(frame);
   }
-  serializeJson(doc, Serial2);
-  serializeJsonPretty(doc, Serial);
   if(isRpc)
   {
     delay(50);
@@ -879,15 +1475,14 @@ void serialReadFromCoMcu(StaticJsonDocument<DOCSIZE> &doc)
   result = stream.str();
   if (err == DeserializationError::Ok)
   {
-    #ifdef SHOW_SERIAL_READ_FROM_COMCU
-      sprintf_P(logBuff, PSTR("%s"), result.c_str());
-      recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-    #endif
+    if(config.logCoMcu)
+    {
+      console.line(result.c_str());
+    }
   }
   else
   {
-    sprintf_P(logBuff, PSTR("Serial2CoMCU DeserializeJson() returned: %s, content: %s"), err.c_str(), result.c_str());
-    recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+    LOG_D("Serial2CoMCU DeserializeJson() returned: %s, content: %s", err.c_str(), result.c_str());
     return;
   }
 }
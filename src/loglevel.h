@@ -0,0 +1,31 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Level gated logging macros
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef loglevel_h
+#define loglevel_h
+
+#ifndef LOG_LEVEL_MAX
+  #define LOG_LEVEL_MAX 5   // Levels above are compiled out, config.logLev filters the rest at runtime
+#endif
+
+// Logs a printf-style message with its file, line and function. Levels suppressed by
+// config.logLev return before the arguments are evaluated or formatted. config and
+// logWrite() are the ones of libudawa.h.
+#define LOG_AT(level, format, ...) do { \
+    if(((level) <= LOG_LEVEL_MAX) && ((level) <= config.logLev)) \
+    { \
+      logWrite((level), PSTR(__FILE__), __LINE__, PSTR(__func__), PSTR(format), ##__VA_ARGS__); \
+    } \
+  } while(0)
+#define LOG_E(format, ...) LOG_AT(1, format, ##__VA_ARGS__)
+#define LOG_C(format, ...) LOG_AT(2, format, ##__VA_ARGS__)
+#define LOG_W(format, ...) LOG_AT(3, format, ##__VA_ARGS__)
+#define LOG_I(format, ...) LOG_AT(4, format, ##__VA_ARGS__)
+#define LOG_D(format, ...) LOG_AT(5, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,541 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Persistent log store on SPIFFS
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "logstore.h"
+#include <esp_ota_ops.h>
+
+#define LOG_SEGMENT_MAGIC 0x55444C32  // "UDL2"
+#define LOG_CURSOR_MAGIC 0x55444C43   // "UDLC"
+#define LOG_RECORD_MARKER 0xA5
+#define LOG_RECORD_MAX (sizeof(Log_Source) + Default_Log_Args_Size)
+
+// Start of every segment file
+struct Log_Segment_Header {
+  uint32_t magic;
+  uint32_t first;
+  uint32_t build;     // Firmware whose string addresses the lines refer to
+};
+
+// Conversion of a printf format, as far as packing its argument is concerned
+struct Log_Conversion {
+  char type;          // Conversion character, 0 at the end of the format
+  uint8_t longs;      // Number of l, 2 for ll and j
+  bool sizeType;      // z or t
+  uint8_t stars;      // Width and precision taken from int arguments
+};
+
+// Skips literal text and parses the next conversion, p ends after it
+static const char *logConversion(const char *p, Log_Conversion &conversion) {
+  memset(&conversion, 0, sizeof(conversion));
+  while (*p) {
+    if ((*p++ == '%') && *p) {
+      if (*p == '%') {
+        p++;
+        continue;
+      }
+      while (*p && strchr("-+ #0123456789.*", *p)) {
+        conversion.stars += (*p++ == '*');
+      }
+      while (*p && strchr("hlLjzt", *p)) {
+        conversion.longs += (*p == 'l') ? 1 : (*p == 'j') ? 2 : 0;
+        conversion.sizeType |= (*p == 'z') || (*p == 't');
+        p++;
+      }
+      conversion.type = *p;
+      return *p ? p + 1 : p;
+    }
+  }
+  return p;
+}
+
+// Packed size of an integer conversion
+static size_t logIntegerSize(const Log_Conversion &conversion) {
+  return (conversion.longs >= 2) ? sizeof(long long) : conversion.longs ? sizeof(long) : conversion.sizeType ? sizeof(size_t) : sizeof(int);
+}
+
+template<typename T>
+static int logFormat(char *text, size_t size, const char *spec, const int *stars, uint8_t count, T value) {
+  if (count >= 2) {
+    return snprintf(text, size, spec, stars[0], stars[1], value);
+  }
+  if (count) {
+    return snprintf(text, size, spec, stars[0], value);
+  }
+  return snprintf(text, size, spec, value);
+}
+
+LogStore::LogStore()
+  : m_file()
+  , m_segment(0)
+  , m_size(0)
+  , m_first()
+  , m_seq(1)
+  , m_cursor(0)
+  , m_dropped(0)
+  , m_build(0)
+  , m_buffered(0)
+  , m_reader()
+  , m_readSegment(0)
+  , m_readBuild(0)
+  , m_reading(false)
+{
+}
+
+bool LogStore::begin() {
+  // The first bytes of the ELF hash tell builds apart
+  char sha[9] = "";
+  esp_ota_get_app_elf_sha256(sha, sizeof(sha));
+  m_build = strtoul(sha, NULL, 16);
+
+  char name[32];
+  uint8_t newest = Default_Log_Segments;
+  uint32_t newestBuild = 0;
+  for (uint8_t i = 0; i < Default_Log_Segments; i++) {
+    m_first[i] = 0;
+    segmentName(i, name);
+    File file = SPIFFS.open(name, FILE_READ);
+    if (!file) {
+      continue;
+    }
+    Log_Segment_Header header;
+    if ((file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)) && (header.magic == LOG_SEGMENT_MAGIC) && header.first) {
+      m_first[i] = header.first;
+      if ((newest == Default_Log_Segments) || (header.first > m_first[newest])) {
+        newest = i;
+        newestBuild = header.build;
+      }
+    }
+    file.close();
+  }
+  if (newest == Default_Log_Segments) {
+    m_cursor = 0;
+    return segmentOpen(0, 1);
+  }
+
+  // Walks the newest segment up to its last complete line
+  segmentName(newest, name);
+  File file = SPIFFS.open(name, FILE_READ);
+  uint32_t size = sizeof(Log_Segment_Header);
+  uint32_t seq = m_first[newest];
+  Log_Record record;
+  file.seek(size);
+  while ((file.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) && (record.marker == LOG_RECORD_MARKER)
+    && (record.seq == seq) && (record.length <= LOG_RECORD_MAX) && (size + sizeof(record) + record.length <= file.size())) {
+    size += sizeof(record) + record.length;
+    seq++;
+    file.seek(size);
+  }
+  bool torn = size < file.size();
+  file.close();
+  m_seq = seq;
+
+  m_cursor = 0;
+  File cursor = SPIFFS.open(Default_Log_Cursor_File, FILE_READ);
+  if (cursor) {
+    uint32_t data[2];
+    if ((cursor.read((uint8_t *)data, sizeof(data)) == sizeof(data)) && (data[0] == LOG_CURSOR_MAGIC) && (data[1] < m_seq)) {
+      m_cursor = data[1];
+    }
+    cursor.close();
+  }
+  if (m_cursor + 1 < oldest()) {
+    m_cursor = oldest() - 1;
+  }
+
+  // Lines appended after a torn write could not be read back, and the lines of a segment
+  // must come from one build, a new segment is started for both
+  if (torn || (newestBuild != m_build)) {
+    return segmentOpen((newest + 1) % Default_Log_Segments, m_seq);
+  }
+  m_file = SPIFFS.open(name, FILE_APPEND);
+  m_segment = newest;
+  m_size = size;
+  return m_file;
+}
+
+bool LogStore::append(uint8_t level, uint64_t ts, const Log_Source &source, va_list args) {
+  uint8_t packed[Default_Log_Args_Size];
+  size_t length = pack(packed, sizeof(packed), source.format, args);
+  uint32_t need = sizeof(Log_Record) + sizeof(Log_Source) + length;
+  if (m_buffered + need > sizeof(m_buffer)) {
+    flush();
+  }
+  if (m_size + need > Default_Log_Segment_Size) {
+    flush();
+    segmentOpen((m_segment + 1) % Default_Log_Segments, m_seq);
+  }
+  if (!m_file) {
+    return false;
+  }
+
+  Log_Record record;
+  record.seq = m_seq++;
+  record.level = level;
+  record.marker = LOG_RECORD_MARKER;
+  record.length = sizeof(Log_Source) + length;
+  record.ts = ts;
+  uint8_t *p = m_buffer + m_buffered;
+  memcpy(p, &record, sizeof(record));
+  memcpy(p + sizeof(record), &source, sizeof(Log_Source));
+  memcpy(p + sizeof(record) + sizeof(Log_Source), packed, length);
+  m_buffered += need;
+  m_size += need;
+  return true;
+}
+
+void LogStore::flush() {
+  if (!m_buffered) {
+    return;
+  }
+  if (m_file) {
+    m_file.write(m_buffer, m_buffered);
+    m_file.flush();
+  }
+  m_buffered = 0;
+}
+
+void LogStore::rewind() {
+  flush();
+  if (m_reading) {
+    m_reader.close();
+    m_reading = false;
+  }
+  // Segment holding the line after the cursor
+  uint8_t segment = Default_Log_Segments;
+  for (uint8_t i = 0; i < Default_Log_Segments; i++) {
+    if (m_first[i] && (m_first[i] <= m_cursor + 1) && ((segment == Default_Log_Segments) || (m_first[i] > m_first[segment]))) {
+      segment = i;
+    }
+  }
+  if (segment < Default_Log_Segments) {
+    readerOpen(segment);
+  }
+}
+
+bool LogStore::next(Log_Record &record, Log_Source &source, char *text, size_t size) {
+  uint8_t data[LOG_RECORD_MAX];
+  while (m_reading) {
+    if ((m_reader.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) && (record.marker == LOG_RECORD_MARKER)
+      && (record.length >= sizeof(Log_Source)) && (record.length <= LOG_RECORD_MAX) && (record.seq < m_seq)) {
+      if (record.seq <= m_cursor) {
+        m_reader.seek(record.length, SeekCur);
+        continue;
+      }
+      if (m_reader.read(data, record.length) == record.length) {
+        memcpy(&source, data, sizeof(Log_Source));
+        const uint8_t *packed = data + sizeof(Log_Source);
+        size_t length = record.length - sizeof(Log_Source);
+        if (m_readBuild == m_build) {
+          expand(text, size, source.format, packed, length);
+        }
+        else {
+          // The strings are not in this firmware, kept raw for decoding with the old build
+          size_t n = snprintf(text, size, "build %08x format %p line %u args ", m_readBuild, source.format, source.line);
+          for (size_t i = 0; (i < length) && (n + 2 < size); i++, n += 2) {
+            snprintf(text + n, size - n, "%02x", packed[i]);
+          }
+          source.file = NULL;
+          source.function = NULL;
+          source.format = NULL;
+        }
+        return true;
+      }
+    }
+
+    // End of the segment, continues with the next one in rotation if it is newer
+    m_reader.close();
+    m_reading = false;
+    uint8_t segment = (m_readSegment + 1) % Default_Log_Segments;
+    if (m_first[segment] > m_first[m_readSegment]) {
+      readerOpen(segment);
+    }
+  }
+  return false;
+}
+
+void LogStore::commit(uint32_t seq) {
+  if (seq <= m_cursor) {
+    return;
+  }
+  m_cursor = seq;
+  File file = SPIFFS.open(Default_Log_Cursor_File, FILE_WRITE);
+  if (file) {
+    uint32_t data[2] = { LOG_CURSOR_MAGIC, m_cursor };
+    file.write((const uint8_t *)data, sizeof(data));
+    file.close();
+  }
+}
+
+void LogStore::segmentName(uint8_t segment, char *name) {
+  sprintf(name, Default_Log_Segment_File, segment);
+}
+
+// Replaces a segment with an empty one starting at first, lines of the replaced
+// segment that were not uploaded yet are lost
+bool LogStore::segmentOpen(uint8_t segment, uint32_t first) {
+  char name[32];
+  segmentName(segment, name);
+  m_file.close();
+  if (m_reading && (m_readSegment == segment)) {
+    m_reader.close();
+    m_reading = false;
+  }
+  m_first[segment] = 0;
+  uint32_t start = oldest();
+  if (start > first) {
+    start = first;
+  }
+  if (m_cursor + 1 < start) {
+    m_dropped += start - 1 - m_cursor;
+    m_cursor = start - 1;
+  }
+
+  m_segment = segment;
+  m_size = sizeof(Log_Segment_Header);
+  m_file = SPIFFS.open(name, FILE_WRITE);
+  if (!m_file) {
+    return false;
+  }
+  Log_Segment_Header header = { LOG_SEGMENT_MAGIC, first, m_build };
+  m_file.write((const uint8_t *)&header, sizeof(header));
+  m_file.flush();
+  m_first[segment] = first;
+  return true;
+}
+
+// First sequence number still stored
+uint32_t LogStore::oldest() {
+  uint32_t first = m_seq;
+  for (uint8_t i = 0; i < Default_Log_Segments; i++) {
+    if (m_first[i] && (m_first[i] < first)) {
+      first = m_first[i];
+    }
+  }
+  return first;
+}
+
+bool LogStore::readerOpen(uint8_t segment) {
+  char name[32];
+  segmentName(segment, name);
+  Log_Segment_Header header;
+  m_reader = SPIFFS.open(name, FILE_READ);
+  m_reading = m_reader && (m_reader.read((uint8_t *)&header, sizeof(header)) == sizeof(header));
+  m_readSegment = segment;
+  m_readBuild = header.build;
+  return m_reading;
+}
+
+// Arguments that do not fit are left out, expand shows them as ?
+size_t LogStore::pack(uint8_t *buffer, size_t size, const char *format, va_list args) {
+  size_t length = 0;
+  Log_Conversion conversion;
+  const char *p = format;
+  for (;;) {
+    p = logConversion(p, conversion);
+    if (!conversion.type) {
+      break;
+    }
+    if (conversion.stars * sizeof(int) + length > size) {
+      return length;
+    }
+    for (uint8_t i = 0; i < conversion.stars; i++) {
+      int star = va_arg(args, int);
+      memcpy(buffer + length, &star, sizeof(star));
+      length += sizeof(star);
+    }
+
+    union {
+      int i;
+      long l;
+      long long ll;
+      size_t z;
+      double d;
+      const void *p;
+    } value;
+    size_t valueSize = 0;
+    switch (conversion.type) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        valueSize = logIntegerSize(conversion);
+        if (conversion.longs >= 2) {
+          value.ll = va_arg(args, long long);
+        }
+        else if (conversion.longs) {
+          value.l = va_arg(args, long);
+        }
+        else if (conversion.sizeType) {
+          value.z = va_arg(args, size_t);
+        }
+        else {
+          value.i = va_arg(args, int);
+        }
+      break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        value.d = va_arg(args, double);
+        valueSize = sizeof(double);
+      break;
+      case 'p':
+        value.p = va_arg(args, const void *);
+        valueSize = sizeof(const void *);
+      break;
+      case 's': {
+        const char *str = va_arg(args, const char *);
+        str = str ? str : "(null)";
+        uint8_t strLength = std::min(strlen(str), (size_t)Default_Log_String_Arg);
+        if (length + 1 + strLength > size) {
+          return length;
+        }
+        buffer[length] = strLength;
+        memcpy(buffer + length + 1, str, strLength);
+        length += 1 + strLength;
+      }
+      break;
+      case 'n':
+        va_arg(args, void *);
+      break;
+      default:
+        // Unknown conversion, the types of the arguments after it are unknown as well
+        return length;
+    }
+    if (length + valueSize > size) {
+      return length;
+    }
+    memcpy(buffer + length, &value, valueSize);
+    length += valueSize;
+  }
+  return length;
+}
+
+size_t LogStore::expand(char *text, size_t size, const char *format, const uint8_t *buffer, size_t length) {
+  size_t out = 0;
+  size_t pos = 0;
+  const char *p = format;
+  text[0] = '\0';
+  while (*p && (out + 1 < size)) {
+    // Literal text up to the next conversion
+    const char *start = p;
+    Log_Conversion conversion;
+    const char *end = logConversion(p, conversion);
+    const char *spec = conversion.type ? end - 1 : end;
+    while (spec > start && *spec != '%') {
+      spec--;
+    }
+    if (!conversion.type) {
+      spec = end;
+    }
+    for (const char *c = start; (c < spec) && (out + 1 < size); c++) {
+      if ((*c == '%') && (c[1] == '%')) {
+        c++;
+      }
+      text[out++] = *c;
+    }
+    p = end;
+    if (!conversion.type) {
+      break;
+    }
+
+    // Conversion spec without the length modifier L, arguments are unpacked as double
+    char fmt[16];
+    size_t fmtLength = 0;
+    for (const char *c = spec; (c < end) && (fmtLength + 1 < sizeof(fmt)); c++) {
+      if (*c != 'L') {
+        fmt[fmtLength++] = *c;
+      }
+    }
+    fmt[fmtLength] = '\0';
+
+    int stars[2] = { 0, 0 };
+    bool missing = false;
+    for (uint8_t i = 0; i < conversion.stars; i++) {
+      if (pos + sizeof(int) > length) {
+        missing = true;
+        break;
+      }
+      memcpy(&stars[std::min(i, (uint8_t)1)], buffer + pos, sizeof(int));
+      pos += sizeof(int);
+    }
+
+    int n = 0;
+    size_t valueSize = 0;
+    switch (conversion.type) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        valueSize = logIntegerSize(conversion);
+        if (missing || (pos + valueSize > length)) {
+          missing = true;
+        }
+        else if (conversion.longs >= 2) {
+          long long value;
+          memcpy(&value, buffer + pos, sizeof(value));
+          n = logFormat(text + out, size - out, fmt, stars, conversion.stars, value);
+        }
+        else if (conversion.longs) {
+          long value;
+          memcpy(&value, buffer + pos, sizeof(value));
+          n = logFormat(text + out, size - out, fmt, stars, conversion.stars, value);
+        }
+        else if (conversion.sizeType) {
+          size_t value;
+          memcpy(&value, buffer + pos, sizeof(value));
+          n = logFormat(text + out, size - out, fmt, stars, conversion.stars, value);
+        }
+        else {
+          int value;
+          memcpy(&value, buffer + pos, sizeof(value));
+          n = logFormat(text + out, size - out, fmt, stars, conversion.stars, value);
+        }
+      break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        valueSize = sizeof(double);
+        if (missing || (pos + valueSize > length)) {
+          missing = true;
+        }
+        else {
+          double value;
+          memcpy(&value, buffer + pos, sizeof(value));
+          n = logFormat(text + out, size - out, fmt, stars, conversion.stars, value);
+        }
+      break;
+      case 'p':
+        valueSize = sizeof(const void *);
+        if (missing || (pos + valueSize > length)) {
+          missing = true;
+        }
+        else {
+          const void *value;
+          memcpy(&value, buffer + pos, sizeof(value));
+          n = logFormat(text + out, size - out, fmt, stars, conversion.stars, value);
+        }
+      break;
+      case 's':
+        if (missing || (pos + 1 > length) || (pos + 1 + buffer[pos] > length)) {
+          missing = true;
+        }
+        else {
+          char value[Default_Log_String_Arg + 1];
+          memcpy(value, buffer + pos + 1, buffer[pos]);
+          value[buffer[pos]] = '\0';
+          valueSize = 1 + buffer[pos];
+          n = logFormat(text + out, size - out, fmt, stars, conversion.stars, (const char *)value);
+        }
+      break;
+      case 'n':
+      break;
+      default:
+        missing = true;
+    }
+    if (missing) {
+      n = snprintf(text + out, size - out, "?");
+      pos = length;
+    }
+    else {
+      pos += valueSize;
+    }
+    out += std::min((size_t)std::max(n, 0), size - 1 - out);
+  }
+  text[out] = '\0';
+  return out;
+}
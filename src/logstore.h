@@ -0,0 +1,106 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Persistent log store on SPIFFS
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef logstore_h
+#define logstore_h
+
+#include <Arduino.h>
+#include <FS.h>
+#include <SPIFFS.h>
+#include <stdarg.h>
+
+#define Default_Log_Segments 4              // Segment files in rotation
+#define Default_Log_Segment_Size 8192       // Bytes per segment, the store never exceeds segments * size
+#define Default_Log_Write_Buffer 512        // Appends are collected here before they reach the file
+#define Default_Log_Segment_File "/logseg%u.bin"
+#define Default_Log_Cursor_File "/logcur.bin"
+#define Default_Log_Args_Size 160           // Packed arguments of one line
+#define Default_Log_String_Arg 64           // String arguments are cut to this length
+
+// Header of every stored line, its source and packed arguments follow
+struct Log_Record {
+  uint32_t seq;         // Increases by one per line, never reused
+  uint8_t level;
+  uint8_t marker;       // Tells a complete header from a torn write
+  uint16_t length;      // Of what follows the header
+  uint64_t ts;          // Epoch milliseconds, 0 when the clock was not set
+};
+
+// Where a line was logged. The strings are literals in flash, only their addresses are
+// stored, they are valid as long as the firmware that wrote them is running.
+struct Log_Source {
+  const char *file;
+  const char *function;
+  const char *format;
+  uint16_t line;
+  uint32_t heap;        // Free heap when logged
+};
+
+// Append-only log in a fixed number of segment files. Lines are kept in binary, as the
+// addresses of their source strings and the arguments packed according to the format,
+// and are only expanded to text when read back. Appends are buffered in RAM and written
+// to the open segment in one go. A full segment closes and the oldest one is deleted to
+// make room, so writes rotate over all segments and the size stays bounded.
+// The upload cursor is the sequence number of the last uploaded line, it is kept in its
+// own file so uploads resume where they stopped after a reboot.
+class LogStore
+{
+  public:
+    LogStore();
+
+    // Finds the newest segment and the last sequence number, reads back the cursor.
+    bool begin();
+    // Packs the arguments of a printf-style line and buffers it, the buffer goes to
+    // flash when it is full.
+    bool append(uint8_t level, uint64_t ts, const Log_Source &source, va_list args);
+    // Writes the buffered lines to the segment.
+    void flush();
+
+    // Starts reading at the first line after the upload cursor.
+    void rewind();
+    // Next line with its message expanded into text, cut to size. Lines written by another
+    // firmware build come with a NULL source and their raw arguments in hex.
+    // False when all lines were read.
+    bool next(Log_Record &record, Log_Source &source, char *text, size_t size);
+    // Lines up to seq are uploaded, they are not read again.
+    void commit(uint32_t seq);
+
+    // Lines not uploaded yet
+    inline uint32_t pending() const { return m_seq - 1 - m_cursor; }
+    // Lines deleted by rotation before they were uploaded
+    inline uint32_t dropped() const { return m_dropped; }
+
+    // Packs the arguments of format, returns their size
+    static size_t pack(uint8_t *buffer, size_t size, const char *format, va_list args);
+    // Formats packed arguments, returns the text length
+    static size_t expand(char *text, size_t size, const char *format, const uint8_t *buffer, size_t length);
+
+  private:
+    void segmentName(uint8_t segment, char *name);
+    bool segmentOpen(uint8_t segment, uint32_t first);
+    uint32_t oldest();
+    bool readerOpen(uint8_t segment);
+
+    File m_file;                  // Segment appended to
+    uint8_t m_segment;
+    uint32_t m_size;              // Of the open segment, buffer included
+    uint32_t m_first[Default_Log_Segments];   // First sequence number of each segment, 0 if empty
+    uint32_t m_seq;               // Next sequence number
+    uint32_t m_cursor;
+    uint32_t m_dropped;
+    uint32_t m_build;             // Firmware that writes, its strings are the ones in flash
+    uint8_t m_buffer[Default_Log_Write_Buffer];
+    uint16_t m_buffered;
+
+    File m_reader;
+    uint8_t m_readSegment;
+    uint32_t m_readBuild;
+    bool m_reading;
+};
+
+#endif
@@ -7,6 +7,9 @@
 */
 
 #include "thingsboard.h"
+#ifdef ESP_PLATFORM
+#include <esp_rom_crc.h>
+#endif
 
 /*----------------------------------------------------------------------------*/
 
@@ -52,4 +55,599 @@ bool Telemetry::serializeKeyval(JsonVariant &jsonObj) const {
 void ThingsBoardDefaultLogger::log(const char *msg) {
   Serial.print(F("[TB] "));
   Serial.println(msg);
-}
\ No newline at end of file
+}
+/*----------------------------------------------------------------------------*/
+
+#define FIRMWARE_CURSOR_MAGIC 0x55444634  // "UDF4"
+
+void Firmware_Cursor::reset(const char *fwTitle, const char *fwVersion, const char *fwChecksum, uint32_t fwSize, uint32_t fwChunkSize) {
+  memset(this, 0, sizeof(Firmware_Cursor));
+  magic = FIRMWARE_CURSOR_MAGIC;
+  strlcpy(title, fwTitle, sizeof(title));
+  strlcpy(version, fwVersion, sizeof(version));
+  strlcpy(checksum, fwChecksum, sizeof(checksum));
+  size = fwSize;
+  chunkSize = fwChunkSize;
+  offset = 0;
+}
+
+bool Firmware_Cursor::matches(const char *fwTitle, const char *fwVersion, const char *fwChecksum, uint32_t fwSize) const {
+  return magic == FIRMWARE_CURSOR_MAGIC && size == fwSize && offset < size && chunkSize > 0
+    && !strcmp(title, fwTitle) && !strcmp(version, fwVersion) && !strcasecmp(checksum, fwChecksum);
+}
+
+bool Firmware_Cursor::load() {
+  File file = SPIFFS.open(Default_Firmware_Cursor_File, FILE_READ);
+  if (!file) {
+    magic = 0;
+    return false;
+  }
+  size_t length = file.read((uint8_t*)this, sizeof(Firmware_Cursor));
+  file.close();
+  if (length != sizeof(Firmware_Cursor) || magic != FIRMWARE_CURSOR_MAGIC) {
+    magic = 0;
+    return false;
+  }
+  return true;
+}
+
+bool Firmware_Cursor::save() const {
+  File file = SPIFFS.open(Default_Firmware_Cursor_File, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  size_t length = file.write((const uint8_t*)this, sizeof(Firmware_Cursor));
+  file.close();
+  return length == sizeof(Firmware_Cursor);
+}
+
+void Firmware_Cursor::clear() {
+  magic = 0;
+  if (SPIFFS.exists(Default_Firmware_Cursor_File)) {
+    SPIFFS.remove(Default_Firmware_Cursor_File);
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+
+#define FIRMWARE_TARGET_MAGIC 0x55445431  // "UDT1"
+
+void Firmware_Target::set(const char *fwTitle, const char *fwVersion, const char *fwChecksum, uint32_t fwSize) {
+  magic = FIRMWARE_TARGET_MAGIC;
+  strlcpy(title, fwTitle, sizeof(title));
+  strlcpy(version, fwVersion, sizeof(version));
+  strlcpy(checksum, fwChecksum, sizeof(checksum));
+  size = fwSize;
+}
+
+void Firmware_Target::report(const char *fwTitle, const char *fwVersion) {
+  magic = FIRMWARE_TARGET_MAGIC;
+  strlcpy(currTitle, fwTitle, sizeof(currTitle));
+  strlcpy(currVersion, fwVersion, sizeof(currVersion));
+}
+
+uint8_t Firmware_Target::fail(const char *fwChecksum) {
+  if ((magic != FIRMWARE_TARGET_MAGIC) || strcasecmp(failedChecksum, fwChecksum)) {
+    strlcpy(failedChecksum, fwChecksum, sizeof(failedChecksum));
+    failures = 0;
+  }
+  magic = FIRMWARE_TARGET_MAGIC;
+  return ++failures;
+}
+
+bool Firmware_Target::matches(const char *fwTitle, const char *fwVersion, const char *fwChecksum) const {
+  return magic == FIRMWARE_TARGET_MAGIC && !strcmp(title, fwTitle) && !strcmp(version, fwVersion)
+    && !strcasecmp(checksum, fwChecksum);
+}
+
+bool Firmware_Target::reported(const char *fwTitle, const char *fwVersion) const {
+  return magic == FIRMWARE_TARGET_MAGIC && !strcmp(currTitle, fwTitle) && !strcmp(currVersion, fwVersion);
+}
+
+bool Firmware_Target::load() {
+  File file = SPIFFS.open(Default_Firmware_Target_File, FILE_READ);
+  if (!file) {
+    magic = 0;
+    return false;
+  }
+  size_t length = file.read((uint8_t*)this, sizeof(Firmware_Target));
+  file.close();
+  if (length != sizeof(Firmware_Target) || magic != FIRMWARE_TARGET_MAGIC) {
+    memset(this, 0, sizeof(Firmware_Target));
+    return false;
+  }
+  return true;
+}
+
+bool Firmware_Target::save() const {
+  File file = SPIFFS.open(Default_Firmware_Target_File, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  size_t length = file.write((const uint8_t*)this, sizeof(Firmware_Target));
+  file.close();
+  return length == sizeof(Firmware_Target);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void hashToHex(const uint8_t *digest, size_t length, char *hex) {
+  for (size_t i = 0; i < length; i++) {
+    sprintf(hex + (i * 2), "%02x", digest[i]);
+  }
+  hex[length * 2] = '\0';
+}
+
+Firmware_Hash_Algorithm Firmware_Hash::algorithm(const char *name) {
+  if (!strcasecmp(name, "MD5")) {
+    return FIRMWARE_HASH_MD5;
+  }
+  if (!strcasecmp(name, "SHA256") || !strcasecmp(name, "SHA-256")) {
+    return FIRMWARE_HASH_SHA256;
+  }
+  if (!strcasecmp(name, "CRC32")) {
+    return FIRMWARE_HASH_CRC32;
+  }
+  return FIRMWARE_HASH_NONE;
+}
+
+void Firmware_MD5::begin() {
+  esp_rom_md5_init(&m_ctx);
+}
+
+void Firmware_MD5::update(const uint8_t *data, size_t length) {
+  esp_rom_md5_update(&m_ctx, data, length);
+}
+
+void Firmware_MD5::finish(char *hex) {
+  uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+  esp_rom_md5_final(digest, &m_ctx);
+  hashToHex(digest, sizeof(digest), hex);
+}
+
+size_t Firmware_MD5::save(uint8_t *state, size_t size) {
+  if (size < sizeof(m_ctx)) {
+    return 0;
+  }
+  memcpy(state, &m_ctx, sizeof(m_ctx));
+  return sizeof(m_ctx);
+}
+
+bool Firmware_MD5::restore(const uint8_t *state, size_t size) {
+  if (size < sizeof(m_ctx)) {
+    return false;
+  }
+  memcpy(&m_ctx, state, sizeof(m_ctx));
+  return true;
+}
+
+// mbedtls 3 dropped the _ret suffix
+#if defined(MBEDTLS_VERSION_NUMBER) && (MBEDTLS_VERSION_NUMBER >= 0x03000000)
+#define sha256_starts mbedtls_sha256_starts
+#define sha256_update mbedtls_sha256_update
+#define sha256_finish mbedtls_sha256_finish
+#else
+#define sha256_starts mbedtls_sha256_starts_ret
+#define sha256_update mbedtls_sha256_update_ret
+#define sha256_finish mbedtls_sha256_finish_ret
+#endif
+
+void Firmware_SHA256::begin() {
+  mbedtls_sha256_free(&m_ctx);
+  mbedtls_sha256_init(&m_ctx);
+  sha256_starts(&m_ctx, 0);
+}
+
+void Firmware_SHA256::update(const uint8_t *data, size_t length) {
+  sha256_update(&m_ctx, data, length);
+}
+
+void Firmware_SHA256::finish(char *hex) {
+  uint8_t digest[32];
+  sha256_finish(&m_ctx, digest);
+  hashToHex(digest, sizeof(digest), hex);
+}
+
+size_t Firmware_SHA256::save(uint8_t *state, size_t size) {
+  if (size < sizeof(m_ctx)) {
+    return 0;
+  }
+  // The ESP32 context may point to the accelerator, clone reads the digest back
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_clone(&ctx, &m_ctx);
+  memcpy(state, &ctx, sizeof(ctx));
+  mbedtls_sha256_free(&ctx);
+  return sizeof(ctx);
+}
+
+bool Firmware_SHA256::restore(const uint8_t *state, size_t size) {
+  if (size < sizeof(m_ctx)) {
+    return false;
+  }
+  mbedtls_sha256_context ctx;
+  memcpy(&ctx, state, sizeof(ctx));
+  mbedtls_sha256_free(&m_ctx);
+  mbedtls_sha256_init(&m_ctx);
+  mbedtls_sha256_clone(&m_ctx, &ctx);
+  return true;
+}
+
+uint32_t Firmware_CRC32::crc32(uint32_t crc, const uint8_t *data, size_t length) {
+#ifdef ESP_PLATFORM
+  return esp_rom_crc32_le(crc, data, length);
+#else
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+#endif
+}
+
+void Firmware_CRC32::begin() {
+  m_crc = 0;
+}
+
+void Firmware_CRC32::update(const uint8_t *data, size_t length) {
+  m_crc = crc32(m_crc, data, length);
+}
+
+void Firmware_CRC32::finish(char *hex) {
+  sprintf(hex, "%08x", m_crc);
+}
+
+size_t Firmware_CRC32::save(uint8_t *state, size_t size) {
+  if (size < sizeof(m_crc)) {
+    return 0;
+  }
+  memcpy(state, &m_crc, sizeof(m_crc));
+  return sizeof(m_crc);
+}
+
+bool Firmware_CRC32::restore(const uint8_t *state, size_t size) {
+  if (size < sizeof(m_crc)) {
+    return false;
+  }
+  memcpy(&m_crc, state, sizeof(m_crc));
+  return true;
+}
+
+bool Firmware_CRC32::verify(const char *hex, const char *expected) {
+  if (Firmware_Hash::verify(hex, expected)) {
+    return true;
+  }
+  // Same value printed from its little endian bytes
+  uint32_t crc = strtoul(hex, NULL, 16);
+  char swapped[9];
+  sprintf(swapped, "%08x", (unsigned int)(((crc & 0xFF) << 24) | ((crc & 0xFF00) << 8) | ((crc >> 8) & 0xFF00) | (crc >> 24)));
+  return !strcasecmp(swapped, expected);
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool Firmware_Writer::begin(size_t size) {
+  abort();
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (!partition || size > partition->size) {
+    return false;
+  }
+  m_partition = partition;
+  return true;
+}
+
+bool Firmware_Writer::resume(const char *label, size_t size, size_t offset) {
+  abort();
+  // Never resume into a partition that is no longer the update target,
+  // e.g. after an ArduinoOTA upload swapped the running partition.
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (!partition || strncmp(partition->label, label, sizeof(partition->label)) || size > partition->size || offset > partition->size) {
+    return false;
+  }
+  // Bytes past offset may hold a rejected or interrupted chunk, flash cannot be
+  // rewritten in place so the sector holding offset is erased and its prefix restored.
+  size_t sector = offset / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+  if (offset > sector) {
+    size_t prefix = offset - sector;
+    uint8_t *buffer = (uint8_t *)malloc(prefix);
+    bool result = buffer
+      && (esp_partition_read(partition, sector, buffer, prefix) == ESP_OK)
+      && (esp_partition_erase_range(partition, sector, SPI_FLASH_SEC_SIZE) == ESP_OK)
+      && (esp_partition_write(partition, sector, buffer, prefix) == ESP_OK);
+    free(buffer);
+    if (!result) {
+      return false;
+    }
+    sector += SPI_FLASH_SEC_SIZE;
+  }
+  m_partition = partition;
+  m_offset = offset;
+  m_erased = sector;
+  return true;
+}
+
+size_t Firmware_Writer::write(const uint8_t *data, size_t length) {
+  if (!m_partition || m_offset + length > m_partition->size) {
+    return 0;
+  }
+  while (m_erased < m_offset + length) {
+    if (esp_partition_erase_range(m_partition, m_erased, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+      return 0;
+    }
+    m_erased += SPI_FLASH_SEC_SIZE;
+  }
+  if (esp_partition_write(m_partition, m_offset, data, length) != ESP_OK) {
+    return 0;
+  }
+  m_offset += length;
+  return length;
+}
+
+bool Firmware_Writer::end() {
+  if (!m_partition) {
+    return false;
+  }
+  // Validates the image before switching the boot partition
+  bool result = esp_ota_set_boot_partition(m_partition) == ESP_OK;
+  abort();
+  return result;
+}
+
+void Firmware_Writer::abort() {
+  m_partition = NULL;
+  m_offset = 0;
+  m_erased = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+#ifdef USE_FW_PEER
+
+bool Firmware_Peer::begin(const Firmware_Target &target) {
+  if (m_server) {
+    return true;
+  }
+  const esp_partition_t *partition = esp_ota_get_running_partition();
+  if (!partition || !target.size || target.size > partition->size) {
+    return false;
+  }
+  m_size = target.size;
+  m_server = new WebServer(Default_Firmware_Peer_Port);
+  const char *headers[] = { "Range" };
+  m_server->collectHeaders(headers, 1);
+  m_server->on("/firmware.bin", HTTP_GET, [this]() { serve(); });
+  m_server->begin();
+
+  MDNS.addService(Default_Firmware_Peer_Service, "tcp", Default_Firmware_Peer_Port);
+  MDNS.addServiceTxt(Default_Firmware_Peer_Service, "tcp", "title", target.title);
+  MDNS.addServiceTxt(Default_Firmware_Peer_Service, "tcp", "version", target.version);
+  MDNS.addServiceTxt(Default_Firmware_Peer_Service, "tcp", "checksum", target.checksum);
+  MDNS.addServiceTxt(Default_Firmware_Peer_Service, "tcp", "size", String(target.size).c_str());
+  return true;
+}
+
+void Firmware_Peer::handle() {
+  if (!m_server) {
+    return;
+  }
+  m_server->handleClient();
+  if (!m_sending) {
+    return;
+  }
+
+  // A slice per pass, the main loop and MQTT keep running while a peer downloads
+  const esp_partition_t *partition = esp_ota_get_running_partition();
+  uint8_t buffer[512];
+  uint32_t slice = 0;
+  while ((m_offset <= m_end) && (slice < Default_Firmware_Peer_Slice) && m_client.connected()) {
+    size_t length = min((uint32_t)sizeof(buffer), m_end + 1 - m_offset);
+    if ((esp_partition_read(partition, m_offset, buffer, length) != ESP_OK) || (m_client.write(buffer, length) != length)) {
+      break;
+    }
+    m_offset += length;
+    slice += length;
+  }
+  if ((m_offset > m_end) || (slice < Default_Firmware_Peer_Slice)) {
+    m_client.stop();
+    m_sending = false;
+  }
+}
+
+bool Firmware_Peer::find(const char *title, const char *version, const char *checksum, String &url, uint32_t &size) {
+  int count = MDNS.queryService(Default_Firmware_Peer_Service, "tcp");
+  for (int i = 0; i < count; i++) {
+    if ((MDNS.txt(i, "title") == title) && (MDNS.txt(i, "version") == version)
+      && MDNS.txt(i, "checksum").equalsIgnoreCase(checksum)) {
+      size = MDNS.txt(i, "size").toInt();
+      if (!size) {
+        continue;
+      }
+      url = "http://" + MDNS.IP(i).toString() + ":" + String(MDNS.port(i)) + "/firmware.bin";
+      return true;
+    }
+  }
+  return false;
+}
+
+// Answers GET /firmware.bin with the whole image or a single "bytes=start-[end]" range.
+// Only the headers are sent here, handle() streams the body.
+void Firmware_Peer::serve() {
+  uint32_t start = 0;
+  uint32_t end = m_size - 1;
+  bool partial = m_server->hasHeader("Range");
+  if (partial) {
+    String range = m_server->header("Range");
+    char *next = NULL;
+    if (!range.startsWith("bytes=")) {
+      m_server->send(416, "text/plain", "");
+      return;
+    }
+    start = strtoul(range.c_str() + 6, &next, 10);
+    if ((*next == '-') && isdigit(next[1])) {
+      end = strtoul(next + 1, NULL, 10);
+    }
+    if ((start > end) || (end >= m_size)) {
+      m_server->send(416, "text/plain", "");
+      return;
+    }
+    m_server->sendHeader("Content-Range", "bytes " + String(start) + "-" + String(end) + "/" + String(m_size));
+  }
+  m_server->setContentLength(end - start + 1);
+  m_server->send(partial ? 206 : 200, "application/octet-stream", "");
+
+  // The body is sent by handle(), a newer request takes over
+  m_client.stop();
+  m_client = m_server->client();
+  m_offset = start;
+  m_end = end;
+  m_sending = true;
+}
+
+#endif
+
+/*----------------------------------------------------------------------------*/
+
+#define HEATSHRINK_MIN_WINDOW_BITS 4
+#define HEATSHRINK_MAX_WINDOW_BITS 12   // 4 KB window at most
+#define HEATSHRINK_DEFAULT_WINDOW_BITS 10
+#define HEATSHRINK_DEFAULT_LOOKAHEAD_BITS 4
+
+enum {
+  HEATSHRINK_TAG,
+  HEATSHRINK_LITERAL,
+  HEATSHRINK_INDEX,
+  HEATSHRINK_COUNT,
+};
+
+bool Firmware_Heatshrink::parse(const char *encoding, uint8_t &windowBits, uint8_t &lookaheadBits) {
+  if (strncmp(encoding, "heatshrink", strlen("heatshrink"))) {
+    return false;
+  }
+  encoding += strlen("heatshrink");
+  if (*encoding == '\0') {
+    windowBits = HEATSHRINK_DEFAULT_WINDOW_BITS;
+    lookaheadBits = HEATSHRINK_DEFAULT_LOOKAHEAD_BITS;
+    return true;
+  }
+  int window = 0, lookahead = 0;
+  if (sscanf(encoding, ":%d,%d", &window, &lookahead) != 2
+    || window < HEATSHRINK_MIN_WINDOW_BITS || window > HEATSHRINK_MAX_WINDOW_BITS
+    || lookahead < 3 || lookahead >= window) {
+    return false;
+  }
+  windowBits = window;
+  lookaheadBits = lookahead;
+  return true;
+}
+
+bool Firmware_Heatshrink::begin(uint8_t windowBits, uint8_t lookaheadBits) {
+  end();
+  // The encoder may reference the zero filled window before the first byte
+  m_window = (uint8_t*)calloc(1, 1UL << windowBits);
+  if (!m_window) {
+    return false;
+  }
+  m_windowBits = windowBits;
+  m_lookaheadBits = lookaheadBits;
+  m_head = 0;
+  memset(&m_state, 0, sizeof(m_state));
+  return true;
+}
+
+bool Firmware_Heatshrink::restore(const State &state, const esp_partition_t *partition, size_t outputOffset) {
+  if (!m_window || !partition) {
+    return false;
+  }
+  const uint32_t windowSize = 1UL << m_windowBits;
+  const uint32_t mask = windowSize - 1;
+  uint8_t buffer[256];
+  size_t position = outputOffset > windowSize ? outputOffset - windowSize : 0;
+  while (position < outputOffset) {
+    size_t length = min(sizeof(buffer), outputOffset - position);
+    if (esp_partition_read(partition, position, buffer, length) != ESP_OK) {
+      return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+      m_window[(position + i) & mask] = buffer[i];
+    }
+    position += length;
+  }
+  m_head = outputOffset;
+  m_state = state;
+  return true;
+}
+
+bool Firmware_Heatshrink::write(const uint8_t *data, size_t length, Firmware_Stage &next) {
+  if (!m_window) {
+    return false;
+  }
+  const uint32_t mask = (1UL << m_windowBits) - 1;
+  uint8_t output[128];
+  size_t outputLength = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    for (uint8_t bit = 0x80; bit; bit >>= 1) {
+      m_state.value = (m_state.value << 1) | ((data[i] & bit) ? 1 : 0);
+      m_state.bits++;
+
+      uint16_t count = 0;
+      switch (m_state.phase) {
+        case HEATSHRINK_TAG:
+          m_state.phase = m_state.value ? HEATSHRINK_LITERAL : HEATSHRINK_INDEX;
+          break;
+        case HEATSHRINK_LITERAL:
+          if (m_state.bits < 8) {
+            continue;
+          }
+          m_state.index = 0;
+          count = 1;
+          break;
+        case HEATSHRINK_INDEX:
+          if (m_state.bits < m_windowBits) {
+            continue;
+          }
+          m_state.index = m_state.value + 1;
+          m_state.phase = HEATSHRINK_COUNT;
+          break;
+        case HEATSHRINK_COUNT:
+          if (m_state.bits < m_lookaheadBits) {
+            continue;
+          }
+          count = m_state.value + 1;
+          break;
+        default:
+          return false;
+      }
+
+      // Literal (index 0) or back-reference, both go through the window
+      for (uint16_t n = 0; n < count; n++) {
+        uint8_t c = m_state.index ? m_window[(m_head - m_state.index) & mask] : (uint8_t)m_state.value;
+        m_window[m_head & mask] = c;
+        m_head++;
+        output[outputLength++] = c;
+        if (outputLength == sizeof(output)) {
+          if (!next.write(output, outputLength)) {
+            return false;
+          }
+          outputLength = 0;
+        }
+      }
+      if (count) {
+        m_state.phase = HEATSHRINK_TAG;
+      }
+      m_state.value = 0;
+      m_state.bits = 0;
+    }
+  }
+  return outputLength ? next.write(output, outputLength) : true;
+}
+
+void Firmware_Heatshrink::end() {
+  if (m_window) {
+    free(m_window);
+    m_window = NULL;
+  }
+}
@@ -8,13 +8,47 @@
 #ifndef thingsboard_h
 #define thingsboard_h
 
-#include <Update.h>
+#include <FS.h>
+#include <SPIFFS.h>
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include "fwpatch.h"
+#include <esp_rom_md5.h>
+#include <mbedtls/sha256.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#ifdef USE_FW_PEER
+#include <WebServer.h>
+#include <ESPmDNS.h>
+#endif
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include "ArduinoJson/Polyfills/type_traits.hpp"
 
 #define Default_Payload 1500
+#define Default_Log_Size 128            // Formatted log messages are cut to this length
 #define Default_Fields_Amt 64
+#define Default_Max_Requests 8          // Attribute and RPC requests waiting for their response
+#define Default_Request_Timeout 5000
+#define Default_Max_Gateway_Devices 8   // Child devices with RPC callbacks in gateway mode
+#define Default_Provision_Timeout 10000
+#define Default_Firmware_Cursor_File "/fwcursor.bin"
+#define Default_Firmware_Target_File "/fwtarget.bin"
+#define Default_Firmware_Max_Failures 3 // Broken downloads of one image before it is given up
+// Bounds of the adaptive OTA chunk size, both must be powers of two
+#define Default_Min_Chunk_Size 512
+#define Default_Max_Chunk_Size 16384
+#define Default_Chunk_Overhead 50       // MQTT header and topic of a chunk response
+#define Default_Chunk_Timeout 3000
+#define Default_Chunk_Fast_Rtt 500      // Chunks answered faster than this grow the chunk size
+#define Default_Chunk_Slow_Rtt 2000     // Chunks answered slower than this shrink it
+#define Default_Hash_State_Size 160     // Room for the intermediate state of any Firmware_Hash
+#define Default_Http_Timeout 10000      // Stalled HTTP firmware downloads are reconnected after this
+#define Default_Http_Loop_Interval (MQTT_KEEPALIVE * 500UL)  // MQTT is serviced this often during HTTP downloads
+#define Default_Firmware_Peer_Port 8266
+#define Default_Firmware_Peer_Service "udawa-fw"
+#define Default_Firmware_Peer_Slice 4096    // Image bytes sent to a peer per loop pass
+#define Default_Firmware_Attributes "fw_checksum,fw_checksum_algorithm,fw_size,fw_title,fw_version,fw_encoding,fw_patch_base,fw_chunk_crc,fw_chunk_crc_size,fw_url"
 
 class ThingsBoardDefaultLogger;
 
@@ -91,6 +125,18 @@ using callbackData = JsonObject;
 using Shared_Attribute_Data = JsonObject;
 using Provision_Data = JsonObject;
 
+// Response to a shared attributes or server RPC request, data is null when the
+// request timed out
+using Response_Callback = void (*)(unsigned int requestId, const JsonObject &data);
+
+// Request waiting for its response, matched by request id
+struct Pending_Request {
+  unsigned int m_id;
+  Response_Callback m_cb;
+  unsigned long m_start;
+  unsigned long m_timeout;
+};
+
 // Generic Callback wrapper
 class GenericCallback {
     template <size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
@@ -114,12 +160,303 @@ class GenericCallback {
     processFn   m_cb;       // Callback to call
 };
 
+// RPC callbacks of a child device fronted through the Gateway API
+struct Gateway_Device {
+  const char *m_name;
+  const GenericCallback *m_callbacks;
+  size_t m_callbacksSize;
+};
+
 class ThingsBoardDefaultLogger
 {
   public:
     static void log(const char *msg);
 };
 
+// Log levels, a message is logged when its level is at most the level of the logger
+#define TB_LOG_NONE 0
+#define TB_LOG_ERROR 1
+#define TB_LOG_WARN 2
+#define TB_LOG_INFO 3
+#define TB_LOG_DEBUG 4
+#ifndef TB_LOG_LEVEL
+#define TB_LOG_LEVEL TB_LOG_INFO
+#endif
+
+// Logger policy with its own level, passes enabled messages to Sink.
+// ThingsBoardSized<1500, 64, ThingsBoardLevelLogger<TB_LOG_WARN>> only logs errors and warnings.
+template<uint8_t Level, typename Sink = ThingsBoardDefaultLogger>
+class ThingsBoardLevelLogger
+{
+  public:
+    static const uint8_t level = Level;
+    static inline void log(const char *msg) { Sink::log(msg); }
+};
+
+// Level of a logger policy, TB_LOG_LEVEL for loggers that do not declare one
+template<typename T>
+struct Logger_Void { typedef void type; };
+
+template<typename Logger, typename = void>
+struct Logger_Level { static const uint8_t value = TB_LOG_LEVEL; };
+
+template<typename Logger>
+struct Logger_Level<Logger, typename Logger_Void<decltype(Logger::level)>::type> { static const uint8_t value = Logger::level; };
+
+// Writes a message to the logger, formatting only happens for enabled levels.
+// Disabled levels are not instantiated, the call and its formatting compile to nothing.
+template<typename Logger, bool Enabled>
+struct Logger_Sink {
+  static inline void write(const char *msg) { Logger::log(msg); }
+
+  template<typename... Args>
+  static void write(const char *format, Args... args) {
+    char msg[Default_Log_Size];
+    snprintf(msg, sizeof(msg), format, args...);
+    Logger::log(msg);
+  }
+};
+
+template<typename Logger>
+struct Logger_Sink<Logger, false> {
+  template<typename... Args>
+  static inline void write(const char *, Args...) { }
+};
+
+// Checksum algorithms announced by the fw_checksum_algorithm shared attribute
+enum Firmware_Hash_Algorithm : uint8_t {
+  FIRMWARE_HASH_NONE,
+  FIRMWARE_HASH_MD5,
+  FIRMWARE_HASH_SHA256,
+  FIRMWARE_HASH_CRC32,
+};
+
+// Incremental firmware checksum. The intermediate state can be saved and
+// restored, so verification continues across resumed downloads.
+class Firmware_Hash
+{
+  public:
+    virtual void begin() = 0;
+    virtual void update(const uint8_t *data, size_t length) = 0;
+    // Writes the digest as lower case hex, hex must hold 65 characters.
+    virtual void finish(char *hex) = 0;
+    // Copies the intermediate state to state, returns its size or 0 if it does not fit.
+    virtual size_t save(uint8_t *state, size_t size) = 0;
+    virtual bool restore(const uint8_t *state, size_t size) = 0;
+    // Compares the digest returned by finish with the expected checksum.
+    virtual bool verify(const char *hex, const char *expected) {
+      return !strcasecmp(hex, expected);
+    }
+
+    static Firmware_Hash_Algorithm algorithm(const char *name);
+};
+
+class Firmware_MD5 : public Firmware_Hash
+{
+  public:
+    void begin() override;
+    void update(const uint8_t *data, size_t length) override;
+    void finish(char *hex) override;
+    size_t save(uint8_t *state, size_t size) override;
+    bool restore(const uint8_t *state, size_t size) override;
+
+  private:
+    md5_context_t m_ctx;
+};
+
+// Uses the SHA accelerator on ESP32 through mbedtls, plain mbedtls elsewhere.
+class Firmware_SHA256 : public Firmware_Hash
+{
+  public:
+    inline Firmware_SHA256() { mbedtls_sha256_init(&m_ctx); }
+    inline ~Firmware_SHA256() { mbedtls_sha256_free(&m_ctx); }
+    void begin() override;
+    void update(const uint8_t *data, size_t length) override;
+    void finish(char *hex) override;
+    size_t save(uint8_t *state, size_t size) override;
+    bool restore(const uint8_t *state, size_t size) override;
+
+  private:
+    mbedtls_sha256_context m_ctx;
+};
+
+class Firmware_CRC32 : public Firmware_Hash
+{
+  public:
+    inline Firmware_CRC32() : m_crc(0) { }
+    void begin() override;
+    void update(const uint8_t *data, size_t length) override;
+    void finish(char *hex) override;
+    size_t save(uint8_t *state, size_t size) override;
+    bool restore(const uint8_t *state, size_t size) override;
+    // Also accepts the little endian hex form some servers print.
+    bool verify(const char *hex, const char *expected) override;
+
+    // IEEE CRC32 that can be chained, crc32(0, data) starts a new one.
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length);
+
+  private:
+    uint32_t m_crc;
+};
+
+// Image encodings announced by the fw_encoding shared attribute
+enum Firmware_Encoding : uint8_t {
+  FIRMWARE_ENCODING_NONE,
+  FIRMWARE_ENCODING_HEATSHRINK,
+};
+
+// Streaming decoder for heatshrink (LZSS) compressed images, compatible with
+// `heatshrink -e -w <windowBits> -l <lookaheadBits>`. The window is the last
+// 2^windowBits bytes of output, so after a reboot it is rebuilt from flash and
+// only the bit reader state has to be persisted. That needs the output to be the
+// image itself, compressed patches are refused.
+class Firmware_Heatshrink
+{
+  public:
+    struct State {
+      uint8_t phase;
+      uint8_t bits;       // Bits read of the current field
+      uint16_t value;     // Field value read so far
+      uint16_t index;     // Back-reference distance of the pending count
+    };
+
+    inline Firmware_Heatshrink()
+      : m_window(NULL), m_windowBits(0), m_lookaheadBits(0), m_head(0), m_state() { }
+    inline ~Firmware_Heatshrink() { end(); }
+
+    // Parses "heatshrink" or "heatshrink:<windowBits>,<lookaheadBits>".
+    static bool parse(const char *encoding, uint8_t &windowBits, uint8_t &lookaheadBits);
+
+    bool begin(uint8_t windowBits, uint8_t lookaheadBits);
+    // Restores the reader state and refills the window from the output written so far.
+    bool restore(const State &state, const esp_partition_t *partition, size_t outputOffset);
+    // Decodes length input bytes and passes the output to next.
+    bool write(const uint8_t *data, size_t length, Firmware_Stage &next);
+    void end();
+
+    inline const State &state() const { return m_state; }
+
+  private:
+    uint8_t *m_window;
+    uint8_t m_windowBits;
+    uint8_t m_lookaheadBits;
+    uint32_t m_head;      // Output bytes produced
+    State m_state;
+};
+
+// Download cursor of an interrupted firmware update. It is persisted after
+// every written chunk, so the next attempt (even after a reboot) continues
+// from the last committed offset instead of chunk 0.
+struct Firmware_Cursor
+{
+  uint32_t magic;
+  char title[32];
+  char version[32];
+  char checksum[68];
+  char partition[17];     // Label of the OTA partition being written
+  uint32_t size;
+  uint32_t chunkSize;
+  uint32_t offset;        // Downloaded bytes processed so far
+  uint32_t imageOffset;   // Image bytes written and hashed so far
+  uint8_t algorithm;
+  uint8_t hash[Default_Hash_State_Size];  // Intermediate hash state at imageOffset
+  uint8_t encoding;
+  uint8_t windowBits;
+  uint8_t lookaheadBits;
+  Firmware_Heatshrink::State decoder;
+  bool patch;             // Image is a delta against the running partition
+  Firmware_Patch::State patchState;
+
+  // Starts a new cursor for the given target.
+  void reset(const char *fwTitle, const char *fwVersion, const char *fwChecksum, uint32_t fwSize, uint32_t fwChunkSize);
+  // Returns true if the cursor belongs to the given target.
+  bool matches(const char *fwTitle, const char *fwVersion, const char *fwChecksum, uint32_t fwSize) const;
+  bool load();
+  bool save() const;
+  void clear();
+};
+
+// Last firmware target handled by Firmware_Update, persisted in SPIFFS so pushed
+// or requested fw_* attributes only trigger an update when the target changes.
+struct Firmware_Target
+{
+  uint32_t magic;
+  char title[32];
+  char version[32];
+  char checksum[68];
+  uint32_t size;           // Size of the written image, 0 unless it was applied
+  char currTitle[32];     // Running firmware last reported to the server
+  char currVersion[32];
+  char failedChecksum[68];  // Image whose downloads failed verification
+  uint8_t failures;
+
+  void set(const char *fwTitle, const char *fwVersion, const char *fwChecksum, uint32_t fwSize);
+  void report(const char *fwTitle, const char *fwVersion);
+  // Counts a failed verification of the image, returns the failures in a row.
+  uint8_t fail(const char *fwChecksum);
+  bool matches(const char *fwTitle, const char *fwVersion, const char *fwChecksum) const;
+  bool reported(const char *fwTitle, const char *fwVersion) const;
+  bool load();
+  bool save() const;
+};
+
+// Writes a firmware image straight into the next OTA partition.
+// Unlike Update, writing can be resumed at any offset that was written before,
+// because sectors are erased lazily as the write position enters them.
+class Firmware_Writer
+{
+  public:
+    inline Firmware_Writer()
+      : m_partition(NULL), m_offset(0), m_erased(0) { }
+
+    // Selects the next OTA partition and starts writing at offset 0.
+    bool begin(size_t size);
+    // Reopens the given OTA partition and continues writing at offset.
+    bool resume(const char *label, size_t size, size_t offset);
+    size_t write(const uint8_t *data, size_t length);
+    // Marks the written partition as the boot partition.
+    bool end();
+    void abort();
+
+    inline bool isRunning() const { return m_partition != NULL; }
+    inline size_t offset() const { return m_offset; }
+    inline const esp_partition_t *partition() const { return m_partition; }
+
+  private:
+    const esp_partition_t *m_partition;
+    size_t m_offset;
+    size_t m_erased;
+};
+
+#ifdef USE_FW_PEER
+// Shares the running firmware with other devices on the LAN: a small HTTP server
+// with Range support reads the running partition and mDNS announces the image as
+// a Default_Firmware_Peer_Service service. mDNS must be started, ArduinoOTA does it.
+class Firmware_Peer
+{
+  public:
+    inline Firmware_Peer()
+      : m_server(NULL), m_size(0), m_client(), m_sending(false), m_offset(0), m_end(0) { }
+
+    // Starts serving the running image described by target.
+    bool begin(const Firmware_Target &target);
+    // Answers requests and sends the next slice of a running transfer, call it every loop.
+    void handle();
+    // Looks for a peer serving the given image, sets its url and image size.
+    static bool find(const char *title, const char *version, const char *checksum, String &url, uint32_t &size);
+
+  private:
+    void serve();
+
+    WebServer *m_server;
+    uint32_t m_size;
+    WiFiClient m_client;    // Peer of the running transfer
+    bool m_sending;
+    uint32_t m_offset;      // Next image byte to send, the transfer ends after m_end
+    uint32_t m_end;
+};
+#endif
+
 // ThingsBoardSized client class
 template<size_t PayloadSize = Default_Payload,
          size_t MaxFieldsAmt = Default_Fields_Amt,
@@ -134,17 +471,45 @@ class ThingsBoardSized
     inline ThingsBoardSized(Client &client)
       : m_client(client)
       , m_requestId(0)
+      , m_subscribed(false)
+      , m_connectedAt(0)
+      , m_requests()
+      , m_gwDevices()
+      , m_gwBatch(NULL)
       , m_fwVersion("")
       , m_fwTitle("")
       , m_fwChecksum("")
       , m_fwChecksumAlgorithm("")
+      , m_fwEncoding("")
+      , m_fwPatchBase("")
+      , m_fwChunkCrc("")
+      , m_fwUrl("")
       , m_fwState("")
       , m_fwSize(0)
+      , m_fwChunkCrcSize(0)
+      , m_fwBlockSize(0)
+      , m_fwBlockCrc(0)
       , m_fwChunkReceive(-1)
+      , m_fwCursor()
+      , m_fwWriter()
+      , m_fwDecoder()
+      , m_fwPatch()
+      , m_fwMD5()
+      , m_fwSHA256()
+      , m_fwCRC32()
+      , m_fwHash(NULL)
+      , m_fwCaCert(NULL)
+      , m_fwTarget()
+      , m_fwPending(false)
+      , m_fwCurrTitle(NULL)
+      , m_fwCurrVersion(NULL)
+      , m_fwImage(*this)
     { }
 
     // Destroys ThingsBoardSized class with network client.
-    inline ~ThingsBoardSized() { }
+    inline ~ThingsBoardSized() {
+      delete m_gwBatch;
+    }
 
     bool beginPublish(const char* topic, unsigned int plength, boolean retained){
       return m_client.beginPublish(topic, plength, retained);
@@ -180,14 +545,18 @@ class ThingsBoardSized
         return false;
       }
       this->callbackUnsubscribe(); // Cleanup all RPC subscriptions
-      if (!strcmp(access_token, "provision")) {
-        provision_mode = true;
-      }
+      provision_mode = !strcmp(access_token, "provision");
       m_client.setServer(host, port);
       bool connection_result = m_client.connect(client_id, access_token, password);
+      m_connectedAt = millis();
       return connection_result;
     }
 
+    // True while connected with the provisioning credentials
+    inline bool provisioning() {
+      return provision_mode && m_client.connected();
+    }
+
     // Disconnects from ThingsBoard. Returns true on success.
     inline void disconnect() {
       m_client.disconnect();
@@ -200,7 +569,17 @@ class ThingsBoardSized
 
     // Executes an event loop for PubSub client.
     inline void loop() {
+#ifdef USE_FW_PEER
+      m_fwPeer.handle();
+#endif
       m_client.loop();
+      Requests_Sweep();
+
+      // Give up a provisioning session the server does not answer, the caller retries
+      if (provision_mode && m_client.connected() && (millis() - m_connectedAt > Default_Provision_Timeout)) {
+        log<TB_LOG_WARN>("Provision response timed out");
+        m_client.disconnect();
+      }
     }
 
     //----------------------------------------------------------------------------
@@ -233,8 +612,8 @@ class ThingsBoardSized
       char requestPayload[objectSize];
       serializeJson(requestObject, requestPayload, objectSize);
 
-      Logger::log("Provision request:");
-      Logger::log(requestPayload);
+      log<TB_LOG_DEBUG>("Provision request:");
+      log<TB_LOG_DEBUG>(requestPayload);
       return m_client.publish("/provision/request", requestPayload);
     }
     //----------------------------------------------------------------------------
@@ -272,20 +651,21 @@ class ThingsBoardSized
     bool callbackSubscribe(const GenericCallback *callbacks, size_t callbacksSize)
     {
       if (callbacksSize > sizeof(m_genericCallbacks) / sizeof(*m_genericCallbacks)){return false;}
-      if (ThingsBoardSized::m_subscribedInstance){return false;}
+      if (m_subscribed){return false;}
       if (!m_client.subscribe("/provision/response")){return false;}
+      // Provisioning credentials may only use the provisioning topics
+      if (provision_mode) {
+        Callbacks_Attach(callbacks, callbacksSize);
+        return true;
+      }
       if (!m_client.subscribe("v1/devices/me/rpc/request/+")){return false;}
+      if (!m_client.subscribe("v1/devices/me/rpc/response/+")){return false;}
       if (!m_client.subscribe("v1/devices/me/attributes/response/+")){return false;}
       if (!m_client.subscribe("v1/devices/me/attributes")){return false;}
       if (!m_client.subscribe("v2/fw/response/#")){return false;}
+      if (Gateway_Devices() && !m_client.subscribe("v1/gateway/rpc")){return false;}
 
-      ThingsBoardSized::m_subscribedInstance = this;
-      for (size_t i = 0; i < callbacksSize; ++i) {
-        m_genericCallbacks[i] = callbacks[i];
-      }
-
-      m_client.setCallback(ThingsBoardSized::on_message);
-
+      Callbacks_Attach(callbacks, callbacksSize);
       return true;
     }
 
@@ -296,16 +676,57 @@ class ThingsBoardSized
       bool flag3 = m_client.unsubscribe("v1/devices/me/attributes");
       bool flag4 = m_client.unsubscribe("v2/fw/response/#");
       bool flag5 = m_client.unsubscribe("/provision/response");
-      ThingsBoardSized::m_subscribedInstance = NULL;
-      return (flag1 && flag2 && flag3 && flag4 && flag5);
+      bool flag6 = m_client.unsubscribe("v1/devices/me/rpc/response/+");
+      bool flag7 = !Gateway_Devices() || m_client.unsubscribe("v1/gateway/rpc");
+      m_subscribed = false;
+      return (flag1 && flag2 && flag3 && flag4 && flag5 && flag6 && flag7);
     }
 
     //----------------------------------------------------------------------------
     // Firmware OTA API
+
+    // CA certificate checked when the image is downloaded from an HTTPS fw_url,
+    // the string must stay valid while updates run
+    inline void Firmware_Set_CA_Cert(const char *caCert) {
+      m_fwCaCert = caCert;
+    }
+
+    // Requests the firmware target without waiting for it. The answer, like any pushed
+    // fw_* update, marks an update as pending when the target differs from the last one
+    // handled, Firmware_Update is then called by the application.
+    bool Firmware_Check(const char* currFwTitle, const char* currFwVersion) {
+      m_fwCurrTitle = currFwTitle;
+      m_fwCurrVersion = currFwVersion;
+      if (!m_fwTarget.magic && !m_fwTarget.load()) {
+        memset(&m_fwTarget, 0, sizeof(m_fwTarget));
+      }
+#ifdef USE_FW_PEER
+      // Running the image it downloaded and verified, share it with the LAN
+      if (m_fwTarget.size && !strcmp(m_fwTarget.title, currFwTitle) && !strcmp(m_fwTarget.version, currFwVersion)) {
+        m_fwPeer.begin(m_fwTarget);
+      }
+#endif
+      Firmware_Clear_Attributes();
+
+      // Report the running firmware once, not on every reconnect
+      if (!m_fwTarget.reported(currFwTitle, currFwVersion)) {
+        if (!Firmware_Send_FW_Info(currFwTitle, currFwVersion)) {
+          return false;
+        }
+        m_fwTarget.report(currFwTitle, currFwVersion);
+        m_fwTarget.save();
+      }
+
+      return Shared_Attributes_Request(Default_Firmware_Attributes);
+    }
+
+    // True once a firmware target different from the last handled one was received
+    inline bool Firmware_Pending() const {
+      return m_fwPending;
+    }
+
     bool Firmware_Update(const char* currFwTitle, const char* currFwVersion) {
       m_fwState.clear();
-      m_fwTitle.clear();
-      m_fwVersion.clear();
 
       // Send current firmware version
       if (!Firmware_Send_FW_Info(currFwTitle, currFwVersion)) {
@@ -315,8 +736,12 @@ class ThingsBoardSized
       // Update state
       Firmware_Send_State("CHECKING FIRMWARE");
 
+      // Always ask for the whole set, a pushed update only carries the keys that changed
+      // and the optional ones left from an earlier target must not apply to this one
+      Firmware_Clear_Attributes();
+
       // Request the firmware informations
-      if (!Shared_Attributes_Request("fw_checksum,fw_checksum_algorithm,fw_size,fw_title,fw_version")) {
+      if (!Shared_Attributes_Request(Default_Firmware_Attributes)) {
         return false;
       }
 
@@ -326,99 +751,236 @@ class ThingsBoardSized
         delay(5);
         loop();
       } while (m_fwVersion.isEmpty() && m_fwTitle.isEmpty() && (timeout >= millis()));
+      m_fwPending = false;
 
       // Check if firmware is available for our device
       if (m_fwVersion.isEmpty() || m_fwTitle.isEmpty()) {
-        Logger::log("No firmware found !");
+        log<TB_LOG_WARN>("No firmware found !");
         Firmware_Send_State("NO FIRMWARE FOUND");
         return false;
       }
 
       // If firmware is the same, we do not update it
       if ((String(currFwTitle) == m_fwTitle) and (String(currFwVersion) == m_fwVersion)) {
-        Logger::log("Firmware is already up to date !");
+        log<TB_LOG_INFO>("Firmware is already up to date !");
         Firmware_Send_State("UP TO DATE");
+        Firmware_Settle();
         return false;
       }
 
       // If firmware title is not the same, we quit now
       if (String(currFwTitle) != m_fwTitle) {
-        Logger::log("Firmware is not for us (title is different) !");
+        log<TB_LOG_WARN>("Firmware is not for us (title is different) !");
         Firmware_Send_State("NO FIRMWARE FOUND");
+        Firmware_Settle();
         return false;
       }
 
-      if (m_fwChecksumAlgorithm != "MD5") {
-        Logger::log("Checksum algorithm is not supported, please use MD5 only");
-        Firmware_Send_State("CHKS IS NOT MD5");
+      Firmware_Hash_Algorithm algorithm = Firmware_Hash::algorithm(m_fwChecksumAlgorithm.c_str());
+      if (algorithm == FIRMWARE_HASH_NONE) {
+        log<TB_LOG_WARN>("Checksum algorithm is not supported, please use MD5, SHA256 or CRC32");
+        Firmware_Send_State("CHKS IS NOT SUPPORTED");
+        Firmware_Settle();
         return false;
       }
 
-      Logger::log("=================================");
-      Logger::log("A new Firmware is available :");
-      Logger::log(String(String(currFwVersion) + " => " + m_fwVersion).c_str());
-      Logger::log("Try to download it...");
+      log<TB_LOG_INFO>("A new Firmware is available: %s => %s", currFwVersion, m_fwVersion.c_str());
 
-      int chunkSize = 4096;   // maybe less if we don't have enough RAM
-      int numberOfChunk = int(m_fwSize / chunkSize) + 1;
-      int currChunk = 0;
-      int nbRetry = 3;
+      // Optional CRC32 of every block of the download, a corrupted block is downloaded again
+      m_fwBlockSize = 0;
+      if (m_fwChunkCrcSize) {
+        if ((m_fwChunkCrcSize >= Default_Min_Chunk_Size) && !(m_fwChunkCrcSize & (m_fwChunkCrcSize - 1))) {
+          m_fwBlockSize = m_fwChunkCrcSize;
+        }
+        else {
+          log<TB_LOG_WARN>("Chunk CRC size must be a power of two, chunk CRCs ignored");
+        }
+      }
 
-      // Increase size of receive buffer
-      if (!m_client.setBufferSize(chunkSize + 50)) {
-        Logger::log("Not enough RAM");
+      // Compressed images are decoded on the fly, the checksum covers the decoded image
+      Firmware_Encoding encoding = FIRMWARE_ENCODING_NONE;
+      uint8_t windowBits = 0;
+      uint8_t lookaheadBits = 0;
+      if (Firmware_Heatshrink::parse(m_fwEncoding.c_str(), windowBits, lookaheadBits)) {
+        encoding = FIRMWARE_ENCODING_HEATSHRINK;
+      }
+      else if (!m_fwEncoding.isEmpty() && m_fwEncoding != "none") {
+        log<TB_LOG_WARN>("Firmware encoding is not supported");
+        Firmware_Send_State("ENCODING NOT SUPPORTED");
+        Firmware_Settle();
         return false;
       }
 
+      // A delta only applies on top of the firmware it was made from
+      bool patch = !m_fwPatchBase.isEmpty();
+      if (patch && (m_fwPatchBase != currFwVersion)) {
+        log<TB_LOG_WARN>("Firmware patch is not for our version !");
+        Firmware_Send_State("PATCH BASE MISMATCH");
+        Firmware_Settle();
+        return false;
+      }
+
+      // The decoder window is refilled from the written image on resume or rollback, a
+      // compressed patch would need the window of the patch stream instead
+      if (patch && (encoding != FIRMWARE_ENCODING_NONE)) {
+        log<TB_LOG_WARN>("Compressed firmware patches are not supported");
+        Firmware_Send_State("ENCODING NOT SUPPORTED");
+        Firmware_Settle();
+        return false;
+      }
+
+#ifdef USE_FW_PEER
+      // A verified copy on the LAN saves the uplink, the server stays the fallback
+      if (Firmware_Peer_Download(algorithm)) {
+        Firmware_Send_State(m_fwState.c_str());
+        Firmware_Settle(m_fwCursor.imageOffset);
+        return true;
+      }
+#endif
+
+      if (!Firmware_Begin(encoding, windowBits, lookaheadBits, patch, algorithm)) {
+        return false;
+      }
+
+      // Start with the largest chunk the free heap allows.
+      // With block CRCs a chunk never crosses a block boundary.
+      uint16_t bufferSize = m_client.getBufferSize();
+      uint32_t maxChunkSize = m_fwBlockSize ? min((uint32_t)Default_Max_Chunk_Size, m_fwBlockSize) : Default_Max_Chunk_Size;
+      uint32_t chunkSize = Firmware_Chunk_Size(maxChunkSize);
+      m_fwCursor.chunkSize = chunkSize;
+
+      // Stream the image over HTTP(S) when the server gives an URL, MQTT chunks are the fallback
+      if (m_fwUrl.length()) {
+        Firmware_Send_State("DOWNLOADING");
+        int nbRetry = 3;
+        while (m_fwWriter.isRunning() && nbRetry) {
+          uint32_t offset = m_fwCursor.offset;
+          if (!Firmware_Http_Download(m_fwUrl, chunkSize) && (m_fwCursor.offset <= offset)) {
+            nbRetry--;
+          }
+        }
+        if (m_fwWriter.isRunning()) {
+          log<TB_LOG_WARN>("HTTP download failed, continue with MQTT");
+          chunkSize = m_fwCursor.chunkSize;
+        }
+      }
+
+      while (m_fwWriter.isRunning() && !m_client.setBufferSize(chunkSize + Default_Chunk_Overhead)) {
+        if (chunkSize <= Default_Min_Chunk_Size) {
+          log<TB_LOG_ERROR>("Not enough RAM");
+          Firmware_Abort();
+          return false;
+        }
+        chunkSize >>= 1;
+      }
+      m_fwCursor.chunkSize = chunkSize;
+      log<TB_LOG_DEBUG>("Chunk size %u bytes", chunkSize);
+
+      int nbRetry = 3;
+      uint8_t nbFast = 0;
+      unsigned long rtt = 0;
+      unsigned long srtt = 0;     // Smoothed chunk round trip time
+
       // Update state
-      Firmware_Send_State("DOWNLOADING");
+      if (!m_fwUrl.length()) {
+        Firmware_Send_State("DOWNLOADING");
+      }
 
-      // Download the firmware
-      do {
+      // Download the firmware, the writer stops running once the last chunk is verified
+      while (m_fwWriter.isRunning()) {
+        // A restore goes back to the cursor of the last commit, written with an older chunk
+        // size. The size in use is kept, halved until it divides the offset again.
+        while ((chunkSize > Default_Min_Chunk_Size) && (m_fwCursor.offset % chunkSize)) {
+          chunkSize >>= 1;
+        }
+        m_fwCursor.chunkSize = chunkSize;
+        int currChunk = m_fwCursor.offset / chunkSize;
+        unsigned long requested = millis();
+        m_fwChunkReceive = -1;
         m_client.publish(String("v2/fw/request/0/chunk/" + String(currChunk)).c_str(), String(chunkSize).c_str());
 
-        timeout = millis() + 3000;
+        unsigned long timeout = requested + (srtt ? constrain(srtt * 4, Default_Chunk_Timeout, Default_Chunk_Timeout * 4) : Default_Chunk_Timeout);
         do {
           delay(5);
           loop();
         } while ((m_fwChunkReceive != currChunk) && (timeout >= millis()));
 
         if (m_fwChunkReceive == currChunk) {
-          // Check if chunk is not the last
-          if (numberOfChunk != (currChunk + 1))
-          {
-            // Check if state is OK
-            if ((m_fwState == "DOWNLOADING")) {
-              currChunk++;
+          rtt = millis() - requested;
+          srtt = srtt ? (srtt * 7 + rtt) / 8 : rtt;
+
+          // Check if state is OK
+          if (m_fwState == "DOWNLOADING") {
+            nbRetry = 3;
+            // Grow after a run of fast chunks, once the offset is aligned to the larger size
+            nbFast = (rtt < Default_Chunk_Fast_Rtt) ? nbFast + 1 : 0;
+            if ((nbFast >= 4) && (chunkSize < maxChunkSize) && !(m_fwCursor.offset % (chunkSize << 1))
+              && ((chunkSize << 1) + Default_Chunk_Overhead <= Firmware_Chunk_Heap_Limit())
+              && m_client.setBufferSize((chunkSize << 1) + Default_Chunk_Overhead)) {
+              chunkSize <<= 1;
+              m_fwCursor.chunkSize = chunkSize;
+              nbFast = 0;
+              log<TB_LOG_DEBUG>("Chunk size %u bytes", chunkSize);
             }
-            else {
-              nbRetry--;
-              if (nbRetry == 0) {
-                Logger::log("Unable to write firmware");
-                return false;
-              }
+            // Shrink when the link is slow; the receive buffer is kept, it is already allocated
+            else if ((rtt > Default_Chunk_Slow_Rtt) && (chunkSize > Default_Min_Chunk_Size)) {
+              chunkSize >>= 1;
+              m_fwCursor.chunkSize = chunkSize;
+              log<TB_LOG_DEBUG>("Chunk size %u bytes", chunkSize);
             }
           }
-          // The last chunk
-          else {
-            currChunk++;
+          else if (m_fwWriter.isRunning()) {
+            nbRetry--;
+            if (nbRetry == 0) {
+              log<TB_LOG_ERROR>("Unable to write firmware");
+              Firmware_Abort();
+              m_client.setBufferSize(bufferSize);
+              return false;
+            }
           }
         }
 
-        // Timeout
+        // Timeout, the cursor is kept so the next attempt resumes from here
         else {
+          nbFast = 0;
+          if (chunkSize > Default_Min_Chunk_Size) {
+            chunkSize >>= 1;
+            m_fwCursor.chunkSize = chunkSize;
+            log<TB_LOG_DEBUG>("Chunk size %u bytes", chunkSize);
+          }
           nbRetry--;
           if (nbRetry == 0) {
-            Logger::log("Unable to download firmware");
+            log<TB_LOG_ERROR>("Unable to download firmware");
+            Firmware_Abort();
+            m_client.setBufferSize(bufferSize);
             return false;
           }
         }
 
-      } while (numberOfChunk != currChunk);
+      }
+
+      m_client.setBufferSize(bufferSize);
 
       // Update state
       Firmware_Send_State(m_fwState.c_str());
 
+      // A broken image is downloaded again right away, a corruption in transit does not
+      // repeat. It is given up after a few tries until the target changes. Interrupted
+      // downloads are retried on the next check.
+      if (m_fwState == "SUCCESS") {
+        Firmware_Settle(m_fwCursor.imageOffset);
+      }
+      else if ((m_fwState == "CHECKSUM ERROR") || (m_fwState == "PATCH ERROR")) {
+        if (m_fwTarget.fail(m_fwChecksum.c_str()) >= Default_Firmware_Max_Failures) {
+          log<TB_LOG_ERROR>("Firmware failed %d times, given up", Default_Firmware_Max_Failures);
+          Firmware_Settle();
+        }
+        else {
+          m_fwTarget.save();
+          m_fwPending = true;
+        }
+      }
+
       return m_fwState == "SUCCESS" ? true : false;
     }
 
@@ -468,10 +1030,200 @@ class ThingsBoardSized
 
       return m_client.publish(String("v1/devices/me/attributes/request/" + String(m_requestId)).c_str(), buffer);
     }
+
+    // Requests shared attributes without waiting, cb receives the response or a null
+    // object after timeout. Returns the request id, 0 if the request was not sent.
+    unsigned int Shared_Attributes_Request(const char* attributes, Response_Callback cb, unsigned long timeout = Default_Request_Timeout) {
+      Pending_Request *request = Request_Register(cb, timeout);
+      if (!request) {
+        return 0;
+      }
+
+      StaticJsonDocument<JSON_OBJECT_SIZE(1)> requestBuffer;
+      JsonObject requestObject = requestBuffer.to<JsonObject>();
+
+      requestObject["sharedKeys"] = attributes;
+
+      int objectSize = measureJson(requestBuffer) + 1;
+      char buffer[objectSize];
+      serializeJson(requestObject, buffer, objectSize);
+
+      if (!m_client.publish(String("v1/devices/me/attributes/request/" + String(request->m_id)).c_str(), buffer)) {
+        request->m_id = 0;
+        return 0;
+      }
+      return request->m_id;
+    }
+
+    //----------------------------------------------------------------------------
+    // Server-side RPC API
+
+    // Calls an RPC method on the server without waiting, cb receives the response or
+    // a null object after timeout. Returns the request id, 0 if the request was not sent.
+    unsigned int RPC_Request(const char* method, const JsonVariant &params, Response_Callback cb, unsigned long timeout = Default_Request_Timeout) {
+      Pending_Request *request = Request_Register(cb, timeout);
+      if (!request) {
+        return 0;
+      }
+
+      StaticJsonDocument<PayloadSize> requestBuffer;
+      requestBuffer["method"] = method;
+      requestBuffer["params"] = params;
+
+      if (measureJson(requestBuffer) > PayloadSize - 1) {
+        log<TB_LOG_ERROR>("too small buffer for JSON data");
+        request->m_id = 0;
+        return 0;
+      }
+      char buffer[PayloadSize];
+      serializeJson(requestBuffer, buffer, sizeof(buffer));
+
+      if (!m_client.publish(String("v1/devices/me/rpc/request/" + String(request->m_id)).c_str(), buffer)) {
+        request->m_id = 0;
+        return 0;
+      }
+      return request->m_id;
+    }
+
+    //----------------------------------------------------------------------------
+    // Gateway API, the connection must belong to a gateway device
+
+    // Announces a child device, the server creates it on first use
+    bool Gateway_Connect(const char *device, const char *type = "default") {
+      StaticJsonDocument<JSON_OBJECT_SIZE(2)> requestBuffer;
+      requestBuffer["device"] = device;
+      requestBuffer["type"] = type;
+
+      char buffer[PayloadSize];
+      serializeJson(requestBuffer, buffer, sizeof(buffer));
+      return m_client.publish("v1/gateway/connect", buffer);
+    }
+
+    bool Gateway_Disconnect(const char *device) {
+      StaticJsonDocument<JSON_OBJECT_SIZE(1)> requestBuffer;
+      requestBuffer["device"] = device;
+
+      char buffer[PayloadSize];
+      serializeJson(requestBuffer, buffer, sizeof(buffer));
+      return m_client.publish("v1/gateway/disconnect", buffer);
+    }
+
+    // Queues telemetry of a child device. Values of several devices are sent in one
+    // publish by Gateway_Telemetry_Flush, or earlier when the batch is full.
+    bool Gateway_Telemetry_Add(const char *device, const JsonObject &values) {
+      if (!m_gwBatch) {
+        // Values take more room in the document than once serialized
+        m_gwBatch = new DynamicJsonDocument(PayloadSize * 2);
+        if (!m_gwBatch->capacity()) {
+          log<TB_LOG_ERROR>("Not enough RAM");
+          delete m_gwBatch;
+          m_gwBatch = NULL;
+          return false;
+        }
+      }
+      // Send the queued values first when these would not fit next to them
+      if (m_gwBatch->size() && (measureJson(*m_gwBatch) + measureJson(values) + strlen(device) + 6 > PayloadSize - 1)
+        && !Gateway_Telemetry_Flush()) {
+        return false;
+      }
+      JsonArray records = (*m_gwBatch)[device];
+      if (records.isNull()) {
+        // A char* key is copied into the document, a const char* one would only be linked
+        // and the batch is sent after the caller's buffer is gone
+        records = m_gwBatch->createNestedArray((char *)device);
+      }
+      if (!records.add(values) || m_gwBatch->overflowed() || (measureJson(*m_gwBatch) > PayloadSize - 1)) {
+        log<TB_LOG_ERROR>("too small buffer for JSON data");
+        m_gwBatch->clear();
+        return false;
+      }
+      return true;
+    }
+
+    // Sends the queued gateway telemetry in a single publish
+    bool Gateway_Telemetry_Flush() {
+      if (!m_gwBatch || !m_gwBatch->size()) {
+        return true;
+      }
+      char buffer[PayloadSize];
+      serializeJson(*m_gwBatch, buffer, sizeof(buffer));
+      m_gwBatch->clear();
+      return m_client.publish("v1/gateway/telemetry", buffer);
+    }
+
+    // Sends client attributes of a child device
+    bool Gateway_Attributes(const char *device, const JsonObject &attributes) {
+      StaticJsonDocument<PayloadSize> requestBuffer;
+      requestBuffer[device] = attributes;
+      if (measureJson(requestBuffer) > PayloadSize - 1) {
+        log<TB_LOG_ERROR>("too small buffer for JSON data");
+        return false;
+      }
+      char buffer[PayloadSize];
+      serializeJson(requestBuffer, buffer, sizeof(buffer));
+      return m_client.publish("v1/gateway/attributes", buffer);
+    }
+
+    // Routes server RPCs sent to a child device to its callbacks, matched by method
+    // name like device RPCs. The callbacks array must stay valid.
+    bool Gateway_Subscribe(const char *device, const GenericCallback *callbacks, size_t callbacksSize) {
+      Gateway_Device *slot = NULL;
+      for (size_t i = 0; i < Default_Max_Gateway_Devices; i++) {
+        if (m_gwDevices[i].m_name && !strcmp(m_gwDevices[i].m_name, device)) {
+          slot = &m_gwDevices[i];
+          break;
+        }
+        if (!slot && !m_gwDevices[i].m_name) {
+          slot = &m_gwDevices[i];
+        }
+      }
+      if (!slot) {
+        log<TB_LOG_WARN>("Too many gateway devices");
+        return false;
+      }
+      bool first = !Gateway_Devices();
+      slot->m_name = device;
+      slot->m_callbacks = callbacks;
+      slot->m_callbacksSize = callbacksSize;
+      // Already subscribed instances only miss the gateway topic
+      if (first && m_subscribed) {
+        return m_client.subscribe("v1/gateway/rpc");
+      }
+      return true;
+    }
+
+    // Number of requests still waiting for a response
+    size_t Requests_Pending() const {
+      size_t count = 0;
+      for (size_t i = 0; i < Default_Max_Requests; i++) {
+        if (m_requests[i].m_id) {
+          count++;
+        }
+      }
+      return count;
+    }
     // -------------------------------------------------------------------------------
     // Provisioning API
 
   private:
+    // Logs a message at Level, printf-style when arguments are given
+    template<uint8_t Level, typename... Args>
+    static inline void log(const char *format, Args... args) {
+      Logger_Sink<Logger, (Level <= Logger_Level<Logger>::value)>::write(format, args...);
+    }
+
+    // True when Level is logged, guards messages whose arguments cost something to build
+    template<uint8_t Level>
+    static constexpr bool log_enabled() {
+      return Level <= Logger_Level<Logger>::value;
+    }
+
+    // Largest receive buffer the OTA download may take, half of the largest free
+    // heap block so TLS records and JSON documents still fit next to it.
+    inline uint32_t Firmware_Chunk_Heap_Limit() {
+      return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 2;
+    }
+
     // Sends single key-value in a generic way.
     template<typename T>
     bool sendKeyval(const char *key, T value, bool telemetry = true) {
@@ -483,12 +1235,12 @@ class ThingsBoardSized
         StaticJsonDocument<JSON_OBJECT_SIZE(1)>jsonBuffer;
         JsonVariant object = jsonBuffer.template to<JsonVariant>();
         if (t.serializeKeyval(object) == false) {
-          Logger::log("unable to serialize data");
+          log<TB_LOG_ERROR>("unable to serialize data");
           return false;
         }
 
         if (measureJson(jsonBuffer) > PayloadSize - 1) {
-          Logger::log("too small buffer for JSON data");
+          log<TB_LOG_ERROR>("too small buffer for JSON data");
           return false;
         }
         serializeJson(object, payload, sizeof(payload));
@@ -503,7 +1255,7 @@ class ThingsBoardSized
         StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
         DeserializationError error = deserializeJson(jsonBuffer, payload, length);
         if (error) {
-          Logger::log("unable to de-serialize RPC");
+          log<TB_LOG_ERROR>("unable to de-serialize RPC");
           return;
         }
         const JsonObject &data = jsonBuffer.template as<JsonObject>();
@@ -511,22 +1263,20 @@ class ThingsBoardSized
         const char *params = data["params"];
 
         if (methodName) {
-          Logger::log("received RPC:");
-          Logger::log(methodName);
+          log<TB_LOG_DEBUG>("received RPC: %s", methodName);
         } else {
-          Logger::log("RPC method is NULL");
+          log<TB_LOG_WARN>("RPC method is NULL");
           return;
         }
 
         for (size_t i = 0; i < sizeof(m_genericCallbacks) / sizeof(*m_genericCallbacks); ++i) {
           if (m_genericCallbacks[i].m_cb && !strcmp(m_genericCallbacks[i].m_name, methodName)) {
 
-            Logger::log("calling RPC:");
-            Logger::log(m_genericCallbacks[i].m_name);
+            log<TB_LOG_DEBUG>("calling RPC: %s", m_genericCallbacks[i].m_name);
 
             // Do not inform client, if parameter field is missing for some reason
             if (!data.containsKey("params")) {
-              Logger::log("no parameters passed with RPC, passing null JSON");
+              log<TB_LOG_DEBUG>("no parameters passed with RPC, passing null JSON");
             }
 
             // try to de-serialize params
@@ -534,12 +1284,12 @@ class ThingsBoardSized
             DeserializationError err_param = deserializeJson(doc, params);
             //if failed to de-serialize params then send JsonObject instead
             if (err_param) {
-              Logger::log("params:");
-              Logger::log(data["params"].as<String>().c_str());
+              if (log_enabled<TB_LOG_DEBUG>()) {
+                log<TB_LOG_DEBUG>("params: %s", data["params"].template as<String>().c_str());
+              }
               r = m_genericCallbacks[i].m_cb(data);
             } else {
-              Logger::log("JsonObject params:");
-              Logger::log(params);
+              log<TB_LOG_DEBUG>("JsonObject params: %s", params);
               const JsonObject &param = doc.template as<JsonObject>();
               // Getting non-existing field from JSON should automatically
               // set JSONVariant to null
@@ -556,82 +1306,536 @@ class ThingsBoardSized
       JsonVariant resp_obj = respBuffer.template to<JsonVariant>();
 
       if (r.serializeKeyval(resp_obj) == false) {
-        Logger::log("unable to serialize data");
+        log<TB_LOG_ERROR>("unable to serialize data");
         return;
       }
 
       if (measureJson(respBuffer) > PayloadSize - 1) {
-        Logger::log("too small buffer for JSON data");
+        log<TB_LOG_ERROR>("too small buffer for JSON data");
         return;
       }
       serializeJson(resp_obj, responsePayload, sizeof(responsePayload));
 
       String responseTopic = String(topic);
       responseTopic.replace("request", "response");
-      Logger::log("response:");
-      Logger::log(responsePayload);
+      log<TB_LOG_DEBUG>("response:");
+      log<TB_LOG_DEBUG>(responsePayload);
       m_client.publish(responseTopic.c_str(), responsePayload);
     }
 
     // Processes firmware response
     void process_firmware_response(char* topic, uint8_t* payload, unsigned int length) {
-      static unsigned int sizeReceive = 0;
-      static MD5Builder md5;
+      int chunk = atoi(strrchr(topic, '/') + 1);
+      log<TB_LOG_DEBUG>("Receive chunk %d, size %u bytes", chunk, length);
+
+      // Late answer to a request that was already retried or sent with another chunk size,
+      // or no download running
+      if (!m_fwWriter.isRunning() || (chunk != int(m_fwCursor.offset / m_fwCursor.chunkSize))
+        || (length != min(m_fwCursor.chunkSize, (uint32_t)(m_fwSize - m_fwCursor.offset)))) {
+        log<TB_LOG_WARN>("Unexpected chunk, ignored");
+        return;
+      }
 
-      m_fwChunkReceive = atoi(strrchr(topic, '/') + 1);
-      Logger::log(String("Receive chunk " + String(m_fwChunkReceive) + ", size " + String(length) + " bytes").c_str());
+      m_fwChunkReceive = chunk;
+      Firmware_Process(payload, length);
+    }
 
+    // Feeds the next bytes of the download into the pipeline, whatever the transport
+    void Firmware_Process(const uint8_t *payload, size_t length) {
       m_fwState = "DOWNLOADING";
 
-      if (m_fwChunkReceive == 0) {
-        sizeReceive = 0;
-        md5 = MD5Builder();
-        md5.begin();
-
-        if(Update.isRunning()){Update.abort();}
-        // Initialize Flash
-        if (!Update.begin(m_fwSize)) {
-          Logger::log("Error during Update.begin");
-          m_fwState = "UPDATE ERROR";
-          return;
-        }
-      }
-
-      // Write data to Flash
-      if (Update.write(payload, length) != length) {
-        Logger::log("Error during Update.write");
+      // Decode and write data to Flash
+      Firmware_Stage &stage = m_fwCursor.patch ? (Firmware_Stage&)m_fwPatch : (Firmware_Stage&)m_fwImage;
+      if (!((m_fwCursor.encoding == FIRMWARE_ENCODING_HEATSHRINK) ? m_fwDecoder.write(payload, length, stage) : stage.write(payload, length))) {
+        log<TB_LOG_ERROR>("Error during firmware write");
         m_fwState = "UPDATE ERROR";
+        // Go back to the last committed chunk, it is requested again
+        if (!Firmware_Restore()) {
+          Firmware_Abort();
+        }
         return;
       }
-
-      // Update value only if write flash success
-      md5.add(payload, length);
-      sizeReceive += length;
+      m_fwCursor.offset += length;
+
+      // Verify the block once its last chunk arrived, go back to its start on mismatch
+      bool blockEnd = true;
+      if (m_fwBlockSize) {
+        m_fwBlockCrc = Firmware_CRC32::crc32(m_fwBlockCrc, payload, length);
+        blockEnd = !(m_fwCursor.offset % m_fwBlockSize) || (m_fwSize <= m_fwCursor.offset);
+        if (blockEnd) {
+          uint32_t expected = 0;
+          if (!Firmware_Chunk_Crc((m_fwCursor.offset - 1) / m_fwBlockSize, expected) || (expected != m_fwBlockCrc)) {
+            log<TB_LOG_WARN>("Block CRC mismatch before offset %u", m_fwCursor.offset);
+            m_fwState = "UPDATE ERROR";
+            if (!Firmware_Restore()) {
+              Firmware_Abort();
+            }
+            return;
+          }
+          m_fwBlockCrc = 0;
+        }
+      }
 
       // Receive Full Firmware
-      if (m_fwSize == sizeReceive) {
-        md5.calculate();
-        String md5Str = md5.toString();
-        Logger::log(String("md5 compute:  " + md5Str).c_str());
-        Logger::log(String("md5 firmware: " + m_fwChecksum).c_str());
-        // Check MD5
-        if (md5Str != m_fwChecksum) {
-          Logger::log("Checksum verification failed !");
-          Update.abort();
+      if (m_fwSize <= m_fwCursor.offset) {
+        m_fwDecoder.end();
+        char digest[65];
+        m_fwHash->finish(digest);
+        m_fwCursor.clear();
+
+        log<TB_LOG_DEBUG>("checksum compute:  %s", digest);
+        log<TB_LOG_DEBUG>("checksum firmware: %s", m_fwChecksum.c_str());
+        // Check the checksum
+        if (m_fwCursor.patch && !m_fwPatch.finished()) {
+          log<TB_LOG_ERROR>("Firmware patch is truncated !");
+          m_fwWriter.abort();
+          m_fwState = "PATCH ERROR";
+        }
+        else if (!m_fwHash->verify(digest, m_fwChecksum.c_str())) {
+          log<TB_LOG_ERROR>("Checksum verification failed !");
+          m_fwWriter.abort();
           m_fwState = "CHECKSUM ERROR";
         }
         else {
-          Logger::log("Checksum is OK !");
-          if (Update.end(true)) {
-            Logger::log("Update Success !");
+          log<TB_LOG_INFO>("Checksum is OK !");
+          if (m_fwWriter.end()) {
+            log<TB_LOG_INFO>("Update Success !");
             m_fwState = "SUCCESS";
           }
           else {
-            Logger::log("Update Fail !");
+            log<TB_LOG_ERROR>("Update Fail !");
             m_fwState = "FAILED";
           }
         }
       }
+      // Commit the cursor, a retry or a reboot continues after this chunk (or verified block)
+      else if (blockEnd && !Firmware_Commit()) {
+        log<TB_LOG_ERROR>("Unable to save firmware cursor");
+      }
+    }
+
+    // Opens the pipeline for the current target, continuing an interrupted download
+    // of the same image when the persisted cursor allows it
+    bool Firmware_Begin(Firmware_Encoding encoding, uint8_t windowBits, uint8_t lookaheadBits, bool patch, Firmware_Hash_Algorithm algorithm) {
+      // Continue an interrupted download of the same image, if any
+      if (m_fwCursor.load() && m_fwCursor.matches(m_fwTitle.c_str(), m_fwVersion.c_str(), m_fwChecksum.c_str(), m_fwSize)
+        && (m_fwCursor.encoding == encoding) && (m_fwCursor.windowBits == windowBits) && (m_fwCursor.lookaheadBits == lookaheadBits)
+        && (m_fwCursor.patch == patch) && (m_fwCursor.algorithm == algorithm)
+        && !(m_fwBlockSize && (m_fwCursor.offset % m_fwBlockSize)) && Firmware_Restore()) {
+        log<TB_LOG_INFO>("Resume download at %u of %u bytes", m_fwCursor.offset, m_fwSize);
+      }
+      else {
+        log<TB_LOG_INFO>("Try to download it...");
+        m_fwCursor.reset(m_fwTitle.c_str(), m_fwVersion.c_str(), m_fwChecksum.c_str(), m_fwSize, Default_Min_Chunk_Size);
+        m_fwCursor.encoding = encoding;
+        m_fwCursor.windowBits = windowBits;
+        m_fwCursor.lookaheadBits = lookaheadBits;
+        m_fwCursor.patch = patch;
+        m_fwCursor.algorithm = algorithm;
+        m_fwHash = Firmware_Select_Hash(algorithm);
+        m_fwHash->begin();
+        if (!m_fwWriter.begin(m_fwSize)) {
+          log<TB_LOG_ERROR>("Error during Firmware_Writer.begin");
+          Firmware_Send_State("UPDATE ERROR");
+          return false;
+        }
+        if ((encoding == FIRMWARE_ENCODING_HEATSHRINK) && !m_fwDecoder.begin(windowBits, lookaheadBits)) {
+          log<TB_LOG_ERROR>("Not enough RAM");
+          m_fwWriter.abort();
+          return false;
+        }
+        if (patch) {
+          m_fwPatch.begin(esp_ota_get_running_partition(), m_fwImage);
+        }
+        strlcpy(m_fwCursor.partition, m_fwWriter.partition()->label, sizeof(m_fwCursor.partition));
+        Firmware_Commit();
+      }
+      return true;
+    }
+
+    // Largest power of two chunk the free heap allows, up to maxChunkSize. The chunk
+    // index is offset / chunk size, so the size must divide the offset.
+    uint32_t Firmware_Chunk_Size(uint32_t maxChunkSize) {
+      uint32_t chunkSize = maxChunkSize;
+      while ((chunkSize > Default_Min_Chunk_Size) &&
+        ((chunkSize + Default_Chunk_Overhead > Firmware_Chunk_Heap_Limit()) || (m_fwCursor.offset % chunkSize))) {
+        chunkSize >>= 1;
+      }
+      return chunkSize;
+    }
+
+    // Downloads the rest of the image with a single HTTP Range request. The stream is fed
+    // to the pipeline in pieces of pieceSize bytes, so commits and block CRCs stay aligned.
+    // Returns false when the transfer stopped early, the cursor tells how far it went.
+    bool Firmware_Http_Download(const String &url, uint32_t pieceSize) {
+      uint8_t *buffer = NULL;
+      while (!(buffer = (uint8_t *)malloc(pieceSize))) {
+        if (pieceSize <= Default_Min_Chunk_Size) {
+          log<TB_LOG_ERROR>("Not enough RAM");
+          return false;
+        }
+        pieceSize >>= 1;
+      }
+      m_fwCursor.chunkSize = pieceSize;
+
+      // The image is verified against the checksum received over MQTT, without a CA
+      // certificate HTTPS only protects the transfer from passive listeners.
+      WiFiClient plain;
+      WiFiClientSecure secure;
+      bool https = url.startsWith("https://");
+      if (https) {
+        if (m_fwCaCert) {
+          secure.setCACert(m_fwCaCert);
+        }
+        else {
+          secure.setInsecure();
+        }
+      }
+
+      HTTPClient http;
+      http.setTimeout(Default_Http_Timeout);
+      if (!http.begin(https ? (WiFiClient&)secure : plain, url)) {
+        log<TB_LOG_WARN>("Invalid firmware URL");
+        free(buffer);
+        return false;
+      }
+      http.addHeader("Range", String("bytes=" + String(m_fwCursor.offset) + "-" + String(m_fwSize - 1)));
+      int code = http.GET();
+      int length = http.getSize();
+      if (!((code == HTTP_CODE_PARTIAL_CONTENT) || ((code == HTTP_CODE_OK) && !m_fwCursor.offset))
+        || ((length >= 0) && ((uint32_t)length != m_fwSize - m_fwCursor.offset))) {
+        log<TB_LOG_WARN>("HTTP download refused, code %d", code);
+        http.end();
+        free(buffer);
+        return false;
+      }
+      log<TB_LOG_INFO>("HTTP download from %u of %u bytes", m_fwCursor.offset, m_fwSize);
+
+      Stream *stream = http.getStreamPtr();
+      size_t filled = 0;
+      unsigned long received = millis();
+      unsigned long serviced = received;
+      while (m_fwWriter.isRunning() && (http.connected() || stream->available())) {
+        // A fast transfer always has data ready, the MQTT session still needs its keepalives
+        if (millis() - serviced >= Default_Http_Loop_Interval) {
+          m_client.loop();
+          serviced = millis();
+        }
+        size_t piece = min(pieceSize, (uint32_t)(m_fwSize - m_fwCursor.offset));
+        size_t available = stream->available();
+        if (!available) {
+          if (millis() - received > Default_Http_Timeout) {
+            log<TB_LOG_WARN>("HTTP download stalled");
+            break;
+          }
+          delay(5);
+          m_client.loop();
+          serviced = millis();
+          continue;
+        }
+        filled += stream->readBytes(buffer + filled, min(available, piece - filled));
+        received = millis();
+        if (filled < piece) {
+          continue;
+        }
+        filled = 0;
+        Firmware_Process(buffer, piece);
+        // The pipeline went back to its last commit, the stream is ahead of it
+        if (m_fwState != "DOWNLOADING") {
+          break;
+        }
+      }
+      http.end();
+      free(buffer);
+      return !m_fwWriter.isRunning();
+    }
+
+    void Firmware_Clear_Attributes() {
+      m_fwTitle.clear();
+      m_fwVersion.clear();
+      m_fwChecksum.clear();
+      m_fwEncoding.clear();
+      m_fwPatchBase.clear();
+      m_fwChunkCrc.clear();
+      m_fwChunkCrcSize = 0;
+      m_fwUrl.clear();
+    }
+
+    // Clears the member of one fw_* attribute
+    void Firmware_Clear_Attribute(const char *key) {
+      if (!key || strncmp(key, "fw_", 3)) {
+        return;
+      }
+      key += 3;
+      if (!strcmp(key, "title"))
+        m_fwTitle.clear();
+      else if (!strcmp(key, "version"))
+        m_fwVersion.clear();
+      else if (!strcmp(key, "checksum"))
+        m_fwChecksum.clear();
+      else if (!strcmp(key, "checksum_algorithm"))
+        m_fwChecksumAlgorithm.clear();
+      else if (!strcmp(key, "size"))
+        m_fwSize = 0;
+      else if (!strcmp(key, "encoding"))
+        m_fwEncoding.clear();
+      else if (!strcmp(key, "patch_base"))
+        m_fwPatchBase.clear();
+      else if (!strcmp(key, "chunk_crc"))
+        m_fwChunkCrc.clear();
+      else if (!strcmp(key, "chunk_crc_size"))
+        m_fwChunkCrcSize = 0;
+      else if (!strcmp(key, "url"))
+        m_fwUrl.clear();
+    }
+
+    // Remembers the current target as handled, size is the image size once it is written
+    void Firmware_Settle(uint32_t size = 0) {
+      m_fwTarget.set(m_fwTitle.c_str(), m_fwVersion.c_str(), m_fwChecksum.c_str(), size);
+      if (!m_fwTarget.save()) {
+        log<TB_LOG_ERROR>("Unable to save firmware target");
+      }
+    }
+
+#ifdef USE_FW_PEER
+    // Downloads the image from a LAN peer announcing the same target. Peers serve the
+    // decoded image, so it is written without decoder, patch or block CRCs and checked
+    // against the same checksum. Returns true once the image is verified.
+    bool Firmware_Peer_Download(Firmware_Hash_Algorithm algorithm) {
+      String url;
+      uint32_t size = 0;
+      if (!Firmware_Peer::find(m_fwTitle.c_str(), m_fwVersion.c_str(), m_fwChecksum.c_str(), url, size)) {
+        return false;
+      }
+      log<TB_LOG_INFO>("Firmware found on peer %s", url.c_str());
+
+      unsigned int fwSize = m_fwSize;
+      uint32_t blockSize = m_fwBlockSize;
+      m_fwSize = size;
+      m_fwBlockSize = 0;
+      if (Firmware_Begin(FIRMWARE_ENCODING_NONE, 0, 0, false, algorithm)) {
+        Firmware_Send_State("DOWNLOADING");
+        int nbRetry = 2;
+        while (m_fwWriter.isRunning() && nbRetry) {
+          uint32_t offset = m_fwCursor.offset;
+          if (!Firmware_Http_Download(url, Firmware_Chunk_Size(Default_Max_Chunk_Size)) && (m_fwCursor.offset <= offset)) {
+            nbRetry--;
+          }
+        }
+        if (m_fwState == "SUCCESS") {
+          return true;
+        }
+        Firmware_Abort();
+      }
+      log<TB_LOG_WARN>("Peer download failed, continue with the server");
+      m_fwSize = fwSize;
+      m_fwBlockSize = blockSize;
+      m_fwState.clear();
+      return false;
+    }
+#endif
+
+    // Persists the pipeline state at the current position
+    bool Firmware_Commit() {
+      m_fwCursor.decoder = m_fwDecoder.state();
+      m_fwCursor.patchState = m_fwPatch.state();
+      return m_fwHash->save(m_fwCursor.hash, sizeof(m_fwCursor.hash)) && m_fwCursor.save();
+    }
+
+    // Reads the expected CRC32 of a block from the comma separated fw_chunk_crc list
+    bool Firmware_Chunk_Crc(uint32_t block, uint32_t &crc) {
+      const char *p = m_fwChunkCrc.c_str();
+      for (; block && p; block--) {
+        p = strchr(p, ',');
+        if (p) {
+          p++;
+        }
+      }
+      if (!p || !*p) {
+        return false;
+      }
+      crc = strtoul(p, NULL, 16);
+      return true;
+    }
+
+    // Reopens the pipeline at the position of the persisted cursor
+    bool Firmware_Restore() {
+      m_fwBlockCrc = 0;
+      if (!m_fwCursor.load() || !(m_fwHash = Firmware_Select_Hash((Firmware_Hash_Algorithm)m_fwCursor.algorithm))
+        || !m_fwHash->restore(m_fwCursor.hash, sizeof(m_fwCursor.hash))
+        || !m_fwWriter.resume(m_fwCursor.partition, m_fwSize, m_fwCursor.imageOffset)) {
+        return false;
+      }
+      if (m_fwCursor.patch) {
+        m_fwPatch.begin(esp_ota_get_running_partition(), m_fwImage);
+        m_fwPatch.restore(m_fwCursor.patchState);
+      }
+      if (m_fwCursor.encoding == FIRMWARE_ENCODING_HEATSHRINK) {
+        return m_fwDecoder.begin(m_fwCursor.windowBits, m_fwCursor.lookaheadBits)
+          && m_fwDecoder.restore(m_fwCursor.decoder, m_fwWriter.partition(), m_fwCursor.imageOffset);
+      }
+      return true;
+    }
+
+    Firmware_Hash *Firmware_Select_Hash(Firmware_Hash_Algorithm algorithm) {
+      switch (algorithm) {
+        case FIRMWARE_HASH_MD5:
+          return &m_fwMD5;
+        case FIRMWARE_HASH_SHA256:
+          return &m_fwSHA256;
+        case FIRMWARE_HASH_CRC32:
+          return &m_fwCRC32;
+        default:
+          return NULL;
+      }
+    }
+
+    // Stops the pipeline, the persisted cursor is kept for the next attempt
+    void Firmware_Abort() {
+      m_fwWriter.abort();
+      m_fwDecoder.end();
+    }
+
+    size_t Gateway_Devices() const {
+      size_t count = 0;
+      for (size_t i = 0; i < Default_Max_Gateway_Devices; i++) {
+        if (m_gwDevices[i].m_name) {
+          count++;
+        }
+      }
+      return count;
+    }
+
+    // Processes a server RPC for a child device:
+    // {"device": name, "data": {"id": id, "method": method, "params": {...}}}
+    void process_gateway_rpc_message(char* topic, uint8_t* payload, unsigned int length) {
+      callbackResponse r;
+      StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+      DeserializationError error = deserializeJson(jsonBuffer, payload, length);
+      if (error) {
+        log<TB_LOG_ERROR>("unable to de-serialize gateway RPC");
+        return;
+      }
+      const char *device = jsonBuffer["device"];
+      JsonObject data = jsonBuffer["data"];
+      const char *methodName = data["method"];
+      if (!device || !methodName) {
+        log<TB_LOG_WARN>("gateway RPC device or method is NULL");
+        return;
+      }
+      log<TB_LOG_DEBUG>("received gateway RPC: %s %s", device, methodName);
+
+      bool found = false;
+      for (size_t i = 0; (i < Default_Max_Gateway_Devices) && !found; i++) {
+        if (!m_gwDevices[i].m_name || strcmp(m_gwDevices[i].m_name, device)) {
+          continue;
+        }
+        for (size_t j = 0; j < m_gwDevices[i].m_callbacksSize; j++) {
+          const GenericCallback &callback = m_gwDevices[i].m_callbacks[j];
+          if (callback.m_cb && !strcmp(callback.m_name, methodName)) {
+            r = callback.m_cb(data["params"].template as<JsonObject>());
+            found = true;
+            break;
+          }
+        }
+      }
+      if (!found) {
+        log<TB_LOG_WARN>("no callback for gateway RPC");
+        return;
+      }
+
+      // Fill in response
+      StaticJsonDocument<JSON_OBJECT_SIZE(4)> respBuffer;
+      respBuffer["device"] = device;
+      respBuffer["id"] = data["id"];
+      JsonVariant resp_obj = respBuffer.createNestedObject("data");
+      if (r.serializeKeyval(resp_obj) == false) {
+        log<TB_LOG_ERROR>("unable to serialize data");
+        return;
+      }
+      if (measureJson(respBuffer) > PayloadSize - 1) {
+        log<TB_LOG_ERROR>("too small buffer for JSON data");
+        return;
+      }
+      char responsePayload[PayloadSize];
+      serializeJson(respBuffer, responsePayload, sizeof(responsePayload));
+      log<TB_LOG_DEBUG>("response:");
+      log<TB_LOG_DEBUG>(responsePayload);
+      m_client.publish("v1/gateway/rpc", responsePayload);
+    }
+
+    // Stores the callbacks and routes incoming messages to this instance
+    void Callbacks_Attach(const GenericCallback *callbacks, size_t callbacksSize) {
+      for (size_t i = 0; i < callbacksSize; ++i) {
+        m_genericCallbacks[i] = callbacks[i];
+      }
+      m_subscribed = true;
+      m_client.setCallback([this](char* topic, uint8_t* payload, unsigned int length) {
+        on_message(topic, payload, length);
+      });
+    }
+
+    // Takes a free slot of the request table for a new request id
+    Pending_Request *Request_Register(Response_Callback cb, unsigned long timeout) {
+      for (size_t i = 0; i < Default_Max_Requests; i++) {
+        if (!m_requests[i].m_id) {
+          // 0 marks a free slot, skip it when the counter wraps
+          if (!++m_requestId) {
+            m_requestId++;
+          }
+          m_requests[i].m_id = m_requestId;
+          m_requests[i].m_cb = cb;
+          m_requests[i].m_start = millis();
+          m_requests[i].m_timeout = timeout;
+          return &m_requests[i];
+        }
+      }
+      log<TB_LOG_WARN>("Too many pending requests");
+      return NULL;
+    }
+
+    // Releases the slot of the given request, returns its callback or NULL if the
+    // request is unknown (not ours, or already timed out)
+    Response_Callback Request_Complete(unsigned int id) {
+      for (size_t i = 0; i < Default_Max_Requests; i++) {
+        if (id && (m_requests[i].m_id == id)) {
+          m_requests[i].m_id = 0;
+          return m_requests[i].m_cb;
+        }
+      }
+      return NULL;
+    }
+
+    // Fails the requests whose response did not come in time
+    void Requests_Sweep() {
+      for (size_t i = 0; i < Default_Max_Requests; i++) {
+        if (m_requests[i].m_id && (millis() - m_requests[i].m_start >= m_requests[i].m_timeout)) {
+          unsigned int id = m_requests[i].m_id;
+          m_requests[i].m_id = 0;
+          log<TB_LOG_WARN>("Request %u timed out", id);
+          if (m_requests[i].m_cb) {
+            m_requests[i].m_cb(id, JsonObject());
+          }
+        }
+      }
+    }
+
+    // Processes the response to a request of the table, returns false if the
+    // response belongs to no pending request
+    bool process_request_response(char* topic, uint8_t* payload, unsigned int length) {
+      unsigned int id = strtoul(strrchr(topic, '/') + 1, NULL, 10);
+      Response_Callback cb = Request_Complete(id);
+      if (!cb) {
+        return false;
+      }
+      StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
+      DeserializationError error = deserializeJson(jsonBuffer, payload, length);
+      if (error) {
+        log<TB_LOG_ERROR>("Unable to de-serialize response");
+      }
+      JsonObject data = jsonBuffer.template as<JsonObject>();
+      cb(id, data);
+      return true;
     }
 
     // Processes shared attribute update message
@@ -639,21 +1843,27 @@ class ThingsBoardSized
       StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
       DeserializationError error = deserializeJson(jsonBuffer, payload, length);
       if (error) {
-        Logger::log("Unable to de-serialize Shared attribute update request");
+        log<TB_LOG_ERROR>("Unable to de-serialize Shared attribute update request");
         return;
       }
       JsonObject data = jsonBuffer.template as<JsonObject>();
 
       if (data && (data.size() >= 1)) {
-        Logger::log("Received shared attribute update request");
+        log<TB_LOG_DEBUG>("Received shared attribute update request");
         if (data["shared"]) {
           data = data["shared"];
         }
       } else {
-        Logger::log("Shared attribute update key not found.");
+        log<TB_LOG_WARN>("Shared attribute update key not found.");
         return;
       }
 
+      // Deleted attributes no longer describe the target
+      JsonArray deleted = data["deleted"];
+      for (JsonVariant key : deleted) {
+        Firmware_Clear_Attribute(key.as<const char*>());
+      }
+
       // Save data for firmware update
       if (data["fw_title"])
         m_fwTitle = data["fw_title"].as<String>();
@@ -670,37 +1880,57 @@ class ThingsBoardSized
       if (data["fw_size"])
         m_fwSize = data["fw_size"].as<int>();
 
+      if (data["fw_encoding"])
+        m_fwEncoding = data["fw_encoding"].as<String>();
+
+      if (data["fw_patch_base"])
+        m_fwPatchBase = data["fw_patch_base"].as<String>();
+
+      if (data["fw_chunk_crc"])
+        m_fwChunkCrc = data["fw_chunk_crc"].as<String>();
+
+      if (data["fw_chunk_crc_size"])
+        m_fwChunkCrcSize = data["fw_chunk_crc_size"].as<unsigned int>();
+
+      if (data["fw_url"])
+        m_fwUrl = data["fw_url"].as<String>();
+
+      // Flag an update when the target moved since it was last handled
+      if (m_fwCurrTitle && (data["fw_title"] || data["fw_version"] || data["fw_checksum"]) && !m_fwVersion.isEmpty()
+        && !m_fwTarget.matches(m_fwTitle.c_str(), m_fwVersion.c_str(), m_fwChecksum.c_str())) {
+        log<TB_LOG_INFO>("New firmware target received");
+        m_fwPending = true;
+      }
+
       if(m_genericCallbacks[0].m_cb)
       {
-        Logger::log("Calling callbacks for updated attribute:");
-        Logger::log(m_genericCallbacks[0].m_name);
+        log<TB_LOG_DEBUG>("Calling callbacks for updated attribute: %s", m_genericCallbacks[0].m_name);
         m_genericCallbacks[0].m_cb(data);
       }
     }
 
     // Processes provisioning response
     void process_provisioning_response(char* topic, uint8_t* payload, unsigned int length) {
-      Logger::log("Process provisioning response");
+      log<TB_LOG_DEBUG>("Process provisioning response");
 
       StaticJsonDocument<JSON_OBJECT_SIZE(MaxFieldsAmt)> jsonBuffer;
       DeserializationError error = deserializeJson(jsonBuffer, payload, length);
       if (error) {
-        Logger::log("Unable to de-serialize provision response");
+        log<TB_LOG_ERROR>("Unable to de-serialize provision response");
         return;
       }
 
       const JsonObject &data = jsonBuffer.template as<JsonObject>();
 
-      Logger::log("Received provision response");
+      log<TB_LOG_DEBUG>("Received provision response");
 
       if (data["status"] == "SUCCESS" && data["credentialsType"] == "X509_CERTIFICATE") {
-        Logger::log("Provision response contains X509_CERTIFICATE credentials, it is not supported yet.");
+        log<TB_LOG_WARN>("Provision response contains X509_CERTIFICATE credentials, it is not supported yet.");
         return;
       }
 
       if (m_genericCallbacks[1].m_cb) {
-        Logger::log("Calling callbacks for provisioning response:");
-        Logger::log(m_genericCallbacks[0].m_name);
+        log<TB_LOG_DEBUG>("Calling callbacks for provisioning response: %s", m_genericCallbacks[1].m_name);
         m_genericCallbacks[1].m_cb(data);
       }
     }
@@ -708,7 +1938,7 @@ class ThingsBoardSized
     // Sends array of attributes or telemetry to ThingsBoard
     bool sendDataArray(const Telemetry *data, size_t data_count, bool telemetry = true) {
       if (MaxFieldsAmt < data_count) {
-        Logger::log("too much JSON fields passed");
+        log<TB_LOG_ERROR>("too much JSON fields passed");
         return false;
       }
       char payload[PayloadSize];
@@ -718,12 +1948,12 @@ class ThingsBoardSized
 
         for (size_t i = 0; i < data_count; ++i) {
           if (data[i].serializeKeyval(object) == false) {
-            Logger::log("unable to serialize data");
+            log<TB_LOG_ERROR>("unable to serialize data");
             return false;
           }
         }
         if (measureJson(jsonBuffer) > PayloadSize - 1) {
-          Logger::log("too small buffer for JSON data");
+          log<TB_LOG_ERROR>("too small buffer for JSON data");
           return false;
         }
         serializeJson(object, payload, sizeof(payload));
@@ -735,47 +1965,94 @@ class ThingsBoardSized
     PubSubClient m_client;              // PubSub MQTT client instance.
     GenericCallback m_genericCallbacks[20];     // Generic Callbacks array
     unsigned int m_requestId;
+    bool m_subscribed;                  // Callbacks are set and messages are processed
+    unsigned long m_connectedAt;
+    Pending_Request m_requests[Default_Max_Requests];
+    Gateway_Device m_gwDevices[Default_Max_Gateway_Devices];
+    DynamicJsonDocument *m_gwBatch;     // Pending gateway telemetry, allocated on first use
 
     // For Firmware Update
-    String m_fwVersion, m_fwTitle, m_fwChecksum, m_fwChecksumAlgorithm, m_fwState;
+    String m_fwVersion, m_fwTitle, m_fwChecksum, m_fwChecksumAlgorithm, m_fwEncoding, m_fwPatchBase, m_fwChunkCrc, m_fwUrl, m_fwState;
     unsigned int m_fwSize;
+    unsigned int m_fwChunkCrcSize;
+    uint32_t m_fwBlockSize;
+    uint32_t m_fwBlockCrc;
     int m_fwChunkReceive;
-
-    // PubSub client cannot call a method when message arrives on subscribed topic.
-    // Only free-standing function is allowed.
-    // To be able to forward event to an instance, rather than to a function, this pointer exists.
-    static ThingsBoardSized *m_subscribedInstance;
+    Firmware_Cursor m_fwCursor;
+    Firmware_Writer m_fwWriter;
+    Firmware_Heatshrink m_fwDecoder;
+    Firmware_Patch m_fwPatch;
+    Firmware_MD5 m_fwMD5;
+    Firmware_SHA256 m_fwSHA256;
+    Firmware_CRC32 m_fwCRC32;
+    Firmware_Hash *m_fwHash;
+    const char *m_fwCaCert;
+    Firmware_Target m_fwTarget;
+    bool m_fwPending;
+    const char *m_fwCurrTitle;
+    const char *m_fwCurrVersion;
+#ifdef USE_FW_PEER
+    Firmware_Peer m_fwPeer;
+#endif
+
+    // Last stage of the firmware pipeline: hashes the image and writes it to flash
+    class Firmware_Image : public Firmware_Stage {
+      public:
+        inline Firmware_Image(ThingsBoardSized &tb) : m_tb(tb) { }
+        bool write(const uint8_t *data, size_t length) override {
+          if (m_tb.m_fwWriter.write(data, length) != length) {
+            return false;
+          }
+          m_tb.m_fwHash->update(data, length);
+          m_tb.m_fwCursor.imageOffset += length;
+          return true;
+        }
+      private:
+        ThingsBoardSized &m_tb;
+    } m_fwImage;
 
     // The callback for when a PUBLISH message is received from the server.
-    static void on_message(char* topic, uint8_t* payload, unsigned int length)
+    void on_message(char* topic, uint8_t* payload, unsigned int length)
     {
-        Logger::log(String("Callback on_message from topic: " + String(topic)).c_str());
-        if (!ThingsBoardSized::m_subscribedInstance){return;}
+        log<TB_LOG_DEBUG>("Callback on_message from topic: %s", topic);
+        if (!m_subscribed){return;}
 
-        if (strncmp("v1/devices/me/rpc", topic, strlen("v1/devices/me/rpc")) == 0)
+        if (strncmp("v1/devices/me/rpc/response/", topic, strlen("v1/devices/me/rpc/response/")) == 0)
+        {
+            if (!process_request_response(topic, payload, length))
+            {
+                log<TB_LOG_WARN>("RPC response without request, ignored");
+            }
+        }
+        else if (strncmp("v1/devices/me/rpc", topic, strlen("v1/devices/me/rpc")) == 0)
         {
-            ThingsBoardSized::m_subscribedInstance->process_rpc_message(topic, payload, length);
+            process_rpc_message(topic, payload, length);
+        }
+        else if ((strncmp("v1/devices/me/attributes/response/", topic, strlen("v1/devices/me/attributes/response/")) == 0)
+            && process_request_response(topic, payload, length))
+        {
+            // Answered a request of the table
         }
         else if (strncmp("v1/devices/me/attributes", topic, strlen("v1/devices/me/attributes")) == 0)
         {
-            ThingsBoardSized::m_subscribedInstance->process_shared_attribute_update_message(topic, payload, length);
+            process_shared_attribute_update_message(topic, payload, length);
+        }
+        else if (strcmp("v1/gateway/rpc", topic) == 0)
+        {
+            process_gateway_rpc_message(topic, payload, length);
         }
         else if(strncmp("/provision/response", topic, strlen("/provision/response")) == 0)
         {
-            ThingsBoardSized::m_subscribedInstance->process_provisioning_response(topic, payload, length);
+            process_provisioning_response(topic, payload, length);
         }
         else if (strncmp("v2/fw/response/", topic, strlen("v2/fw/response/")) == 0)
         {
-            ThingsBoardSized::m_subscribedInstance->process_firmware_response(topic, payload, length);
+            process_firmware_response(topic, payload, length);
         }
     }
 
 };
 
-template<size_t PayloadSize, size_t MaxFieldsAmt, typename Logger>
-ThingsBoardSized<PayloadSize, MaxFieldsAmt, Logger> *ThingsBoardSized<PayloadSize, MaxFieldsAmt, Logger>::m_subscribedInstance;
-
-
 using ThingsBoard = ThingsBoardSized<>;
 
 #endif // ThingsBoard_h
\ No newline at end of file
@@ -0,0 +1,458 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * TLS client with session resumption for the broker connection
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "tlsclient.h"
+#include <FS.h>
+#include <SPIFFS.h>
+#include <esp_attr.h>
+
+#define TLS_SESSION_MAGIC 0x544C5331  // "TLS1"
+
+// mbedTLS 3 hides the handshake state, sessions are still resumed but not counted as such
+#if !defined(MBEDTLS_VERSION_NUMBER) || (MBEDTLS_VERSION_NUMBER < 0x03000000)
+#define TLS_HANDSHAKE_OVER(ssl) ((ssl)->state == MBEDTLS_SSL_HANDSHAKE_OVER)
+#define TLS_HANDSHAKE_RESUMING(ssl, resumed) ((ssl)->handshake ? ((ssl)->handshake->resume != 0) : (resumed))
+#else
+#define TLS_HANDSHAKE_OVER(ssl) mbedtls_ssl_is_handshake_over(ssl)
+#define TLS_HANDSHAKE_RESUMING(ssl, resumed) (resumed)
+#endif
+
+// Persisted session, tagged with the server it belongs to
+struct TLS_Session_Record {
+  uint32_t magic;
+  char host[64];
+  uint16_t port;
+  uint16_t length;
+  uint8_t data[Default_TLS_Session_Size];
+};
+
+// Not cleared by software resets, checked by magic and by mbedtls_ssl_session_load
+RTC_NOINIT_ATTR static TLS_Session_Record rtcSession;
+
+TLSClient::TLSClient()
+  : m_client()
+  , m_dns(NULL)
+  , m_rootCA(NULL)
+  , m_ready(false)
+  , m_connected(false)
+  , m_peek(-1)
+  , m_inSize(Default_TLS_In_Buffer)
+  , m_outSize(Default_TLS_Out_Buffer)
+  , m_store(TLS_SESSION_RAM)
+  , m_hasSession(false)
+  , m_loaded(false)
+  , m_sessionPort(0)
+  , m_stats()
+{
+  m_sessionHost[0] = '\0';
+  mbedtls_ssl_init(&m_ssl);
+  mbedtls_ssl_config_init(&m_conf);
+  mbedtls_x509_crt_init(&m_ca);
+  mbedtls_entropy_init(&m_entropy);
+  mbedtls_ctr_drbg_init(&m_drbg);
+  mbedtls_ssl_session_init(&m_session);
+}
+
+TLSClient::~TLSClient() {
+  stop();
+  release();
+  mbedtls_ssl_session_free(&m_session);
+}
+
+void TLSClient::setCACert(const char *rootCA) {
+  stop();
+  release();
+  m_rootCA = rootCA;
+}
+
+void TLSClient::setSessionStore(TLS_Session_Store store) {
+  m_store = store;
+  m_loaded = false;
+}
+
+void TLSClient::setBufferSizes(uint16_t in, uint16_t out) {
+  stop();
+  release();
+  m_inSize = in;
+  m_outSize = out ? out : Default_TLS_Out_Buffer;
+}
+
+// The outbound size only splits writes, it never changes an allocation. Without variable
+// buffers mbedTLS keeps both record buffers at their compile time size whatever is negotiated.
+uint32_t TLSClient::memoryRequired() const {
+  uint32_t in = MBEDTLS_SSL_IN_CONTENT_LEN;
+  uint32_t out = MBEDTLS_SSL_OUT_CONTENT_LEN;
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+  uint8_t code = fragmentCode(m_inSize);
+  if (code) {
+    in = std::min(in, (uint32_t)(256 << code));
+    out = std::min(out, (uint32_t)(256 << code));
+  }
+#endif
+  return in + out + 2 * Default_TLS_Record_Overhead + Default_TLS_Handshake_Heap;
+}
+
+void TLSClient::clearSession() {
+  mbedtls_ssl_session_free(&m_session);
+  mbedtls_ssl_session_init(&m_session);
+  m_hasSession = false;
+  m_sessionHost[0] = '\0';
+  if (m_store == TLS_SESSION_RTC) {
+    rtcSession.magic = 0;
+  }
+  else if ((m_store == TLS_SESSION_FLASH) && SPIFFS.exists(Default_TLS_Session_File)) {
+    SPIFFS.remove(Default_TLS_Session_File);
+  }
+}
+
+int TLSClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip.toString().c_str(), port);
+}
+
+int TLSClient::connect(const char *host, uint16_t port) {
+  stop();
+  if (!setup()) {
+    return 0;
+  }
+  IPAddress ip;
+  if (m_dns) {
+    if (!m_dns->resolve(host, ip)) {
+      return 0;
+    }
+    if (!m_client.connect(ip, port)) {
+      // The address may be outdated, it is resolved again next time
+      m_dns->invalidate(host);
+      return 0;
+    }
+  }
+  else if (!m_client.connect(host, port)) {
+    return 0;
+  }
+  if (mbedtls_ssl_setup(&m_ssl, &m_conf) || mbedtls_ssl_set_hostname(&m_ssl, host)) {
+    stop();
+    return 0;
+  }
+  mbedtls_ssl_set_bio(&m_ssl, &m_client, bioSend, bioRecv, NULL);
+
+  if ((m_store != TLS_SESSION_RAM) && !m_loaded) {
+    m_loaded = true;
+    sessionLoad();
+  }
+  bool offered = sessionMatches(host, port) && !mbedtls_ssl_set_session(&m_ssl, &m_session);
+
+  bool resumed = false;
+  unsigned long start = millis();
+  bool result = handshake(host, resumed);
+  uint32_t elapsed = millis() - start;
+  if (!result) {
+    m_stats.failedHandshakes++;
+    // The cached session may be what the server refused
+    if (offered) {
+      clearSession();
+    }
+    stop();
+    return 0;
+  }
+
+  m_connected = true;
+  m_stats.lastHandshakeTime = elapsed;
+  m_stats.lastResumed = resumed;
+  if (resumed) {
+    m_stats.resumedHandshakes++;
+    m_stats.resumedHandshakeTime += elapsed;
+  }
+  else {
+    m_stats.fullHandshakes++;
+    m_stats.fullHandshakeTime += elapsed;
+  }
+  // Flash is only written when the session changed, a resumed one may still bring a new ticket
+  if (!resumed || (m_store != TLS_SESSION_FLASH)) {
+    sessionStore(host, port);
+  }
+  return 1;
+}
+
+size_t TLSClient::write(uint8_t data) {
+  return write(&data, 1);
+}
+
+size_t TLSClient::write(const uint8_t *buf, size_t size) {
+  if (!m_connected) {
+    return 0;
+  }
+  size_t sent = 0;
+  unsigned long start = millis();
+  while (sent < size) {
+    int ret = mbedtls_ssl_write(&m_ssl, buf + sent, std::min(size - sent, (size_t)m_outSize));
+    if (ret > 0) {
+      sent += ret;
+      continue;
+    }
+    if (((ret != MBEDTLS_ERR_SSL_WANT_READ) && (ret != MBEDTLS_ERR_SSL_WANT_WRITE))
+      || (millis() - start > Default_TLS_Handshake_Timeout)) {
+      stop();
+      break;
+    }
+    delay(1);
+  }
+  return sent;
+}
+
+int TLSClient::available() {
+  if (!m_connected) {
+    return 0;
+  }
+  // Processes the next record, if any, so its bytes become available
+  int ret = mbedtls_ssl_read(&m_ssl, NULL, 0);
+  if ((ret < 0) && (ret != MBEDTLS_ERR_SSL_WANT_READ) && (ret != MBEDTLS_ERR_SSL_WANT_WRITE)) {
+    stop();
+    return 0;
+  }
+  return mbedtls_ssl_get_bytes_avail(&m_ssl) + ((m_peek >= 0) ? 1 : 0);
+}
+
+int TLSClient::read() {
+  uint8_t data;
+  return (read(&data, 1) == 1) ? data : -1;
+}
+
+int TLSClient::read(uint8_t *buf, size_t size) {
+  if (!m_connected || !size) {
+    return -1;
+  }
+  size_t length = 0;
+  if (m_peek >= 0) {
+    buf[length++] = m_peek;
+    m_peek = -1;
+    if (length == size) {
+      return length;
+    }
+  }
+  int ret = mbedtls_ssl_read(&m_ssl, buf + length, size - length);
+  if (ret > 0) {
+    return length + ret;
+  }
+  if ((ret != MBEDTLS_ERR_SSL_WANT_READ) && (ret != MBEDTLS_ERR_SSL_WANT_WRITE)) {
+    stop();
+  }
+  return length ? length : -1;
+}
+
+int TLSClient::peek() {
+  if (m_peek < 0) {
+    uint8_t data;
+    if (read(&data, 1) == 1) {
+      m_peek = data;
+    }
+  }
+  return m_peek;
+}
+
+void TLSClient::flush() {
+}
+
+void TLSClient::stop() {
+  if (m_connected) {
+    mbedtls_ssl_close_notify(&m_ssl);
+  }
+  m_connected = false;
+  m_peek = -1;
+  mbedtls_ssl_free(&m_ssl);
+  mbedtls_ssl_init(&m_ssl);
+  m_client.stop();
+}
+
+uint8_t TLSClient::connected() {
+  if (m_connected && !m_client.connected() && !mbedtls_ssl_get_bytes_avail(&m_ssl) && (m_peek < 0)) {
+    stop();
+  }
+  return m_connected;
+}
+
+// Maximum fragment length code for an inbound buffer size, none from 16384 on
+uint8_t TLSClient::fragmentCode(uint16_t size) {
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  if (size >= Default_TLS_In_Buffer) {
+    return MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+  }
+  if (size >= 4096) {
+    return MBEDTLS_SSL_MAX_FRAG_LEN_4096;
+  }
+  if (size >= 2048) {
+    return MBEDTLS_SSL_MAX_FRAG_LEN_2048;
+  }
+  if (size >= 1024) {
+    return MBEDTLS_SSL_MAX_FRAG_LEN_1024;
+  }
+  return MBEDTLS_SSL_MAX_FRAG_LEN_512;
+#else
+  return 0;
+#endif
+}
+
+int TLSClient::bioSend(void *ctx, const unsigned char *buf, size_t len) {
+  WiFiClient *client = (WiFiClient *)ctx;
+  size_t sent = client->write(buf, len);
+  if (!sent) {
+    return client->connected() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  return sent;
+}
+
+// Never blocks, the callers poll
+int TLSClient::bioRecv(void *ctx, unsigned char *buf, size_t len) {
+  WiFiClient *client = (WiFiClient *)ctx;
+  if (!client->available()) {
+    return client->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int received = client->read(buf, len);
+  return (received > 0) ? received : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+bool TLSClient::setup() {
+  if (m_ready) {
+    return true;
+  }
+  if (mbedtls_ctr_drbg_seed(&m_drbg, mbedtls_entropy_func, &m_entropy, NULL, 0)
+    || mbedtls_ssl_config_defaults(&m_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) {
+    release();
+    return false;
+  }
+  if (m_rootCA) {
+    if (mbedtls_x509_crt_parse(&m_ca, (const unsigned char *)m_rootCA, strlen(m_rootCA) + 1)) {
+      release();
+      return false;
+    }
+    mbedtls_ssl_conf_ca_chain(&m_conf, &m_ca, NULL);
+    mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  }
+  else {
+    mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+  mbedtls_ssl_conf_rng(&m_conf, mbedtls_ctr_drbg_random, &m_drbg);
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  if (mbedtls_ssl_conf_max_frag_len(&m_conf, fragmentCode(m_inSize))) {
+    release();
+    return false;
+  }
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&m_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  m_ready = true;
+  return true;
+}
+
+void TLSClient::release() {
+  mbedtls_ssl_config_free(&m_conf);
+  mbedtls_x509_crt_free(&m_ca);
+  mbedtls_ctr_drbg_free(&m_drbg);
+  mbedtls_entropy_free(&m_entropy);
+  mbedtls_ssl_config_init(&m_conf);
+  mbedtls_x509_crt_init(&m_ca);
+  mbedtls_entropy_init(&m_entropy);
+  mbedtls_ctr_drbg_init(&m_drbg);
+  m_ready = false;
+}
+
+// Runs the handshake step by step to see whether the server accepted the offered session
+bool TLSClient::handshake(const char *host, bool &resumed) {
+  unsigned long start = millis();
+  while (!TLS_HANDSHAKE_OVER(&m_ssl)) {
+    int ret = mbedtls_ssl_handshake_step(&m_ssl);
+    resumed = TLS_HANDSHAKE_RESUMING(&m_ssl, resumed);
+    if ((ret == MBEDTLS_ERR_SSL_WANT_READ) || (ret == MBEDTLS_ERR_SSL_WANT_WRITE)) {
+      if (millis() - start > Default_TLS_Handshake_Timeout) {
+        log_e("TLS handshake with %s timed out", host);
+        return false;
+      }
+      delay(1);
+    }
+    else if (ret) {
+      log_e("TLS handshake with %s failed: -0x%04X", host, -ret);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TLSClient::sessionMatches(const char *host, uint16_t port) {
+  return m_hasSession && (m_sessionPort == port) && !strcmp(m_sessionHost, host);
+}
+
+void TLSClient::sessionStore(const char *host, uint16_t port) {
+  mbedtls_ssl_session_free(&m_session);
+  mbedtls_ssl_session_init(&m_session);
+  m_hasSession = !mbedtls_ssl_get_session(&m_ssl, &m_session);
+  if (!m_hasSession) {
+    return;
+  }
+  strlcpy(m_sessionHost, host, sizeof(m_sessionHost));
+  m_sessionPort = port;
+  if (m_store == TLS_SESSION_RAM) {
+    return;
+  }
+
+  TLS_Session_Record *record = (m_store == TLS_SESSION_RTC) ? &rtcSession : (TLS_Session_Record *)malloc(sizeof(TLS_Session_Record));
+  if (!record) {
+    return;
+  }
+  size_t length = 0;
+  record->magic = 0;
+  if (!mbedtls_ssl_session_save(&m_session, record->data, sizeof(record->data), &length)) {
+    strlcpy(record->host, host, sizeof(record->host));
+    record->port = port;
+    record->length = length;
+    record->magic = TLS_SESSION_MAGIC;
+  }
+  if (m_store == TLS_SESSION_FLASH) {
+    if (record->magic) {
+      File file = SPIFFS.open(Default_TLS_Session_File, FILE_WRITE);
+      if (file) {
+        file.write((const uint8_t *)record, offsetof(TLS_Session_Record, data) + length);
+        file.close();
+      }
+    }
+    free(record);
+  }
+}
+
+bool TLSClient::sessionLoad() {
+  TLS_Session_Record *record = &rtcSession;
+  if (m_store == TLS_SESSION_FLASH) {
+    File file = SPIFFS.open(Default_TLS_Session_File, FILE_READ);
+    if (!file) {
+      return false;
+    }
+    record = (TLS_Session_Record *)malloc(sizeof(TLS_Session_Record));
+    if (record && (file.read((uint8_t *)record, sizeof(TLS_Session_Record)) < offsetof(TLS_Session_Record, data))) {
+      record->magic = 0;
+    }
+    file.close();
+    if (!record) {
+      return false;
+    }
+  }
+
+  bool result = (record->magic == TLS_SESSION_MAGIC) && (record->length <= sizeof(record->data))
+    && (memchr(record->host, '\0', sizeof(record->host)) != NULL)
+    && !mbedtls_ssl_session_load(&m_session, record->data, record->length);
+  if (result) {
+    strlcpy(m_sessionHost, record->host, sizeof(m_sessionHost));
+    m_sessionPort = record->port;
+    m_hasSession = true;
+  }
+  else {
+    mbedtls_ssl_session_free(&m_session);
+    mbedtls_ssl_session_init(&m_session);
+  }
+  if (record != &rtcSession) {
+    free(record);
+  }
+  return result;
+}
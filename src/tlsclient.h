@@ -0,0 +1,128 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * TLS client with session resumption for the broker connection
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#ifndef tlsclient_h
+#define tlsclient_h
+
+#include <Arduino.h>
+#include <Client.h>
+#include <WiFi.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include "dnscache.h"
+
+#define Default_TLS_Session_File "/tlssess.bin"
+#define Default_TLS_Session_Size 1536   // Serialized session, includes the peer certificate
+#define Default_TLS_Handshake_Timeout 15000
+#define Default_TLS_In_Buffer 16384         // Inbound record plaintext, 16384 leaves the fragment length unnegotiated
+#define Default_TLS_Out_Buffer 4096         // Outbound record plaintext
+#define Default_TLS_Record_Overhead 512     // Header, IV, MAC and padding on top of each record buffer
+#define Default_TLS_Handshake_Heap 40000    // Peak transient heap of a full handshake (certificate chain, key exchange)
+
+// Where the last session survives besides RAM
+enum TLS_Session_Store : uint8_t {
+  TLS_SESSION_RAM,      // Lost on reboot
+  TLS_SESSION_RTC,      // Survives software resets and deep sleep, not power loss
+  TLS_SESSION_FLASH,    // Survives power loss, written to SPIFFS after full handshakes
+};
+
+// Handshake counters, durations are in milliseconds
+struct TLS_Stats {
+  uint32_t fullHandshakes;
+  uint32_t resumedHandshakes;
+  uint32_t failedHandshakes;
+  uint32_t fullHandshakeTime;       // Sum of the full handshake durations
+  uint32_t resumedHandshakeTime;    // Sum of the resumed handshake durations
+  uint32_t lastHandshakeTime;
+  bool lastResumed;
+};
+
+// mbedTLS client over a WiFiClient socket, a drop-in replacement of WiFiClientSecure
+// for PubSubClient. The session of the last handshake is kept and offered on the next
+// connect to the same host and port, so reconnects skip the certificate exchange and
+// the key agreement when the server accepts it (session ID or session ticket).
+class TLSClient : public Client
+{
+  public:
+    TLSClient();
+    ~TLSClient();
+
+    // Verifies the server against rootCA, the string must stay valid.
+    // Without CA the server is not verified.
+    void setCACert(const char *rootCA);
+    void setSessionStore(TLS_Session_Store store);
+    // Record buffer sizes, applied from the next connect. The inbound size is negotiated
+    // with the server as maximum fragment length (RFC 6066) and rounded down to 4096, 2048,
+    // 1024 or 512. The outbound size caps the plaintext of each record written.
+    void setBufferSizes(uint16_t in, uint16_t out);
+    // Heap needed to connect, full handshake included. The negotiated fragment length only
+    // counts when mbedTLS resizes its buffers (MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH).
+    uint32_t memoryRequired() const;
+    // Resolves hostnames through dns, the hostname is still used for SNI,
+    // certificate verification and session matching
+    inline void setResolver(DNSCache *dns) { m_dns = dns; }
+    // Forgets the cached session, the next connect does a full handshake.
+    void clearSession();
+    inline const TLS_Stats &stats() const { return m_stats; }
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t data) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+
+    using Print::write;
+
+  private:
+    static int bioSend(void *ctx, const unsigned char *buf, size_t len);
+    static int bioRecv(void *ctx, unsigned char *buf, size_t len);
+
+    static uint8_t fragmentCode(uint16_t size);
+
+    bool setup();
+    void release();
+    bool handshake(const char *host, bool &resumed);
+    bool sessionMatches(const char *host, uint16_t port);
+    void sessionStore(const char *host, uint16_t port);
+    bool sessionLoad();
+
+    WiFiClient m_client;
+    DNSCache *m_dns;
+    const char *m_rootCA;
+    bool m_ready;         // Configuration, CA and RNG are set up
+    bool m_connected;
+    int m_peek;
+    uint16_t m_inSize;
+    uint16_t m_outSize;
+
+    mbedtls_ssl_context m_ssl;
+    mbedtls_ssl_config m_conf;
+    mbedtls_x509_crt m_ca;
+    mbedtls_entropy_context m_entropy;
+    mbedtls_ctr_drbg_context m_drbg;
+
+    TLS_Session_Store m_store;
+    mbedtls_ssl_session m_session;
+    bool m_hasSession;
+    bool m_loaded;        // Persisted session was read back
+    char m_sessionHost[64];
+    uint16_t m_sessionPort;
+
+    TLS_Stats m_stats;
+};
+
+#endif
@@ -49,23 +49,25 @@ void loop()
   {
     if(tb.callbackSubscribe(callbacks, callbacksSize))
     {
-      sprintf_P(logBuff, PSTR("Callbacks subscribed successfuly!"));
-      recordLog(4, PSTR(__FILE__), __LINE__, PSTR(__func__));
+      LOG_I("Callbacks subscribed successfuly!");
       FLAG_IOT_SUBSCRIBE = false;
     }
+    tb.Firmware_Check(CURRENT_FIRMWARE_TITLE, CURRENT_FIRMWARE_VERSION);
+
+    syncClientAttributes();
+  }
+
+  if(tb.connected() && tb.Firmware_Pending())
+  {
     if (tb.Firmware_Update(CURRENT_FIRMWARE_TITLE, CURRENT_FIRMWARE_VERSION))
     {
-      sprintf_P(logBuff, PSTR("OTA Update finished, rebooting..."));
-      recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+      LOG_D("OTA Update finished, rebooting...");
       reboot();
     }
     else
     {
-      sprintf_P(logBuff, PSTR("Firmware up-to-date."));
-      recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+      LOG_D("Firmware not updated.");
     }
-
-    syncClientAttributes();
   }
 }
 
@@ -134,22 +136,10 @@ callbackResponse processSyncClientAttributes(const callbackData &data)
 
 callbackResponse processSharedAttributesUpdate(const callbackData &data)
 {
-  sprintf_P(logBuff, PSTR("Received shared attributes update:"));
-  recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
-  if(config.logLev >= 4){serializeJsonPretty(data, Serial);}
-
-  if(data["model"] != nullptr){strlcpy(config.model, data["model"].as<const char*>(), sizeof(config.model));}
-  if(data["group"] != nullptr){strlcpy(config.group, data["group"].as<const char*>(), sizeof(config.group));}
-  if(data["broker"] != nullptr){strlcpy(config.broker, data["broker"].as<const char*>(), sizeof(config.broker));}
-  if(data["port"] != nullptr){data["port"].as<uint16_t>();}
-  if(data["wssid"] != nullptr){strlcpy(config.wssid, data["wssid"].as<const char*>(), sizeof(config.wssid));}
-  if(data["wpass"] != nullptr){strlcpy(config.wpass, data["wpass"].as<const char*>(), sizeof(config.wpass));}
-  if(data["dssid"] != nullptr){strlcpy(config.dssid, data["dssid"].as<const char*>(), sizeof(config.dssid));}
-  if(data["dpass"] != nullptr){strlcpy(config.dpass, data["dpass"].as<const char*>(), sizeof(config.dpass));}
-  if(data["upass"] != nullptr){strlcpy(config.upass, data["upass"].as<const char*>(), sizeof(config.upass));}
-  if(data["provisionDeviceKey"] != nullptr){strlcpy(config.provisionDeviceKey, data["provisionDeviceKey"].as<const char*>(), sizeof(config.provisionDeviceKey));}
-  if(data["provisionDeviceSecret"] != nullptr){strlcpy(config.provisionDeviceSecret, data["provisionDeviceSecret"].as<const char*>(), sizeof(config.provisionDeviceSecret));}
-  if(data["logLev"] != nullptr){config.logLev = data["logLev"].as<uint8_t>();}
+  LOG_D("Received shared attributes update:");
+  if(config.logLev >= 4){serializeJsonPretty(data, console);}
+
+  configAttributesApply(data);
 
   if(data["fTeleDev"] != nullptr){mySettings.fTeleDev = data["fTeleDev"].as<bool>();}
   if(data["myTaskInterval"] != nullptr){mySettings.myTaskInterval = data["myTaskInterval"].as<unsigned long>();}
@@ -179,30 +169,20 @@ void syncClientAttributes()
   doc["sdkVer"] = ESP.getSdkVersion();
   tb.sendAttributeDoc(doc);
   doc.clear();
-  doc["model"] = config.model;
-  doc["group"] = config.group;
-  doc["broker"] = config.broker;
-  doc["port"] = config.port;
-  doc["wssid"] = config.wssid;
-  tb.sendAttributeDoc(doc);
-  doc.clear();
-  doc["wpass"] = config.wpass;
-  doc["dssid"] = config.dssid;
-  doc["dpass"] = config.dpass;
-  doc["upass"] = config.upass;
-  doc["accessToken"] = config.accessToken;
-  doc["provisionDeviceKey"] = config.provisionDeviceKey;
-  doc["provisionDeviceSecret"] = config.provisionDeviceSecret;
-  doc["logLev"] = config.logLev;
   doc["fTeleDev"] = mySettings.fTeleDev;
   doc["myTaskInterval"] = mySettings.myTaskInterval;
-
   tb.sendAttributeDoc(doc);
   doc.clear();
+
+  configAttributesSend();
 }
 
 void publishDeviceTelemetry()
 {
+  if(!tb.connected() || tb.provisioning())
+  {
+    return;
+  }
   StaticJsonDocument<DOCSIZE> doc;
 
   doc["heap"] = heap_caps_get_free_size(MALLOC_CAP_8BIT);;
@@ -214,6 +194,5 @@ void publishDeviceTelemetry()
 
 void myTask()
 {
-  sprintf_P(logBuff, PSTR("I'm executing myTask every %ld."), mySettings.myTaskInterval);
-  recordLog(5, PSTR(__FILE__), __LINE__, PSTR(__func__));
+  LOG_D("I'm executing myTask every %ld.", mySettings.myTaskInterval);
 }
\ No newline at end of file
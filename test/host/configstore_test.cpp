@@ -0,0 +1,341 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Host test and benchmark of the config store against a file backed SPIFFS
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "configstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define BENCH_KEYS 40
+#define BENCH_UPDATES 2000
+#define BENCH_LOADS 200
+
+typedef std::vector<uint8_t> Bytes;
+typedef std::map<std::string, std::string> Model;
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { \
+  printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+static const char *files[] = { "/cfgkv0.bin", "/cfgkv1.bin" };
+
+static void wipe() {
+  SPIFFS.remove(files[0]);
+  SPIFFS.remove(files[1]);
+}
+
+// The file of the slot in use, -1 unless exactly one exists
+static int active() {
+  bool first = SPIFFS.exists(files[0]);
+  bool second = SPIFFS.exists(files[1]);
+  return (first != second) ? (second ? 1 : 0) : -1;
+}
+
+static Bytes readFile(const char *name) {
+  Bytes data;
+  File file = SPIFFS.open(name, FILE_READ);
+  uint8_t buffer[256];
+  size_t length;
+  while ((length = file.read(buffer, sizeof(buffer))) > 0) {
+    data.insert(data.end(), buffer, buffer + length);
+  }
+  return data;
+}
+
+static void writeFile(const char *name, const Bytes &data, size_t length) {
+  File file = SPIFFS.open(name, FILE_WRITE);
+  file.write(data.data(), length);
+  file.close();
+}
+
+static bool matches(ConfigStore &store, const Model &model) {
+  if (store.count() != model.size()) {
+    return false;
+  }
+  for (const auto &pair : model) {
+    char value[Default_Config_Value_Size + 1];
+    if (!store.getString(pair.first.c_str(), value, sizeof(value)) || (pair.second != value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void set(ConfigStore &store, Model &model, const std::string &key, const std::string &value) {
+  CHECK(store.setString(key.c_str(), value.c_str()));
+  model[key] = value;
+}
+
+static void remove(ConfigStore &store, Model &model, const std::string &key) {
+  CHECK(store.remove(key.c_str()));
+  model.erase(key);
+}
+
+static void testReload() {
+  wipe();
+  Model model;
+  {
+    ConfigStore store;
+    CHECK(store.begin());
+    CHECK(active() == 1);
+    set(store, model, "name", "udawa");
+    set(store, model, "broker", "prita.undiknas.ac.id");
+    uint32_t port = 1883;
+    CHECK(store.set("port", port));
+    CHECK(store.get("port", port) && (port == 1883));
+    uint16_t narrow;
+    CHECK(!store.get("port", narrow));
+    CHECK(!store.exists("missing"));
+
+    // An unchanged value is not written again
+    uint32_t written = store.stats().written;
+    set(store, model, "name", "udawa");
+    CHECK((store.stats().written == written) && (store.stats().skipped == 1));
+  }
+  {
+    // Nothing is read before the first use
+    ConfigStore store;
+    CHECK(store.stats().loadTime == 0);
+    uint32_t port = 0;
+    CHECK(store.get("port", port) && (port == 1883));
+    CHECK(store.exists("broker") && store.exists("name"));
+    remove(store, model, "broker");
+    CHECK(!store.exists("broker"));
+  }
+  {
+    ConfigStore store;
+    CHECK(!store.exists("broker"));
+    CHECK(store.count() == 2);
+    CHECK(store.clear());
+    CHECK(store.count() == 0);
+  }
+  {
+    ConfigStore store;
+    CHECK(store.count() == 0);
+    CHECK(active() >= 0);
+  }
+}
+
+// Overwrites pile up until loop() compacts, the values survive it and a reload
+static void testCompaction() {
+  wipe();
+  Model model;
+  ConfigStore store;
+  for (int i = 0; i < 10; i++) {
+    set(store, model, "key" + std::to_string(i), "initial");
+  }
+  uint32_t peak = 0;
+  for (int i = 0; store.stats().compactions < 3; i++) {
+    set(store, model, "key" + std::to_string(i % 10), "value " + std::to_string(i));
+    peak = std::max(peak, store.version().size);
+    uint32_t generation = store.version().generation;
+    store.loop();
+    if (store.version().generation != generation) {
+      CHECK(store.version().size < Default_Config_Store_Size / 2);
+      CHECK(matches(store, model));
+    }
+  }
+  CHECK(peak > Default_Config_Store_Size);
+  CHECK(active() >= 0);
+  ConfigStore reloaded;
+  CHECK(matches(reloaded, model));
+}
+
+// A log cut at any byte, as by a power loss during an append, loads as the state after the
+// last whole record. A write after such a load stays readable on the next boot.
+static void testTruncatedLog() {
+  wipe();
+  std::vector<std::pair<uint32_t, Model>> checkpoints;
+  Model model;
+  {
+    ConfigStore store;
+    CHECK(store.begin());
+    checkpoints.push_back(std::make_pair(store.version().size, model));
+    for (int i = 0; i < 12; i++) {
+      set(store, model, "key" + std::to_string(i), std::string(i * 7 % 40 + 1, 'a' + i));
+      checkpoints.push_back(std::make_pair(store.version().size, model));
+    }
+    set(store, model, "key3", "overwritten");
+    checkpoints.push_back(std::make_pair(store.version().size, model));
+    remove(store, model, "key5");
+    checkpoints.push_back(std::make_pair(store.version().size, model));
+    set(store, model, "key5", "back");
+    checkpoints.push_back(std::make_pair(store.version().size, model));
+    set(store, model, "long", std::string(Default_Config_Value_Size, 'z'));
+    checkpoints.push_back(std::make_pair(store.version().size, model));
+  }
+  int slot = active();
+  CHECK(slot >= 0);
+  Bytes log = readFile(files[slot]);
+  CHECK(log.size() == checkpoints.back().first);
+
+  uint32_t checked = 0;
+  for (size_t length = 0; length <= log.size(); length++) {
+    Model expected;
+    for (const auto &checkpoint : checkpoints) {
+      if (checkpoint.first <= length) {
+        expected = checkpoint.second;
+      }
+    }
+    wipe();
+    writeFile(files[slot], log, length);
+    {
+      ConfigStore store;
+      bool intact = matches(store, expected);
+      CHECK(intact);
+      CHECK(store.setString("after", "cut"));
+      expected["after"] = "cut";
+      checked += intact;
+    }
+    ConfigStore store;
+    CHECK(matches(store, expected));
+    CHECK(active() >= 0);
+  }
+  printf("truncated log: %u of %zu cut points load the last whole record\n", checked, log.size() + 1);
+}
+
+// A compaction cut short leaves the older sealed file in charge
+static void testTruncatedCompaction() {
+  wipe();
+  Model model;
+  int slot;
+  Bytes old;
+  Bytes compacted;
+  {
+    ConfigStore store;
+    for (int i = 0; i < 20; i++) {
+      set(store, model, "key" + std::to_string(i), "first " + std::to_string(i));
+    }
+    for (int i = 0; i < 20; i += 2) {
+      set(store, model, "key" + std::to_string(i), "second " + std::to_string(i));
+    }
+    remove(store, model, "key7");
+    slot = active();
+    old = readFile(files[slot]);
+    CHECK(store.compact());
+    CHECK(active() == (slot ^ 1));
+    compacted = readFile(files[slot ^ 1]);
+  }
+  CHECK(compacted.size() < old.size());
+
+  for (size_t length = 0; length <= compacted.size(); length++) {
+    wipe();
+    writeFile(files[slot], old, old.size());
+    writeFile(files[slot ^ 1], compacted, length);
+    ConfigStore store;
+    CHECK(matches(store, model));
+    CHECK(active() == ((length == compacted.size()) ? (slot ^ 1) : slot));
+  }
+}
+
+// Value of a key of the bench, numbers like most of the config and a few strings
+static std::string benchValue(int key, uint32_t seed) {
+  if (key % 4 == 0) {
+    char text[25];
+    snprintf(text, sizeof(text), "value-%018u", seed);
+    return text;
+  }
+  return std::string((const char *)&seed, sizeof(seed));
+}
+
+static void benchmark() {
+  wipe();
+  Model model;
+  ConfigStore store;
+  std::vector<std::string> keys;
+  for (int i = 0; i < BENCH_KEYS; i++) {
+    keys.push_back("field" + std::to_string(i));
+    std::string value = benchValue(i, i);
+    CHECK(store.set(keys[i].c_str(), value.data(), value.size()));
+    model[keys[i]] = value;
+  }
+  Config_Stats base = store.stats();
+  CHECK(store.compact());
+  uint32_t image = store.version().size;
+
+  uint32_t seed = 1;
+  for (int i = 0; i < BENCH_UPDATES; i++) {
+    seed = seed * 1103515245u + 12345u;
+    int key = (seed >> 16) % BENCH_KEYS;
+    std::string value = benchValue(key, seed);
+    CHECK(store.set(keys[key].c_str(), value.data(), value.size()));
+    model[keys[key]] = value;
+    store.loop();
+  }
+  const Config_Stats &stats = store.stats();
+  uint32_t updated = stats.updated - base.updated;
+  uint32_t written = stats.written - base.written;
+  double amplification = (double)written / updated;
+  printf("%d updates of %d keys: %u value bytes changed, %u bytes written, %.1fx, %u compactions\n",
+    BENCH_UPDATES, BENCH_KEYS, updated, written, amplification, stats.compactions);
+  printf("rewriting the %u byte store per update would write %u bytes, %.1fx\n",
+    image, image * BENCH_UPDATES, (double)image * BENCH_UPDATES / updated);
+  // Each record carries its header and key, compaction adds the rest
+  CHECK(amplification < 8.0);
+
+  // Load time of the compacted store and of a log grown to the compaction threshold
+  for (int grown = 0; grown < 2; grown++) {
+    if (grown) {
+      while (store.version().size < Default_Config_Store_Size) {
+        seed = seed * 1103515245u + 12345u;
+        int key = (seed >> 16) % BENCH_KEYS;
+        std::string value = benchValue(key, seed);
+        CHECK(store.set(keys[key].c_str(), value.data(), value.size()));
+        model[keys[key]] = value;
+      }
+    }
+    else {
+      CHECK(store.compact());
+    }
+    uint32_t size = store.version().size;
+    uint64_t total = 0;
+    uint32_t slowest = 0;
+    for (int i = 0; i < BENCH_LOADS; i++) {
+      ConfigStore loaded;
+      CHECK(loaded.begin());
+      total += loaded.stats().loadTime;
+      slowest = std::max(slowest, loaded.stats().loadTime);
+      CHECK(loaded.count() == BENCH_KEYS);
+    }
+    printf("loading a %u byte log: %.1f us mean, %u us max\n", size, (double)total / BENCH_LOADS, slowest);
+  }
+
+  ConfigStore reloaded;
+  for (const auto &pair : model) {
+    uint8_t value[Default_Config_Value_Size];
+    CHECK(reloaded.get(pair.first.c_str(), value, pair.second.size()) && !memcmp(value, pair.second.data(), pair.second.size()));
+  }
+}
+
+int main() {
+  char root[] = "/tmp/configstoreXXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  SPIFFSFS::root() = root;
+
+  testReload();
+  testCompaction();
+  testTruncatedLog();
+  testTruncatedCompaction();
+  benchmark();
+
+  wipe();
+  rmdir(root);
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("configstore: all checks passed\n");
+  return 0;
+}
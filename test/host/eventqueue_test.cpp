@@ -0,0 +1,122 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Host stress test of the event queue with several producer threads
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "eventqueue.h"
+#include <stdio.h>
+#include <vector>
+
+#define PRODUCERS 4
+#define EVENTS 200000             // Per producer
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { \
+  printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// A full queue refuses the push and counts it, the events already queued stay intact
+static void testOverflow() {
+  EventQueue queue;
+  for (uint32_t i = 0; i < Default_Event_Queue_Size; i++) {
+    CHECK(queue.push(EVENT_WIFI_DISCONNECTED, i));
+  }
+  CHECK(!queue.push(EVENT_WIFI_GOT_IP));
+  CHECK(queue.stats().overflows == 1);
+
+  Event event;
+  for (uint32_t i = 0; i < Default_Event_Queue_Size; i++) {
+    CHECK(queue.pop(event));
+    CHECK(event.type == EVENT_WIFI_DISCONNECTED && event.reason == i);
+  }
+  CHECK(!queue.pop(event));
+  CHECK(queue.push(EVENT_WIFI_GOT_IP));
+  CHECK(queue.pop(event) && event.type == EVENT_WIFI_GOT_IP);
+}
+
+// Producers retry refused pushes, so every event arrives once and in the order of its
+// producer. The type carries the producer, the reason a sequence number.
+static void testStress() {
+  static EventQueue queue;
+  std::vector<std::thread> producers;
+  for (uint8_t p = 0; p < PRODUCERS; p++) {
+    producers.emplace_back([p]() {
+      for (uint32_t i = 0; i < EVENTS; i++) {
+        while (!queue.push(p, (uint8_t)i)) {
+          yield();
+        }
+      }
+    });
+  }
+
+  uint32_t received[PRODUCERS] = {0};
+  uint32_t total = 0;
+  uint32_t misordered = 0;
+  uint64_t latency = 0;
+  Event event;
+  while (total < PRODUCERS * EVENTS) {
+    if (!queue.pop(event)) {
+      yield();
+      continue;
+    }
+    if ((event.type >= PRODUCERS) || (event.reason != (uint8_t)received[event.type])) {
+      misordered++;
+    }
+    if (event.type < PRODUCERS) {
+      received[event.type]++;
+    }
+    latency += queue.stats().lastLatency;
+    total++;
+  }
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+
+  CHECK(misordered == 0);
+  for (uint8_t p = 0; p < PRODUCERS; p++) {
+    CHECK(received[p] == EVENTS);
+  }
+  CHECK(!queue.pop(event));
+  Event_Stats stats = queue.stats();
+  CHECK(stats.handled == PRODUCERS * EVENTS);
+  printf("%u events from %u producers, %u pushes refused while full\n", stats.handled, PRODUCERS, stats.overflows);
+  printf("latency from push to pop: mean %.1f us, max %u us\n", (double)latency / total, stats.maxLatency);
+}
+
+// Latency of a lone event, the case of a WiFi callback and an idle loop
+static void testLatency() {
+  EventQueue queue;
+  std::atomic<bool> done(false);
+  std::thread consumer([&]() {
+    Event event;
+    while (!done.load()) {
+      if (!queue.pop(event)) {
+        yield();
+      }
+    }
+  });
+  for (int i = 0; i < 1000; i++) {
+    queue.push(EVENT_WIFI_GOT_IP);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  done.store(true);
+  consumer.join();
+  Event_Stats stats = queue.stats();
+  CHECK(stats.handled == 1000);
+  printf("single events: last latency %u us, max %u us\n", stats.lastLatency, stats.maxLatency);
+}
+
+int main() {
+  testOverflow();
+  testStress();
+  testLatency();
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("eventqueue: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,264 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Host test of the delta firmware applier against a file backed partition
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "fwpatch.h"
+#include <stdio.h>
+#include <vector>
+
+typedef std::vector<uint8_t> Bytes;
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { \
+  printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// Collects the reconstructed image, optionally failing after limit bytes
+class Sink : public Firmware_Stage
+{
+  public:
+    Sink(size_t limit = SIZE_MAX) : m_limit(limit) { }
+    bool write(const uint8_t *data, size_t length) override {
+      if (output.size() + length > m_limit) {
+        return false;
+      }
+      output.insert(output.end(), data, data + length);
+      return true;
+    }
+    Bytes output;
+
+  private:
+    size_t m_limit;
+};
+
+// Running partition holding the base image
+class Partition
+{
+  public:
+    Partition(const Bytes &image) {
+      m_partition.size = image.size();
+      strcpy(m_partition.label, "app0");
+      m_partition.file = tmpfile();
+      fwrite(image.data(), 1, image.size(), m_partition.file);
+      fflush(m_partition.file);
+    }
+    ~Partition() { fclose(m_partition.file); }
+    inline const esp_partition_t *get() const { return &m_partition; }
+
+  private:
+    esp_partition_t m_partition;
+};
+
+static uint32_t fnv1a(const Bytes &data) {
+  uint32_t hash = 2166136261u;
+  for (uint8_t b : data) {
+    hash = (hash ^ b) * 16777619u;
+  }
+  return hash;
+}
+
+static Bytes random(size_t size, uint32_t seed) {
+  Bytes data(size);
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245u + 12345u;
+    data[i] = seed >> 16;
+  }
+  return data;
+}
+
+static void varint(Bytes &out, uint32_t value) {
+  while (value >= 0x80) {
+    out.push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(value);
+}
+
+// Builds a patch and the image it produces from records of
+// (diff length, extra length, adjustment), diff bytes change every 97th byte
+struct Record {
+  uint32_t diff;
+  uint32_t extra;
+  int32_t adjustment;
+};
+
+static void build(const Bytes &base, const std::vector<Record> &records, Bytes &patch, Bytes &image) {
+  uint32_t size = 0;
+  for (const Record &record : records) {
+    size += record.diff + record.extra;
+  }
+  patch.assign({'U', 'D', 'P', '1'});
+  varint(patch, size);
+  image.clear();
+  uint32_t source = 0;
+  uint32_t seed = 7;
+  for (const Record &record : records) {
+    varint(patch, record.diff);
+    for (uint32_t i = 0; i < record.diff; i++, source++) {
+      uint8_t delta = (i % 97) ? 0 : (uint8_t)(i / 97 + 1);
+      patch.push_back(delta);
+      image.push_back(base[source] + delta);
+    }
+    varint(patch, record.extra);
+    Bytes extra = random(record.extra, seed++);
+    patch.insert(patch.end(), extra.begin(), extra.end());
+    image.insert(image.end(), extra.begin(), extra.end());
+    varint(patch, record.adjustment < 0 ? ((uint32_t)(-record.adjustment - 1) << 1) | 1 : (uint32_t)record.adjustment << 1);
+    source += record.adjustment;
+  }
+}
+
+// Feeds the patch in pieces of the given sizes, cycling through them
+static bool apply(Firmware_Patch &patcher, const Bytes &patch, size_t length, const std::vector<size_t> &pieces) {
+  size_t offset = 0;
+  for (size_t i = 0; offset < length; i++) {
+    size_t piece = std::min(pieces[i % pieces.size()], length - offset);
+    if (!patcher.write(patch.data() + offset, piece)) {
+      return false;
+    }
+    offset += piece;
+  }
+  return true;
+}
+
+static void testKnownVector() {
+  const char *text = "hello world";
+  Bytes base(text, text + strlen(text));
+  Partition partition(base);
+  // "hello " from the base, its "w" turned into "t" by a diff of -3, then "here!" as extra
+  const uint8_t patch[] = {'U', 'D', 'P', '1', 12, 7, 0, 0, 0, 0, 0, 0, 0xfd, 5, 'h', 'e', 'r', 'e', '!', 0};
+  Sink sink;
+  Firmware_Patch patcher;
+  patcher.begin(partition.get(), sink);
+  CHECK(patcher.write(patch, sizeof(patch)));
+  CHECK(patcher.finished());
+  CHECK(sink.output == Bytes((const uint8_t *)"hello there!", (const uint8_t *)"hello there!" + 12));
+}
+
+static const std::vector<Record> records = {
+  {20000, 100, 500},
+  {30000, 0, -10000},
+  {5000, 3000, 0},
+  {0, 64, 0},
+};
+
+static void testGenerated() {
+  Bytes base = random(65536, 1);
+  Partition partition(base);
+  Bytes patch, image;
+  build(base, records, patch, image);
+  // Pins the generator, the image checks below would otherwise pass on any output
+  CHECK(fnv1a(image) == 0xe0c0b436);
+
+  const std::vector<std::vector<size_t>> feeds = {{patch.size()}, {1}, {512}, {3, 1000, 17, 4096}};
+  for (const std::vector<size_t> &pieces : feeds) {
+    Sink sink;
+    Firmware_Patch patcher;
+    patcher.begin(partition.get(), sink);
+    CHECK(apply(patcher, patch, patch.size(), pieces));
+    CHECK(patcher.finished());
+    CHECK(fnv1a(sink.output) == fnv1a(image));
+    CHECK(sink.output == image);
+  }
+  printf("generated patch: %zu bytes for a %zu byte image, hash %08x\n", patch.size(), image.size(), fnv1a(image));
+}
+
+// A second applier restored from the state taken mid stream continues the same image
+static void testResume() {
+  Bytes base = random(65536, 1);
+  Partition partition(base);
+  Bytes patch, image;
+  build(base, records, patch, image);
+
+  for (size_t cut : {(size_t)3, (size_t)4, (size_t)9, patch.size() / 3, patch.size() / 2, patch.size() - 1}) {
+    Sink sink;
+    Firmware_Patch first;
+    first.begin(partition.get(), sink);
+    CHECK(first.write(patch.data(), cut));
+    Firmware_Patch second;
+    second.begin(partition.get(), sink);
+    second.restore(first.state());
+    CHECK(second.write(patch.data() + cut, patch.size() - cut));
+    CHECK(second.finished());
+    CHECK(sink.output == image);
+  }
+}
+
+// A cut patch never reports a finished image and only ever produces a prefix of it
+static void testTruncated() {
+  Bytes base = random(65536, 1);
+  Partition partition(base);
+  Bytes patch, image;
+  build(base, records, patch, image);
+
+  for (size_t length = 0; length < patch.size(); length += (length < 64) ? 1 : 509) {
+    Sink sink;
+    Firmware_Patch patcher;
+    patcher.begin(partition.get(), sink);
+    patcher.write(patch.data(), length);
+    CHECK(!patcher.finished());
+    CHECK(sink.output.size() < image.size());
+    CHECK(std::equal(sink.output.begin(), sink.output.end(), image.begin()));
+  }
+}
+
+static bool applyCorrupt(const Bytes &base, const Bytes &patch, size_t sinkLimit = SIZE_MAX) {
+  Partition partition(base);
+  Sink sink(sinkLimit);
+  Firmware_Patch patcher;
+  patcher.begin(partition.get(), sink);
+  return patcher.write(patch.data(), patch.size()) && patcher.finished();
+}
+
+static void testCorrupt() {
+  Bytes base = random(65536, 1);
+  Bytes patch, image;
+  build(base, records, patch, image);
+  CHECK(applyCorrupt(base, patch));
+
+  // Wrong magic
+  Bytes bad = patch;
+  bad[3] = '2';
+  CHECK(!applyCorrupt(base, bad));
+
+  // More diff bytes than the announced image size
+  bad.assign({'U', 'D', 'P', '1', 4, 8, 0, 0, 0, 0, 0, 0, 0, 0});
+  CHECK(!applyCorrupt(base, bad));
+
+  // Source position past the end of the running partition
+  bad.assign({'U', 'D', 'P', '1', 8, 0, 0});
+  varint(bad, 65536 << 1);
+  varint(bad, 8);
+  bad.insert(bad.end(), 8, 0);
+  CHECK(!applyCorrupt(base, bad));
+
+  // Varint longer than five bytes
+  bad.assign({'U', 'D', 'P', '1', 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01});
+  CHECK(!applyCorrupt(base, bad));
+
+  // A flash write error stops the applier
+  CHECK(!applyCorrupt(base, patch, image.size() / 2));
+
+  // Padding after the last record is ignored
+  Bytes padded = patch;
+  padded.insert(padded.end(), 16, 0xff);
+  CHECK(applyCorrupt(base, padded));
+}
+
+int main() {
+  testKnownVector();
+  testGenerated();
+  testResume();
+  testTruncated();
+  testCorrupt();
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("fwpatch: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,95 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Host benchmark of the cost of a suppressed log call
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include "loglevel.h"
+
+#define CALLS 10000000
+
+struct {
+  uint8_t logLev;
+} config;
+
+static char line[192];
+static uint32_t evaluated = 0;
+static uint32_t written = 0;
+
+void logWrite(uint8_t level, const char* fileName, int lineNumber, const char* functionName, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  written++;
+}
+
+static const char *argument() {
+  evaluated++;
+  return "sensor";
+}
+
+// A call site of each kind, kept out of line like a call site in the firmware
+__attribute__((noinline)) static void gated(int i) {
+  LOG_D("Reading %d from %s", i, argument());
+}
+
+__attribute__((noinline)) static void beyondFloor(int i) {
+  LOG_AT(LOG_LEVEL_MAX + 1, "Reading %d from %s", i, argument());
+}
+
+// The former front end, formatted into a buffer before the level was checked
+__attribute__((noinline)) static void formattedFirst(int i) {
+  snprintf(line, sizeof(line), "Reading %d from %s", i, argument());
+  if (5 <= config.logLev) {
+    written++;
+  }
+}
+
+template<typename Site> static double nsPerCall(Site site) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < CALLS; i++) {
+    site(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / CALLS;
+}
+
+int main() {
+  int failed = 0;
+
+  config.logLev = 1;
+  double suppressed = nsPerCall(gated);
+  if (evaluated || written) {
+    printf("suppressed calls evaluated %u arguments and wrote %u lines\n", evaluated, written);
+    failed++;
+  }
+
+  config.logLev = 255;
+  nsPerCall(beyondFloor);
+  if (evaluated || written) {
+    printf("calls above LOG_LEVEL_MAX evaluated %u arguments and wrote %u lines\n", evaluated, written);
+    failed++;
+  }
+
+  config.logLev = 1;
+  double formatted = nsPerCall(formattedFirst);
+  evaluated = 0;
+
+  config.logLev = 5;
+  double admitted = nsPerCall(gated);
+  if (evaluated != CALLS || written != CALLS) {
+    printf("admitted calls evaluated %u arguments and wrote %u lines\n", evaluated, written);
+    failed++;
+  }
+
+  printf("suppressed LOG_D:              %6.1f ns per call\n", suppressed);
+  printf("formatted first, then dropped: %6.1f ns per call\n", formatted);
+  printf("admitted LOG_D (vsnprintf):    %6.1f ns per call\n", admitted);
+  return failed ? 1 : 0;
+}
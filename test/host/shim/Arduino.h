@@ -0,0 +1,51 @@
+// Host stand-in for the parts of Arduino.h used by the portable modules
+#ifndef host_arduino_h
+#define host_arduino_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#define PSTR(s) (s)
+
+using std::min;
+using std::max;
+
+inline uint32_t micros() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint32_t millis() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void yield() {
+  std::this_thread::yield();
+}
+
+// Part of newlib on the device, glibc only has it from 2.38
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+inline size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t length = strlen(src);
+  if (size) {
+    size_t n = std::min(length, size - 1);
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return length;
+}
+#endif
+
+#define log_e(format, ...) fprintf(stderr, "[E] " format "\n", ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,49 @@
+// Host stand-in for the Print, Stream and Client interfaces of the Arduino core
+#ifndef host_client_h
+#define host_client_h
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+class Print
+{
+  public:
+    virtual ~Print() { }
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+      size_t n = 0;
+      while (size-- && write(*buffer++)) {
+        n++;
+      }
+      return n;
+    }
+    size_t write(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    virtual void flush() { }
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+class Client : public Stream
+{
+  public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+};
+
+#endif
@@ -0,0 +1,62 @@
+// Host stand-in for FS.h, a File is a stdio file shared by its copies like on the device
+#ifndef host_fs_h
+#define host_fs_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode { SeekSet = SEEK_SET, SeekCur = SEEK_CUR, SeekEnd = SEEK_END };
+
+class File
+{
+  public:
+    File() { }
+    explicit File(FILE *file) : m_file(file ? std::make_shared<Handle>(file) : std::shared_ptr<Handle>()) { }
+
+    size_t read(uint8_t *buffer, size_t size) { return *this ? fread(buffer, 1, size, m_file->file) : 0; }
+    size_t write(const uint8_t *buffer, size_t size) { return *this ? fwrite(buffer, 1, size, m_file->file) : 0; }
+    bool seek(uint32_t position, SeekMode mode = SeekSet) { return *this && !fseek(m_file->file, position, mode); }
+    size_t position() const { return *this ? ftell(m_file->file) : 0; }
+    size_t size() const {
+      if (!*this) {
+        return 0;
+      }
+      long position = ftell(m_file->file);
+      fseek(m_file->file, 0, SEEK_END);
+      long size = ftell(m_file->file);
+      fseek(m_file->file, position, SEEK_SET);
+      return size;
+    }
+    void flush() {
+      if (*this) {
+        fflush(m_file->file);
+      }
+    }
+    void close() {
+      if (*this) {
+        fclose(m_file->file);
+        m_file->file = NULL;
+      }
+    }
+    operator bool() const { return m_file && m_file->file; }
+
+  private:
+    // Closed with the last copy
+    struct Handle {
+      Handle(FILE *file) : file(file) { }
+      ~Handle() {
+        if (file) {
+          fclose(file);
+        }
+      }
+      FILE *file;
+    };
+    std::shared_ptr<Handle> m_file;
+};
+
+#endif
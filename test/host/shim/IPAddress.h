@@ -0,0 +1,33 @@
+// Host stand-in for IPAddress.h, the address is kept in network order like on the device
+#ifndef host_ipaddress_h
+#define host_ipaddress_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <string>
+
+class IPAddress
+{
+  public:
+    IPAddress() : m_address(0) { }
+    IPAddress(uint32_t address) : m_address(address) { }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+      uint8_t bytes[4] = { a, b, c, d };
+      memcpy(&m_address, bytes, 4);
+    }
+    bool fromString(const char *text) { return inet_pton(AF_INET, text, &m_address) == 1; }
+    operator uint32_t() const { return m_address; }
+    std::string toString() const {
+      const uint8_t *bytes = (const uint8_t *)&m_address;
+      char text[16];
+      snprintf(text, sizeof(text), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+      return text;
+    }
+
+  private:
+    uint32_t m_address;
+};
+
+#endif
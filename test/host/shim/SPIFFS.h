@@ -0,0 +1,33 @@
+// Host stand-in for SPIFFS.h, paths are files in a directory of the host
+#ifndef host_spiffs_h
+#define host_spiffs_h
+
+#include "FS.h"
+#include <string>
+
+class SPIFFSFS
+{
+  public:
+    // Shared by every translation unit
+    static std::string &root() {
+      static std::string path = ".";
+      return path;
+    }
+    File open(const char *path, const char *mode) {
+      return File(fopen((root() + path).c_str(), mode));
+    }
+    bool exists(const char *path) {
+      FILE *file = fopen((root() + path).c_str(), "r");
+      if (file) {
+        fclose(file);
+      }
+      return file != NULL;
+    }
+    bool remove(const char *path) {
+      return ::remove((root() + path).c_str()) == 0;
+    }
+};
+
+static SPIFFSFS SPIFFS;
+
+#endif
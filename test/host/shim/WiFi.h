@@ -0,0 +1,115 @@
+// Host stand-in for WiFi.h, a WiFiClient is a POSIX socket and names go to the host resolver
+#ifndef host_wifi_h
+#define host_wifi_h
+
+#include <Arduino.h>
+#include <Client.h>
+#include <IPAddress.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class WiFiClass
+{
+  public:
+    // No DNS server of its own, resolving falls back to hostByName()
+    IPAddress dnsIP(uint8_t index = 0) { return IPAddress(); }
+    int hostByName(const char *host, IPAddress &ip) {
+      addrinfo hints = {};
+      addrinfo *result = NULL;
+      hints.ai_family = AF_INET;
+      if (getaddrinfo(host, NULL, &hints, &result) || !result) {
+        return 0;
+      }
+      ip = IPAddress(((sockaddr_in *)result->ai_addr)->sin_addr.s_addr);
+      freeaddrinfo(result);
+      return 1;
+    }
+};
+
+static WiFiClass WiFi;
+
+// Reads never block, as the TLS client polls like it does on the device
+class WiFiClient : public Client
+{
+  public:
+    WiFiClient() : m_socket(-1), m_closed(false) { }
+    ~WiFiClient() { stop(); }
+
+    int connect(IPAddress ip, uint16_t port) override {
+      stop();
+      sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      address.sin_port = htons(port);
+      address.sin_addr.s_addr = ip;
+      m_socket = socket(AF_INET, SOCK_STREAM, 0);
+      if ((m_socket < 0) || ::connect(m_socket, (sockaddr *)&address, sizeof(address))) {
+        stop();
+        return 0;
+      }
+      int one = 1;
+      setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      m_closed = false;
+      return 1;
+    }
+    int connect(const char *host, uint16_t port) override {
+      IPAddress ip;
+      return WiFi.hostByName(host, ip) ? connect(ip, port) : 0;
+    }
+    size_t write(uint8_t data) override { return write(&data, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override {
+      ssize_t sent = (m_socket >= 0) ? send(m_socket, buffer, size, MSG_NOSIGNAL) : -1;
+      if (sent < 0) {
+        m_closed = true;
+        return 0;
+      }
+      return sent;
+    }
+    int available() override {
+      int length = 0;
+      if ((m_socket < 0) || ioctl(m_socket, FIONREAD, &length)) {
+        return 0;
+      }
+      if (!length) {
+        uint8_t data;
+        ssize_t peeked = recv(m_socket, &data, 1, MSG_PEEK | MSG_DONTWAIT);
+        m_closed = m_closed || (peeked == 0) || ((peeked < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK));
+      }
+      return length;
+    }
+    int read() override {
+      uint8_t data;
+      return (read(&data, 1) == 1) ? data : -1;
+    }
+    int read(uint8_t *buffer, size_t size) override {
+      ssize_t received = (m_socket >= 0) ? recv(m_socket, buffer, size, MSG_DONTWAIT) : -1;
+      if (received == 0) {
+        m_closed = true;
+      }
+      return (received > 0) ? received : -1;
+    }
+    int peek() override {
+      uint8_t data;
+      return ((m_socket >= 0) && (recv(m_socket, &data, 1, MSG_PEEK | MSG_DONTWAIT) == 1)) ? data : -1;
+    }
+    void flush() override { }
+    void stop() override {
+      if (m_socket >= 0) {
+        close(m_socket);
+      }
+      m_socket = -1;
+      m_closed = false;
+    }
+    uint8_t connected() override { return (m_socket >= 0) && (!m_closed || available()); }
+    operator bool() override { return connected(); }
+
+  private:
+    int m_socket;
+    bool m_closed;
+};
+
+#endif
@@ -0,0 +1,21 @@
+// Host stand-in for WiFiUdp.h, nothing is sent as WiFi.dnsIP() names no server
+#ifndef host_wifiudp_h
+#define host_wifiudp_h
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+class WiFiUDP
+{
+  public:
+    int beginPacket(IPAddress ip, uint16_t port) { return 0; }
+    size_t write(const uint8_t *buffer, size_t size) { return 0; }
+    int endPacket() { return 0; }
+    int parsePacket() { return 0; }
+    int read(uint8_t *buffer, size_t size) { return 0; }
+    IPAddress remoteIP() { return IPAddress(); }
+    uint16_t remotePort() { return 0; }
+    void stop() { }
+};
+
+#endif
@@ -0,0 +1,7 @@
+// Host stand-in for esp_attr.h, there is no RTC memory
+#ifndef host_esp_attr_h
+#define host_esp_attr_h
+
+#define RTC_NOINIT_ATTR
+
+#endif
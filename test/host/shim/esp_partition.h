@@ -0,0 +1,26 @@
+// Host stand-in for esp_partition.h, a partition is backed by a file
+#ifndef host_esp_partition_h
+#define host_esp_partition_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+struct esp_partition_t {
+  uint32_t size;
+  char label[17];
+  FILE *file;
+};
+
+inline esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size) {
+  if (offset + size > partition->size || fseek(partition->file, offset, SEEK_SET)
+    || fread(dst, 1, size, partition->file) != size) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * UDAWA - Universal Digital Agriculture Watering Assistant
+ * Host test of TLS session resumption against a local openssl s_server
+ * Licensed under aGPLv3
+ * Researched and developed by PRITA Research Group & Narin Laboratory
+ * prita.undiknas.ac.id | narin.co.id
+**/
+
+#include "tlsclient.h"
+#include <SPIFFS.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <string>
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { \
+  printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+static const char *openssl;
+static std::string root;
+static uint16_t port;
+static pid_t server = -1;
+
+// A port nothing listens on, taken from the kernel
+static uint16_t freePort() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  bind(fd, (sockaddr *)&address, sizeof(address));
+  getsockname(fd, (sockaddr *)&address, &length);
+  close(fd);
+  return ntohs(address.sin_port);
+}
+
+static void stopServer() {
+  if (server > 0) {
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+  }
+  server = -1;
+}
+
+// A new process starts without the session cache and ticket key of the one before
+static bool startServer() {
+  stopServer();
+  std::string accept = "127.0.0.1:" + std::to_string(port);
+  std::string cert = root + "/cert.pem";
+  std::string key = root + "/key.pem";
+  server = fork();
+  if (!server) {
+    freopen("/dev/null", "w", stdout);
+    execl(openssl, openssl, "s_server", "-accept", accept.c_str(), "-cert", cert.c_str(), "-key", key.c_str(),
+      "-tls1_2", "-www", "-quiet", (char *)NULL);
+    _exit(127);
+  }
+  for (int i = 0; i < 100; i++) {
+    WiFiClient probe;
+    if (probe.connect(IPAddress(127, 0, 0, 1), port)) {
+      return true;
+    }
+    delay(50);
+  }
+  return false;
+}
+
+static std::string readText(const std::string &path) {
+  std::string text;
+  FILE *file = fopen(path.c_str(), "r");
+  char buffer[256];
+  size_t length;
+  while (file && (length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    text.append(buffer, length);
+  }
+  if (file) {
+    fclose(file);
+  }
+  return text;
+}
+
+// Runs a request over the connection so the records are exercised, not only the handshake
+static bool request(TLSClient &client) {
+  client.write((const uint8_t *)"GET / HTTP/1.0\r\n\r\n", 18);
+  char reply[13] = { 0 };
+  size_t length = 0;
+  unsigned long start = millis();
+  while ((length < sizeof(reply) - 1) && (millis() - start < 5000)) {
+    int n = client.available() ? client.read((uint8_t *)reply + length, sizeof(reply) - 1 - length) : 0;
+    length += (n > 0) ? n : 0;
+    if (n <= 0) {
+      delay(1);
+    }
+  }
+  return !strncmp(reply, "HTTP/1.0 200", 12);
+}
+
+static void testResume(const std::string &ca) {
+  TLSClient client;
+  client.setCACert(ca.c_str());
+  CHECK(client.connect("localhost", port));
+  CHECK(request(client));
+  client.stop();
+  CHECK((client.stats().fullHandshakes == 1) && !client.stats().lastResumed);
+
+  for (uint32_t i = 1; i <= 3; i++) {
+    CHECK(client.connect("localhost", port));
+    CHECK(request(client));
+    client.stop();
+    CHECK(client.stats().resumedHandshakes == i);
+    CHECK(client.stats().lastResumed);
+  }
+  CHECK(client.stats().fullHandshakes == 1);
+  printf("full handshake %u ms, resumed %u ms on average\n", client.stats().fullHandshakeTime,
+    client.stats().resumedHandshakeTime / client.stats().resumedHandshakes);
+
+  // Another server does not know the session, the client falls back to a full handshake
+  CHECK(startServer());
+  CHECK(client.connect("localhost", port));
+  CHECK(request(client));
+  client.stop();
+  CHECK(client.stats().fullHandshakes == 2);
+  CHECK(client.stats().resumedHandshakes == 3);
+  CHECK(client.stats().failedHandshakes == 0);
+  CHECK(!client.stats().lastResumed);
+
+  // The session of the new server is the one offered from now on
+  CHECK(client.connect("localhost", port));
+  client.stop();
+  CHECK(client.stats().resumedHandshakes == 4);
+}
+
+// A session written to flash is resumed by the next client, as after a reboot
+static void testFlashStore(const std::string &ca) {
+  CHECK(startServer());
+  {
+    TLSClient client;
+    client.setCACert(ca.c_str());
+    client.setSessionStore(TLS_SESSION_FLASH);
+    client.clearSession();
+    CHECK(client.connect("localhost", port));
+    client.stop();
+    CHECK(client.stats().fullHandshakes == 1);
+  }
+  TLSClient client;
+  client.setCACert(ca.c_str());
+  client.setSessionStore(TLS_SESSION_FLASH);
+  CHECK(client.connect("localhost", port));
+  CHECK(request(client));
+  client.stop();
+  CHECK(client.stats().resumedHandshakes == 1);
+  CHECK(client.stats().fullHandshakes == 0);
+}
+
+// The certificate does not name the address, every handshake fails
+static void testVerification(const std::string &ca) {
+  TLSClient client;
+  client.setCACert(ca.c_str());
+  CHECK(!client.connect("127.0.0.1", port));
+  CHECK(client.stats().failedHandshakes == 1);
+  CHECK(!client.connect("127.0.0.1", port));
+  CHECK(client.stats().failedHandshakes == 2);
+}
+
+int main(int argc, char **argv) {
+  openssl = (argc > 1) ? argv[1] : "openssl";
+  char directory[] = "/tmp/tlsclientXXXXXX";
+  if (!mkdtemp(directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  root = directory;
+  SPIFFSFS::root() = root;
+  std::string command = std::string(openssl) + " req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1"
+    " -subj /CN=localhost -keyout " + root + "/key.pem -out " + root + "/cert.pem 2>/dev/null";
+  if (system(command.c_str())) {
+    printf("could not create the server certificate with %s\n", openssl);
+    return 1;
+  }
+  std::string ca = readText(root + "/cert.pem");
+  port = freePort();
+  if (!startServer()) {
+    printf("openssl s_server did not start\n");
+    stopServer();
+    return 1;
+  }
+
+  testResume(ca);
+  testFlashStore(ca);
+  testVerification(ca);
+
+  stopServer();
+  system(("rm -rf " + root).c_str());
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("tlsclient: all checks passed\n");
+  return 0;
+}